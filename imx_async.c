@@ -0,0 +1,723 @@
+/**
+ * \file	imx_usb_console/imx_async.c
+ * \date	2026-Oct-16
+ * \author	Andre Renaud
+ * \copyright	Aiotec Ltd/Bluewater Systems
+ * \brief       Non-blocking requests, so that a single event loop can drive
+ *              many devices at once
+ * \description
+ * Each request is broken down into SDP commands, which are run one at a
+ * time. A command's transfers are all submitted up front (the HAB & status
+ * reads ahead of the command and data reports), and the transfer callbacks
+ * move it along, so nothing ever waits on the device. The callbacks are
+ * made by the transport from imx_async_dispatch.
+ * Requests which finish are moved to a list of completed requests, and
+ * their callbacks are only made from imx_async_dispatch. This covers
+ * requests which fail while they are being submitted, so a callback never
+ * runs inside an imx_async_xxx request function.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "imx_async.h"
+#include "imx_transport.h"
+
+#define min(a,b) (((a) < (b)) ? (a) : (b))
+
+/* Data reports in flight at once */
+#define ASYNC_OUT_DEPTH 4
+/* Interrupt IN reports in flight at once */
+#define ASYNC_IN_DEPTH 8
+/* Largest READ_REGISTER command */
+#define ASYNC_READ_MAX (64 * 1024)
+
+enum {
+    REQ_WRITE_REG,
+    REQ_WRITE_BULK,
+    REQ_READ_BULK,
+    REQ_DCD,
+    REQ_JUMP,
+};
+
+/* What an IN transfer is waiting for */
+enum {
+    IN_HAB,
+    IN_STATUS,
+    IN_DATA,
+};
+
+struct request {
+    struct request *next;
+    int type;           /* REQ_xxx */
+    uint32_t addr;
+    uint32_t value;
+    int width;
+    const uint8_t *data;
+    uint8_t *result;
+    int length;
+    const struct imx_dcd *dcd;
+    int pos;            /* Progress through the request */
+    uint8_t ivt[IMX_JUMP_IVT_SIZE];
+    int status;         /* Once it has completed */
+    imx_async_cb callback;
+    void *user_data;
+};
+
+struct slot {
+    struct imx_async *a;
+    struct imx_transfer *xfer;
+    int busy;
+    int kind;           /* IN_xxx */
+    uint8_t data[1025];
+};
+
+struct imx_async {
+    struct imx_device *h;
+    const struct imx_transport_ops *ops;
+    void *priv;
+
+    struct request *head, *tail;
+    struct request *done, *done_tail;   /* Callbacks still to be made */
+    int pending;
+    int running;        /* Inside async_run */
+
+    /* Command in progress, for the request at the head of the queue */
+    int active;
+    struct sdp_command cmd;
+    const uint8_t *out_data;    /* Sent as data reports after the command */
+    int out_len, out_sent;
+    uint8_t *in_data;           /* READ_REGISTER: where the data goes */
+    int in_len, in_requested, in_done, in_reads;
+    uint32_t expected;          /* Status word, or 0 if there is none */
+    int jump;
+    int hab_ok, status_ok;
+    int error;
+    int inflight;
+
+    struct slot cmd_slot;
+    struct slot out[ASYNC_OUT_DEPTH];
+    struct slot in[ASYNC_IN_DEPTH];
+    uint8_t dcd_buffer[DCD_MAX_BYTES];
+};
+
+static void async_run(struct imx_async *a);
+
+/**
+ * Move the request at the head of the queue to the completed list. Its
+ * callback is made from imx_async_dispatch
+ */
+static void request_done(struct imx_async *a, int result)
+{
+    struct request *r = a->head;
+
+    a->head = r->next;
+    if (!a->head)
+        a->tail = NULL;
+    r->next = NULL;
+    r->status = result;
+    if (a->done_tail)
+        a->done_tail->next = r;
+    else
+        a->done = r;
+    a->done_tail = r;
+}
+
+static int slot_submit(struct imx_async *a, struct slot *s, int type,
+        int length, imx_transfer_cb callback)
+{
+    struct imx_transfer *xfer = s->xfer;
+    int e;
+
+    xfer->type = type;
+    xfer->endpoint = 0;
+    xfer->buffer = s->data;
+    xfer->length = length;
+    xfer->actual_length = 0;
+    xfer->status = 0;
+    xfer->callback = callback;
+    xfer->user_data = s;
+    e = a->ops->submit(a->priv, xfer);
+    if (e < 0)
+        return e;
+    s->busy = 1;
+    a->inflight++;
+    return 0;
+}
+
+static struct slot *free_slot(struct slot *slots, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+        if (!slots[i].busy)
+            return &slots[i];
+    return NULL;
+}
+
+/**
+ * Abandon the current command, cancelling everything still in flight. It
+ * completes once the cancelled transfers have drained
+ */
+static void async_fail(struct imx_async *a, int e)
+{
+    int i;
+
+    if (a->error)
+        return;
+    a->error = e;
+    if (a->cmd_slot.busy)
+        a->ops->cancel(a->priv, a->cmd_slot.xfer);
+    for (i = 0; i < ASYNC_OUT_DEPTH; i++)
+        if (a->out[i].busy)
+            a->ops->cancel(a->priv, a->out[i].xfer);
+    for (i = 0; i < ASYNC_IN_DEPTH; i++)
+        if (a->in[i].busy)
+            a->ops->cancel(a->priv, a->in[i].xfer);
+}
+
+static void out_callback(struct imx_transfer *xfer);
+static void in_callback(struct imx_transfer *xfer);
+
+/**
+ * Keep the data reports flowing
+ */
+static int send_data(struct imx_async *a)
+{
+    struct slot *s;
+    int e;
+
+    while (a->out_sent < a->out_len &&
+            (s = free_slot(a->out, ASYNC_OUT_DEPTH))) {
+        int this_len = min(1024, a->out_len - a->out_sent);
+
+        s->data[0] = 2;
+        memcpy(&s->data[1], a->out_data + a->out_sent, this_len);
+        e = slot_submit(a, s, IMX_TRANSFER_SET_REPORT, this_len + 1,
+                out_callback);
+        if (e < 0)
+            return e;
+        a->out_sent += this_len;
+    }
+    return 0;
+}
+
+/**
+ * Keep enough data reads queued to collect the rest of a READ_REGISTER
+ */
+static int request_reads(struct imx_async *a)
+{
+    struct slot *s;
+    int e;
+
+    for (;;) {
+        /* Short reports mean we need more than we've asked for */
+        if (a->in_requested >= a->in_len && !a->in_reads)
+            a->in_requested = a->in_done;
+        if (a->in_requested >= a->in_len ||
+                !(s = free_slot(a->in, ASYNC_IN_DEPTH)))
+            return 0;
+        s->kind = IN_DATA;
+        e = slot_submit(a, s, IMX_TRANSFER_READ, 65, in_callback);
+        if (e < 0)
+            return e;
+        a->in_requested += 64;
+        a->in_reads++;
+    }
+}
+
+/**
+ * Finish the current command once all its transfers are done
+ */
+static void command_check(struct imx_async *a)
+{
+    int e = a->error;
+
+    if (!a->active || a->inflight)
+        return;
+    a->active = 0;
+
+    if (!e && (!a->hab_ok || (a->expected && !a->status_ok) ||
+                a->in_done < a->in_len || a->out_sent < a->out_len))
+        e = -EIO;
+    /* The rest of the request is abandoned */
+    if (e < 0)
+        request_done(a, e);
+    async_run(a);
+}
+
+static void out_callback(struct imx_transfer *xfer)
+{
+    struct slot *s = xfer->user_data;
+    struct imx_async *a = s->a;
+    int e = imx_device_link_result(a->h, xfer->status);
+
+    s->busy = 0;
+    a->inflight--;
+    if (!a->error) {
+        if (e >= 0)
+            e = send_data(a);
+        if (e < 0)
+            async_fail(a, e);
+    }
+    command_check(a);
+}
+
+static void in_callback(struct imx_transfer *xfer)
+{
+    struct slot *s = xfer->user_data;
+    struct imx_async *a = s->a;
+    int e = imx_device_link_result(a->h, xfer->status);
+
+    s->busy = 0;
+    a->inflight--;
+    if (s->kind == IN_DATA)
+        a->in_reads--;
+    if (a->error)
+        goto out;
+    if (e < 0) {
+        async_fail(a, e);
+        goto out;
+    }
+
+    switch (s->kind) {
+    case IN_HAB:
+        e = imx_check_hab(s->data, xfer->actual_length);
+        a->hab_ok = e >= 0;
+        /* The ROM stops talking once it has jumped */
+        if (a->hab_ok && a->jump)
+            imx_device_link_result(a->h, LIBUSB_ERROR_NO_DEVICE);
+        break;
+    case IN_STATUS:
+        e = imx_check_status(s->data, xfer->actual_length, a->expected);
+        a->status_ok = e >= 0;
+        break;
+    case IN_DATA:
+        if (xfer->actual_length > 1) {
+            int this_len = min(a->in_len - a->in_done,
+                    xfer->actual_length - 1);
+            memcpy(a->in_data + a->in_done, &s->data[1], this_len);
+            a->in_done += this_len;
+        }
+        e = request_reads(a);
+        break;
+    }
+    if (e < 0)
+        async_fail(a, e);
+
+out:
+    command_check(a);
+}
+
+/**
+ * Submit all of the transfers for a command
+ */
+static void command_start(struct imx_async *a)
+{
+    struct slot *s;
+    int e;
+
+    a->active = 1;
+    a->out_sent = 0;
+    a->in_requested = a->in_done = a->in_reads = 0;
+    a->hab_ok = a->status_ok = 0;
+    a->error = 0;
+
+    /* Responses first, so they're waiting when the device replies */
+    s = &a->in[0];
+    s->kind = IN_HAB;
+    e = slot_submit(a, s, IMX_TRANSFER_READ, 65, in_callback);
+    if (e >= 0 && a->expected) {
+        s = &a->in[1];
+        s->kind = IN_STATUS;
+        e = slot_submit(a, s, IMX_TRANSFER_READ, 65, in_callback);
+    } else if (e >= 0) {
+        e = request_reads(a);
+    }
+
+    if (e >= 0) {
+        memcpy(a->cmd_slot.data, &a->cmd, sizeof(a->cmd));
+        e = slot_submit(a, &a->cmd_slot, IMX_TRANSFER_SET_REPORT,
+                sizeof(a->cmd), out_callback);
+    }
+    if (e >= 0)
+        e = send_data(a);
+
+    if (e < 0) {
+        fprintf(stderr, "%s: unable to submit transfer: %s\n",
+                imx_name(a->h), libusb_error_name(e));
+        async_fail(a, e);
+    }
+    command_check(a);
+}
+
+/**
+ * Work out the next command a request needs
+ * @return < 0 on failure, 0 if the request has finished, otherwise 1
+ */
+static int request_next(struct imx_async *a, struct request *r)
+{
+    struct sdp_command *cmd = &a->cmd;
+    int len;
+
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->report_id = 1;
+    a->out_data = NULL;
+    a->out_len = 0;
+    a->in_data = NULL;
+    a->in_len = 0;
+    a->expected = 0;
+    a->jump = 0;
+
+    switch (r->type) {
+    case REQ_WRITE_REG:
+        if (r->pos)
+            return 0;
+        cmd->command_type = SDP_WRITE_REGISTER;
+        cmd->address = htonl(r->addr);
+        cmd->format = r->width;
+        cmd->data_count = htonl(1);
+        cmd->data = htonl(r->value);
+        a->expected = STATUS_WRITE_COMPLETE;
+        r->pos = 1;
+        return 1;
+
+    case REQ_WRITE_BULK:
+        if (r->pos >= r->length)
+            return 0;
+        if (imx_get_write_mode(a->h) == IMX_WRITE_STREAM)
+            len = min(imx_get_write_window(a->h), r->length - r->pos);
+        else
+            len = min(1024, r->length - r->pos);
+        cmd->command_type = SDP_WRITE_FILE;
+        cmd->address = htonl(r->addr + r->pos);
+        cmd->data_count = htonl(len);
+        a->out_data = r->data + r->pos;
+        a->out_len = len;
+        a->expected = STATUS_FILE_COMPLETE;
+        r->pos += len;
+        return 1;
+
+    case REQ_READ_BULK:
+        if (r->pos >= r->length)
+            return 0;
+        len = min(ASYNC_READ_MAX, r->length - r->pos);
+        cmd->command_type = SDP_READ_REGISTER;
+        cmd->address = htonl(r->addr + r->pos);
+        cmd->format = 0x08;
+        cmd->data_count = htonl(len);
+        a->in_data = r->result + r->pos;
+        a->in_len = len;
+        r->pos += len;
+        return 1;
+
+    case REQ_DCD:
+        if (r->pos >= r->dcd->count)
+            return 0;
+        len = imx_dcd_encode(r->dcd, &r->pos, a->dcd_buffer);
+        cmd->command_type = SDP_DCD_WRITE;
+        cmd->address = htonl(imx_get_dcd_address(a->h));
+        cmd->data_count = htonl(len);
+        a->out_data = a->dcd_buffer;
+        a->out_len = len;
+        a->expected = STATUS_WRITE_COMPLETE;
+        return 1;
+
+    case REQ_JUMP:
+        if (r->pos == 0) {
+            /* Write a pretend IVT header just ahead of the code */
+            cmd->command_type = SDP_WRITE_FILE;
+            cmd->address = htonl(r->addr);
+            cmd->data_count = htonl(sizeof(r->ivt));
+            a->out_data = r->ivt;
+            a->out_len = sizeof(r->ivt);
+            a->expected = STATUS_FILE_COMPLETE;
+        } else if (r->pos == 1) {
+            cmd->command_type = SDP_JUMP_ADDRESS;
+            cmd->address = htonl(r->addr);
+            a->jump = 1;
+        } else {
+            return 0;
+        }
+        r->pos++;
+        return 1;
+    }
+    return -EINVAL;
+}
+
+/**
+ * Start the next command, completing requests as they run out of commands
+ */
+static void async_run(struct imx_async *a)
+{
+    if (a->running)
+        return;
+    a->running = 1;
+    while (!a->active && a->head) {
+        struct request *r = a->head;
+        int e = request_next(a, r);
+
+        if (e > 0 && !imx_connected(a->h))
+            e = -ENODEV;
+        if (e > 0) {
+            command_start(a);
+            continue;
+        }
+        request_done(a, e);
+    }
+    a->running = 0;
+}
+
+static int async_submit(struct imx_async *a, struct request *r,
+        imx_async_cb callback, void *user_data)
+{
+    r->callback = callback;
+    r->user_data = user_data;
+    if (a->tail)
+        a->tail->next = r;
+    else
+        a->head = r;
+    a->tail = r;
+    a->pending++;
+    async_run(a);
+    return 0;
+}
+
+/**
+ * Create a request, checking that the boot ROM accepts it
+ * @param cap IMX_CAP_xxx flag the request needs
+ * @param what Description of the request, for the error message
+ * @return < 0 on failure, >= 0 on success
+ */
+static int request_alloc(struct imx_async *a, int type, unsigned int cap,
+        const char *what, struct request **r)
+{
+    if (!(imx_soc(a->h)->caps & cap)) {
+        fprintf(stderr, "%s does not support %s\n", imx_soc(a->h)->name,
+                what);
+        return -EOPNOTSUPP;
+    }
+    *r = calloc(1, sizeof(**r));
+    if (!*r)
+        return -ENOMEM;
+    (*r)->type = type;
+    return 0;
+}
+
+int imx_async_write_reg(struct imx_async *a, uint32_t addr, uint32_t value,
+        int width, imx_async_cb callback, void *user_data)
+{
+    struct request *r;
+    int e;
+
+    if (width != 8 && width != 16 && width != 32)
+        return -EINVAL;
+    e = request_alloc(a, REQ_WRITE_REG, IMX_CAP_REGISTERS,
+            "register writes", &r);
+    if (e < 0)
+        return e;
+    r->addr = addr;
+    r->value = value;
+    r->width = width;
+    return async_submit(a, r, callback, user_data);
+}
+
+int imx_async_write_bulk(struct imx_async *a, uint32_t addr,
+        const uint8_t *data, int length, imx_async_cb callback,
+        void *user_data)
+{
+    struct request *r;
+    int e;
+
+    e = request_alloc(a, REQ_WRITE_BULK, IMX_CAP_REGISTERS, "bulk writes",
+            &r);
+    if (e < 0)
+        return e;
+    r->addr = addr;
+    r->data = data;
+    r->length = length;
+    return async_submit(a, r, callback, user_data);
+}
+
+int imx_async_read_bulk(struct imx_async *a, uint32_t addr, uint8_t *result,
+        int count, imx_async_cb callback, void *user_data)
+{
+    struct request *r;
+    int e;
+
+    e = request_alloc(a, REQ_READ_BULK, IMX_CAP_REGISTERS, "memory reads",
+            &r);
+    if (e < 0)
+        return e;
+    r->addr = addr;
+    r->result = result;
+    r->length = count;
+    return async_submit(a, r, callback, user_data);
+}
+
+int imx_async_dcd(struct imx_async *a, const struct imx_dcd *dcd,
+        imx_async_cb callback, void *user_data)
+{
+    struct request *r;
+    int e;
+
+    e = request_alloc(a, REQ_DCD, IMX_CAP_DCD_WRITE, "DCD writes", &r);
+    if (e < 0)
+        return e;
+    r->dcd = dcd;
+    return async_submit(a, r, callback, user_data);
+}
+
+int imx_async_jump(struct imx_async *a, uint32_t addr,
+        imx_async_cb callback, void *user_data)
+{
+    struct request *r;
+    int e;
+
+    e = request_alloc(a, REQ_JUMP, IMX_CAP_JUMP, "jumps", &r);
+    if (e < 0)
+        return e;
+    r->addr = imx_jump_ivt(addr, r->ivt);
+    return async_submit(a, r, callback, user_data);
+}
+
+int imx_async_pollfds(struct imx_async *a, struct pollfd *fds, int max)
+{
+    if (!a->ops->pollfds)
+        return 0;
+    return a->ops->pollfds(a->priv, fds, max);
+}
+
+int imx_async_timeout(struct imx_async *a)
+{
+    if (a->done)
+        return 0;
+    if (!a->inflight)
+        return -1;
+    return a->ops->next_timeout(a->priv);
+}
+
+/**
+ * Make the callbacks of the requests which have completed. Requests made
+ * from these callbacks which complete straight away wait for the next
+ * dispatch
+ */
+static void deliver(struct imx_async *a)
+{
+    struct request *r = a->done;
+
+    a->done = a->done_tail = NULL;
+    while (r) {
+        struct request *next = r->next;
+
+        a->pending--;
+        r->callback(a, r->status, r->user_data);
+        free(r);
+        r = next;
+    }
+}
+
+int imx_async_dispatch(struct imx_async *a)
+{
+    int e = 0;
+
+    if (a->inflight)
+        e = imx_transport_poll_events(a->ops, a->priv);
+    deliver(a);
+    return e;
+}
+
+int imx_async_pending(struct imx_async *a)
+{
+    return a->pending;
+}
+
+struct imx_device *imx_async_device(struct imx_async *a)
+{
+    return a->h;
+}
+
+static void slot_free(struct imx_async *a, struct slot *s)
+{
+    if (!s->xfer)
+        return;
+    if (s->xfer->priv)
+        a->ops->release(a->priv, s->xfer);
+    free(s->xfer);
+}
+
+static int slot_init(struct imx_async *a, struct slot *s)
+{
+    s->a = a;
+    s->xfer = calloc(1, sizeof(*s->xfer));
+    if (!s->xfer)
+        return -ENOMEM;
+    s->xfer->dev = a->h;
+    return 0;
+}
+
+void imx_async_destroy(struct imx_async *a)
+{
+    struct request *r;
+    int i;
+
+    if (a->active) {
+        async_fail(a, -ECANCELED);
+        while (a->inflight)
+            if (a->ops->handle_events(a->priv) < 0)
+                break;
+    }
+    deliver(a);
+    while ((r = a->head)) {
+        a->head = r->next;
+        r->callback(a, -ECANCELED, r->user_data);
+        free(r);
+    }
+
+    slot_free(a, &a->cmd_slot);
+    for (i = 0; i < ASYNC_OUT_DEPTH; i++)
+        slot_free(a, &a->out[i]);
+    for (i = 0; i < ASYNC_IN_DEPTH; i++)
+        slot_free(a, &a->in[i]);
+    free(a);
+}
+
+struct imx_async *imx_async_create(struct imx_device *h)
+{
+    struct imx_async *a;
+    int e, i;
+
+    if (imx_soc(h)->protocol != IMX_PROTOCOL_SDP) {
+        fprintf(stderr, "%s does not support asynchronous requests\n",
+                imx_soc(h)->name);
+        return NULL;
+    }
+    if (imx_write_barrier(h) < 0)
+        return NULL;
+
+    a = calloc(1, sizeof(*a));
+    if (!a)
+        return NULL;
+    a->h = h;
+    a->ops = imx_device_ops(h, &a->priv);
+    if (!a->ops->next_timeout) {
+        fprintf(stderr, "The %s transport can't be driven from an event "
+                "loop\n", a->ops->name);
+        free(a);
+        return NULL;
+    }
+
+    e = slot_init(a, &a->cmd_slot);
+    for (i = 0; i < ASYNC_OUT_DEPTH && e >= 0; i++)
+        e = slot_init(a, &a->out[i]);
+    for (i = 0; i < ASYNC_IN_DEPTH && e >= 0; i++)
+        e = slot_init(a, &a->in[i]);
+    if (e < 0) {
+        imx_async_destroy(a);
+        return NULL;
+    }
+    return a;
+}
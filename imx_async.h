@@ -0,0 +1,113 @@
+/**
+ * \file	imx_usb_console/imx_async.h
+ * \date	2026-Oct-16
+ * \author	Andre Renaud
+ * \copyright	Aiotec Ltd/Bluewater Systems
+ * \brief       Non-blocking requests, so that a single event loop can drive
+ *              many devices at once
+ */
+#ifndef IMX_ASYNC_H
+#define IMX_ASYNC_H
+
+#include <poll.h>
+
+#include "imx_usb_lib.h"
+
+/**
+ * Queue of requests for a single device. Requests are carried out in the
+ * order they are submitted, and complete by calling their callback from
+ * imx_async_dispatch
+ */
+struct imx_async;
+
+/**
+ * Called when a request completes
+ * @param result < 0 on failure, >= 0 on success
+ */
+typedef void (*imx_async_cb)(struct imx_async *a, int result,
+        void *user_data);
+
+/**
+ * Start making non-blocking requests of a device. The blocking functions
+ * in imx_usb_lib.h must not be used on the device while requests are
+ * outstanding. If the device is being recorded (imx_capture_start), the
+ * recording must be started first
+ * @param h i.MX?? USB connection handle (SDP devices only)
+ * @return Request queue, or NULL on failure
+ */
+struct imx_async *imx_async_create(struct imx_device *h);
+/**
+ * Cancel any outstanding requests (calling their callbacks with
+ * -ECANCELED) and release the queue. Requests which have already completed
+ * get their callbacks with their results. The device is left open
+ */
+void imx_async_destroy(struct imx_async *a);
+/**
+ * Get the device a queue is for
+ */
+struct imx_device *imx_async_device(struct imx_async *a);
+
+/**
+ * Get the file descriptors to wait on (ie: to add to an epoll set). These
+ * may change as requests are made, so should be refreshed after dispatching
+ * @param fds Filled in with the file descriptors & the events of interest
+ * @param max Number of entries in fds
+ * @return < 0 on failure, otherwise the number of entries used
+ */
+int imx_async_pollfds(struct imx_async *a, struct pollfd *fds, int max);
+/**
+ * Get the longest time to wait before calling imx_async_dispatch, even if
+ * none of the file descriptors are ready
+ * @return Timeout in ms (0 if callbacks are waiting to be made), or -1 if
+ *         there is no need to wake up
+ */
+int imx_async_timeout(struct imx_async *a);
+/**
+ * Process any completed transfers without blocking, moving requests along
+ * and calling the callbacks of those which have finished. This is the only
+ * place callbacks are called from (apart from imx_async_destroy)
+ * @return < 0 on failure, >= 0 on success
+ */
+int imx_async_dispatch(struct imx_async *a);
+/**
+ * Get the number of requests whose callbacks have not yet been called
+ */
+int imx_async_pending(struct imx_async *a);
+
+/*
+ * Requests. Each returns < 0 if the request could not be queued (-EOPNOTSUPP
+ * if the boot ROM doesn't support it), in which case the callback is not
+ * called. Once queued, failures are reported through the callback, even if
+ * they happen straight away. Buffers passed in must remain valid until the
+ * request completes
+ */
+/**
+ * Write a single register
+ * @param width Register width in bits (8, 16 or 32)
+ */
+int imx_async_write_reg(struct imx_async *a, uint32_t addr, uint32_t value,
+        int width, imx_async_cb callback, void *user_data);
+/**
+ * Write a block of memory, as for imx_write_bulk
+ */
+int imx_async_write_bulk(struct imx_async *a, uint32_t addr,
+        const uint8_t *data, int length, imx_async_cb callback,
+        void *user_data);
+/**
+ * Read a block of memory, as for imx_read_bulk with 8-bit accesses
+ */
+int imx_async_read_bulk(struct imx_async *a, uint32_t addr, uint8_t *result,
+        int count, imx_async_cb callback, void *user_data);
+/**
+ * Execute a DCD table, as for imx_dcd_send
+ */
+int imx_async_dcd(struct imx_async *a, const struct imx_dcd *dcd,
+        imx_async_cb callback, void *user_data);
+/**
+ * Begin executing code at a given address, as for imx_jump_address. The
+ * device can't be used once this has completed
+ */
+int imx_async_jump(struct imx_async *a, uint32_t addr,
+        imx_async_cb callback, void *user_data);
+
+#endif
@@ -0,0 +1,207 @@
+/**
+ * \file	imx_usb_console/imx_async_example.c
+ * \date	2026-Oct-16
+ * \author	Andre Renaud
+ * \copyright	Aiotec Ltd/Bluewater Systems
+ * \brief       Example of driving several devices from a single event loop
+ *              with the non-blocking requests in imx_async.h
+ * \description
+ * Each simulated device has a block of memory written, a register within
+ * it written, and the block read back, all queued up front. One poll() loop
+ * then runs every device's requests to completion, and the data read back
+ * is checked. Exits with failure if anything goes wrong, including a
+ * callback being made from anywhere but imx_async_dispatch.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "imx_usb_lib.h"
+#include "imx_sim.h"
+#include "imx_async.h"
+
+#define MAX_DEVICES 16
+#define REG_VALUE 0x5a6b7c8d
+
+#define mseconds() (int)({struct timeval _tv; gettimeofday(&_tv, NULL); _tv.tv_sec * 1000 + _tv.tv_usec / 1000; })
+
+struct device {
+    struct imx_device *h;
+    struct imx_async *a;
+    uint8_t *result;
+    int errors;
+};
+
+/* Set while imx_async_dispatch is running, to check when callbacks happen */
+static int dispatching = 0;
+
+static void request_done(struct imx_async *a, int result, void *user_data)
+{
+    struct device *d = user_data;
+
+    if (!dispatching) {
+        fprintf(stderr, "%s: callback made outside of imx_async_dispatch\n",
+                imx_name(d->h));
+        d->errors++;
+    }
+    if (result < 0) {
+        fprintf(stderr, "%s: request failed: %d\n", imx_name(d->h), result);
+        d->errors++;
+    }
+}
+
+/**
+ * Run the event loop until every device's requests have completed
+ */
+static int run_loop(struct device *devices, int count)
+{
+    struct pollfd fds[MAX_DEVICES * 4];
+
+    for (;;) {
+        int nfds = 0, timeout = -1, pending = 0, i, e;
+
+        for (i = 0; i < count; i++) {
+            struct imx_async *a = devices[i].a;
+            int t = imx_async_timeout(a);
+
+            pending += imx_async_pending(a);
+            e = imx_async_pollfds(a, &fds[nfds], MAX_DEVICES * 4 - nfds);
+            if (e < 0)
+                return e;
+            nfds += e;
+            if (t >= 0 && (timeout < 0 || t < timeout))
+                timeout = t;
+        }
+        if (!pending)
+            return 0;
+
+        if (poll(fds, nfds, timeout) < 0 && errno != EINTR)
+            return -errno;
+        dispatching = 1;
+        for (i = 0; i < count; i++) {
+            e = imx_async_dispatch(devices[i].a);
+            if (e < 0)
+                break;
+        }
+        dispatching = 0;
+        if (e < 0)
+            return e;
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-n devices] [-s latency_us] [-a address] "
+            "[-l length]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    struct device devices[MAX_DEVICES];
+    uint32_t addr = 0x10000000, got;
+    uint8_t *data;
+    int count = 4, latency = 100, length = 256 * 1024;
+    int start, duration, failed = 0, i, e;
+
+    while ((e = getopt(argc, argv, "n:s:a:l:")) != -1) {
+        switch (e) {
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 's':
+            latency = atoi(optarg);
+            break;
+        case 'a':
+            addr = strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            length = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (count < 1 || count > MAX_DEVICES || length < 4) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    data = malloc(length);
+    if (!data)
+        return EXIT_FAILURE;
+    for (i = 0; i < length; i++)
+        data[i] = i ^ (i >> 8) ^ 0xa5;
+
+    memset(devices, 0, sizeof(devices));
+    for (i = 0; i < count; i++) {
+        struct device *d = &devices[i];
+
+        d->h = imx_sim_connect(NULL, latency);
+        d->a = d->h ? imx_async_create(d->h) : NULL;
+        d->result = malloc(length);
+        if (!d->a || !d->result) {
+            fprintf(stderr, "Unable to set up simulated device %d\n", i);
+            count = i + 1;
+            failed = 1;
+            goto out;
+        }
+    }
+
+    start = mseconds();
+    for (i = 0; i < count; i++) {
+        struct device *d = &devices[i];
+
+        e = imx_async_write_bulk(d->a, addr, data, length, request_done, d);
+        if (e >= 0)
+            e = imx_async_write_reg(d->a, addr, REG_VALUE, 32,
+                    request_done, d);
+        if (e >= 0)
+            e = imx_async_read_bulk(d->a, addr, d->result, length,
+                    request_done, d);
+        if (e < 0) {
+            fprintf(stderr, "%s: unable to queue request: %d\n",
+                    imx_name(d->h), e);
+            d->errors++;
+        }
+    }
+    e = run_loop(devices, count);
+    duration = mseconds() - start;
+    if (e < 0) {
+        fprintf(stderr, "Event loop failed: %d\n", e);
+        failed = 1;
+    }
+
+    for (i = 0; i < count; i++) {
+        struct device *d = &devices[i];
+        uint8_t *r = d->result;
+
+        got = r[0] | r[1] << 8 | r[2] << 16 | (uint32_t)r[3] << 24;
+        if (!d->errors && (got != REG_VALUE ||
+                    memcmp(&data[4], &r[4], length - 4) != 0)) {
+            fprintf(stderr, "%s: data read back doesn't match\n",
+                    imx_name(d->h));
+            d->errors++;
+        }
+        if (d->errors)
+            failed = 1;
+    }
+    if (!failed)
+        printf("Wrote and read back %dB on %d devices in %dms\n", length,
+                count, duration);
+
+out:
+    for (i = 0; i < count; i++) {
+        if (devices[i].a)
+            imx_async_destroy(devices[i].a);
+        if (devices[i].h)
+            imx_disconnect(devices[i].h);
+        free(devices[i].result);
+    }
+    free(data);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
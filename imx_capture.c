@@ -0,0 +1,737 @@
+/**
+ * \file	imx_usb_console/imx_capture.c
+ * \date	2026-Oct-16
+ * \author	Andre Renaud
+ * \copyright	Aiotec Ltd/Bluewater Systems
+ * \brief       Recording of SDP sessions, and replaying them without hardware
+ * \description
+ * Capturing layers a transport on top of the one a device is using, which
+ * logs each transfer as it completes. The log is a short header:
+ *      "IMXC", version (1 byte), vid & pid (LE16), ep_out (1 byte),
+ *      flags (1 byte)
+ * followed by a record per transfer:
+ *      kind            1 byte, see CAPTURE_xxx
+ *      time            varint, microseconds since the previous record
+ *      duration        varint, microseconds from submission to completion
+ *      status          1 byte, -LIBUSB_ERROR_xxx (only if CAPTURE_ERROR)
+ *      length          varint
+ *      data            length bytes, or a 4 byte FNV-1a hash if
+ *                      CAPTURE_HASHED
+ * Varints are little endian base 128, as used by protobuf.
+ *
+ * The replay transport serves the recorded IN reports back in order, taking
+ * the recorded duration (scaled) to complete each transfer, and checks that
+ * the reports sent to it match the recording.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "imx_capture.h"
+#include "imx_transport.h"
+
+#define min(a,b) (((a) < (b)) ? (a) : (b))
+#define max(a,b) (((a) > (b)) ? (a) : (b))
+
+#define CAPTURE_MAGIC "IMXC"
+#define CAPTURE_VERSION 1
+
+/* Record kind: transfer type in the bottom bits, plus flags */
+#define CAPTURE_TYPE_MASK 0x03
+#define CAPTURE_ASYNC   0x04
+#define CAPTURE_HASHED  0x08
+#define CAPTURE_ERROR   0x10
+
+/* Header flags */
+#define CAPTURE_FULL    0x01
+
+/* Reports longer than this are hashed, unless recording in full */
+#define CAPTURE_MAX_UNHASHED 64
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_until(uint64_t when)
+{
+    struct timespec ts;
+
+    if (when <= now_us())
+        return;
+    ts.tv_sec = when / 1000000;
+    ts.tv_nsec = (when % 1000000) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static uint32_t fnv1a(const uint8_t *data, int len)
+{
+    uint32_t hash = 0x811c9dc5;
+
+    while (len--) {
+        hash ^= *data++;
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+static void put_varint(FILE *fp, uint64_t value)
+{
+    do {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        fputc(value ? byte | 0x80 : byte, fp);
+    } while (value);
+}
+
+static int get_varint(FILE *fp, uint64_t *value)
+{
+    int shift = 0, c;
+
+    *value = 0;
+    do {
+        c = fgetc(fp);
+        if (c == EOF || shift > 63)
+            return -EINVAL;
+        *value |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return 0;
+}
+
+/*
+ * Capture
+ */
+struct capture {
+    const struct imx_transport_ops *ops;
+    void *priv;
+    FILE *fp;
+    int full;
+    uint64_t last;      /* Time of the previous record */
+};
+
+/* Details of an asynchronous transfer, while it is in flight */
+struct capture_xfer {
+    struct capture *cap;
+    imx_transfer_cb callback;
+    void *user_data;
+    uint64_t start;
+};
+
+static void capture_record(struct capture *cap, int type, int async,
+        uint64_t start, int status, const uint8_t *data, int len)
+{
+    uint64_t now = now_us();
+    int hashed = type != IMX_TRANSFER_READ && !cap->full &&
+        len > CAPTURE_MAX_UNHASHED;
+    uint8_t kind = type;
+
+    if (async)
+        kind |= CAPTURE_ASYNC;
+    if (hashed)
+        kind |= CAPTURE_HASHED;
+    if (status < 0) {
+        kind |= CAPTURE_ERROR;
+        if (type == IMX_TRANSFER_READ)
+            len = 0;
+    }
+
+    fputc(kind, cap->fp);
+    put_varint(cap->fp, now - cap->last);
+    put_varint(cap->fp, now - start);
+    if (status < 0)
+        fputc(-status, cap->fp);
+    put_varint(cap->fp, len);
+    if (hashed) {
+        uint32_t hash = fnv1a(data, len);
+        uint8_t bytes[4] = {hash, hash >> 8, hash >> 16, hash >> 24};
+        fwrite(bytes, 1, sizeof(bytes), cap->fp);
+    } else {
+        fwrite(data, 1, len, cap->fp);
+    }
+    cap->last = now;
+}
+
+static int capture_set_report(void *priv, uint8_t *report, int len,
+        unsigned int timeout)
+{
+    struct capture *cap = priv;
+    uint64_t start = now_us();
+    int e = cap->ops->set_report(cap->priv, report, len, timeout);
+
+    capture_record(cap, IMX_TRANSFER_SET_REPORT, 0, start, min(e, 0), report,
+            len);
+    return e;
+}
+
+static int capture_read_report(void *priv, uint8_t *report, int len,
+        int *actual, unsigned int timeout)
+{
+    struct capture *cap = priv;
+    uint64_t start = now_us();
+    int e = cap->ops->read_report(cap->priv, report, len, actual, timeout);
+
+    capture_record(cap, IMX_TRANSFER_READ, 0, start, min(e, 0), report,
+            e < 0 ? 0 : *actual);
+    return e;
+}
+
+static void capture_callback(struct imx_transfer *xfer)
+{
+    struct capture_xfer *cx = xfer->user_data;
+    struct capture *cap = cx->cap;
+
+    xfer->callback = cx->callback;
+    xfer->user_data = cx->user_data;
+    capture_record(cap, xfer->type, 1, cx->start, xfer->status, xfer->buffer,
+            xfer->type == IMX_TRANSFER_READ ? xfer->actual_length :
+            xfer->length);
+    free(cx);
+    xfer->callback(xfer);
+}
+
+static int capture_submit(void *priv, struct imx_transfer *xfer)
+{
+    struct capture *cap = priv;
+    struct capture_xfer *cx = malloc(sizeof(*cx));
+    int e;
+
+    if (!cx)
+        return LIBUSB_ERROR_NO_MEM;
+    cx->cap = cap;
+    cx->callback = xfer->callback;
+    cx->user_data = xfer->user_data;
+    cx->start = now_us();
+    xfer->callback = capture_callback;
+    xfer->user_data = cx;
+
+    e = cap->ops->submit(cap->priv, xfer);
+    if (e < 0) {
+        xfer->callback = cx->callback;
+        xfer->user_data = cx->user_data;
+        free(cx);
+    }
+    return e;
+}
+
+static int capture_cancel(void *priv, struct imx_transfer *xfer)
+{
+    struct capture *cap = priv;
+
+    return cap->ops->cancel(cap->priv, xfer);
+}
+
+static void capture_release(void *priv, struct imx_transfer *xfer)
+{
+    struct capture *cap = priv;
+
+    cap->ops->release(cap->priv, xfer);
+}
+
+static int capture_handle_events(void *priv)
+{
+    struct capture *cap = priv;
+
+    return cap->ops->handle_events(cap->priv);
+}
+
+static int capture_pollfds(void *priv, struct pollfd *fds, int max)
+{
+    struct capture *cap = priv;
+
+    if (!cap->ops->pollfds)
+        return 0;
+    return cap->ops->pollfds(cap->priv, fds, max);
+}
+
+static int capture_next_timeout(void *priv)
+{
+    struct capture *cap = priv;
+
+    return cap->ops->next_timeout(cap->priv);
+}
+
+static int capture_poll_events(void *priv)
+{
+    struct capture *cap = priv;
+
+    return imx_transport_poll_events(cap->ops, cap->priv);
+}
+
+static void capture_close(void *priv)
+{
+    struct capture *cap = priv;
+
+    if (fclose(cap->fp) != 0)
+        perror("capture log");
+    cap->ops->close(cap->priv);
+    free(cap);
+}
+
+static const struct imx_transport_ops capture_transport_ops = {
+    .name = "capture",
+    .set_report = capture_set_report,
+    .read_report = capture_read_report,
+    .submit = capture_submit,
+    .cancel = capture_cancel,
+    .release = capture_release,
+    .handle_events = capture_handle_events,
+    .pollfds = capture_pollfds,
+    .next_timeout = capture_next_timeout,
+    .poll_events = capture_poll_events,
+    .close = capture_close,
+};
+
+int imx_capture_start(struct imx_device *h, const char *filename, int full)
+{
+    const struct imx_soc *soc = imx_soc(h);
+    struct capture *cap;
+    uint8_t header[4 + 7];
+
+    cap = calloc(1, sizeof(*cap));
+    if (!cap)
+        return -ENOMEM;
+    cap->fp = fopen(filename, "wb");
+    if (!cap->fp) {
+        int e = -errno;
+        fprintf(stderr, "Unable to create %s: %s\n", filename, strerror(errno));
+        free(cap);
+        return e;
+    }
+    cap->full = full;
+    cap->last = now_us();
+    cap->ops = imx_device_ops(h, &cap->priv);
+
+    memcpy(header, CAPTURE_MAGIC, 4);
+    header[4] = CAPTURE_VERSION;
+    header[5] = soc->vid & 0xff;
+    header[6] = soc->vid >> 8;
+    header[7] = soc->pid & 0xff;
+    header[8] = soc->pid >> 8;
+    header[9] = imx_device_ep_out(h);
+    header[10] = full ? CAPTURE_FULL : 0;
+    fwrite(header, 1, sizeof(header), cap->fp);
+
+    imx_device_set_ops(h, &capture_transport_ops, cap);
+    return 0;
+}
+
+/*
+ * Replay
+ */
+struct replay_record {
+    uint8_t kind;
+    int status;
+    uint32_t duration;
+    uint32_t length;
+    uint32_t hash;
+    uint8_t *data;      /* NULL if only the hash was recorded */
+};
+
+/* Records for one direction, in the order they completed */
+struct replay_stream {
+    struct replay_record *records;
+    int count;
+    int size;
+    int pos;            /* Next record to serve */
+    int sched;          /* Next record to schedule a transfer for */
+    uint64_t last;      /* Completion time of the previous transfer */
+};
+
+struct replay_pending {
+    struct replay_pending *next;
+    struct imx_transfer *xfer;
+    uint64_t due;
+};
+
+struct replay_queue {
+    struct replay_pending *head;
+    struct replay_pending *tail;
+};
+
+struct replay {
+    struct replay_stream out;
+    struct replay_stream in;
+    double scale;
+    uint64_t recorded;  /* Total time covered by the recording */
+    int transfers;
+    int diverged;
+
+    struct replay_queue pending_out;
+    struct replay_queue pending_in;
+    struct replay_queue done;
+};
+
+static int replay_add(struct replay_stream *s, struct replay_record *r)
+{
+    if (s->count == s->size) {
+        int size = s->size ? s->size * 2 : 256;
+        struct replay_record *records = realloc(s->records,
+                size * sizeof(*records));
+        if (!records)
+            return -ENOMEM;
+        s->records = records;
+        s->size = size;
+    }
+    s->records[s->count++] = *r;
+    return 0;
+}
+
+static int replay_load(struct replay *rp, FILE *fp)
+{
+    int c;
+
+    while ((c = fgetc(fp)) != EOF) {
+        struct replay_record r = {.kind = c};
+        uint64_t time, duration, length;
+        int e;
+
+        if (get_varint(fp, &time) < 0 || get_varint(fp, &duration) < 0)
+            return -EINVAL;
+        if (r.kind & CAPTURE_ERROR) {
+            if ((c = fgetc(fp)) == EOF)
+                return -EINVAL;
+            r.status = -c;
+        }
+        if (get_varint(fp, &length) < 0 || length > 65536)
+            return -EINVAL;
+        r.duration = duration;
+        r.length = length;
+
+        if (r.kind & CAPTURE_HASHED) {
+            uint8_t bytes[4];
+            if (fread(bytes, 1, sizeof(bytes), fp) != sizeof(bytes))
+                return -EINVAL;
+            r.hash = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) |
+                ((uint32_t)bytes[3] << 24);
+        } else if (length) {
+            r.data = malloc(length);
+            if (!r.data)
+                return -ENOMEM;
+            if (fread(r.data, 1, length, fp) != length) {
+                free(r.data);
+                return -EINVAL;
+            }
+        }
+        rp->recorded += time;
+
+        /* Cancelled reads are cancelled again when the replay gets there */
+        if ((r.kind & CAPTURE_TYPE_MASK) == IMX_TRANSFER_READ &&
+                r.status == LIBUSB_ERROR_INTERRUPTED) {
+            free(r.data);
+            continue;
+        }
+
+        if ((r.kind & CAPTURE_TYPE_MASK) == IMX_TRANSFER_READ)
+            e = replay_add(&rp->in, &r);
+        else
+            e = replay_add(&rp->out, &r);
+        if (e < 0) {
+            free(r.data);
+            return e;
+        }
+    }
+    return 0;
+}
+
+static uint64_t replay_due(struct replay *rp, struct replay_stream *s)
+{
+    uint64_t due = now_us();
+
+    if (s->sched < s->count)
+        due += s->records[s->sched++].duration * rp->scale;
+    due = max(due, s->last);
+    s->last = due;
+    return due;
+}
+
+/**
+ * Check a report sent to the device against the recording
+ * @return Recorded result of the transfer
+ */
+static int replay_out(struct replay *rp, const uint8_t *report, int len)
+{
+    struct replay_record *r;
+    int match;
+
+    if (rp->out.pos == rp->out.count)
+        return LIBUSB_ERROR_NO_DEVICE;
+    r = &rp->out.records[rp->out.pos++];
+    rp->transfers++;
+
+    if (r->kind & CAPTURE_HASHED)
+        match = r->length == len && r->hash == fnv1a(report, len);
+    else
+        match = r->length == len && memcmp(r->data, report, len) == 0;
+    if (!match) {
+        if (!rp->diverged)
+            fprintf(stderr, "replay: report %d differs from the recording\n",
+                    rp->out.pos);
+        rp->diverged++;
+    }
+
+    return r->status < 0 ? r->status : len;
+}
+
+/**
+ * Take the next recorded IN report
+ * @return Recorded result of the transfer
+ */
+static int replay_in(struct replay *rp, uint8_t *report, int len, int *actual)
+{
+    struct replay_record *r;
+
+    *actual = 0;
+    if (rp->in.pos == rp->in.count)
+        return LIBUSB_ERROR_NO_DEVICE;
+    r = &rp->in.records[rp->in.pos++];
+    rp->transfers++;
+    if (r->status < 0)
+        return r->status;
+    if (len < r->length)
+        return LIBUSB_ERROR_OVERFLOW;
+    memcpy(report, r->data, r->length);
+    *actual = r->length;
+    return 0;
+}
+
+static int replay_set_report(void *priv, uint8_t *report, int len,
+        unsigned int timeout)
+{
+    struct replay *rp = priv;
+
+    sleep_until(replay_due(rp, &rp->out));
+    return replay_out(rp, report, len);
+}
+
+static int replay_read_report(void *priv, uint8_t *report, int len,
+        int *actual, unsigned int timeout)
+{
+    struct replay *rp = priv;
+
+    sleep_until(replay_due(rp, &rp->in));
+    return replay_in(rp, report, len, actual);
+}
+
+static void queue_add(struct replay_queue *q, struct replay_pending *p)
+{
+    p->next = NULL;
+    if (q->tail)
+        q->tail->next = p;
+    else
+        q->head = p;
+    q->tail = p;
+}
+
+static struct replay_pending *queue_pop(struct replay_queue *q)
+{
+    struct replay_pending *p = q->head;
+
+    if (p) {
+        q->head = p->next;
+        if (!q->head)
+            q->tail = NULL;
+    }
+    return p;
+}
+
+static int replay_submit(void *priv, struct imx_transfer *xfer)
+{
+    struct replay *rp = priv;
+    struct replay_pending *p = calloc(1, sizeof(*p));
+
+    if (!p)
+        return LIBUSB_ERROR_NO_MEM;
+    p->xfer = xfer;
+    /* Transfers complete in order, so this one is served the record
+     * after those of the transfers already in flight */
+    if (xfer->type == IMX_TRANSFER_READ) {
+        p->due = replay_due(rp, &rp->in);
+        queue_add(&rp->pending_in, p);
+    } else {
+        p->due = replay_due(rp, &rp->out);
+        queue_add(&rp->pending_out, p);
+    }
+    return 0;
+}
+
+static int replay_cancel(void *priv, struct imx_transfer *xfer)
+{
+    struct replay *rp = priv;
+    struct replay_queue *queues[] = {&rp->pending_in, &rp->pending_out};
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        struct replay_pending **pp, *prev = NULL;
+
+        for (pp = &queues[i]->head; *pp; prev = *pp, pp = &(*pp)->next) {
+            struct replay_pending *p = *pp;
+
+            if (p->xfer != xfer)
+                continue;
+            *pp = p->next;
+            if (queues[i]->tail == p)
+                queues[i]->tail = prev;
+            xfer->status = LIBUSB_ERROR_INTERRUPTED;
+            queue_add(&rp->done, p);
+            return 0;
+        }
+    }
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+static void replay_release(void *priv, struct imx_transfer *xfer)
+{
+}
+
+static int replay_handle_events(void *priv)
+{
+    struct replay *rp = priv;
+    struct imx_transfer *xfer;
+    struct replay_pending *p;
+    int e;
+
+    p = queue_pop(&rp->done);
+    if (p) {
+        xfer = p->xfer;
+        free(p);
+        xfer->actual_length = 0;
+        xfer->callback(xfer);
+        return 0;
+    }
+
+    if (rp->pending_out.head && (!rp->pending_in.head ||
+            rp->pending_out.head->due <= rp->pending_in.head->due)) {
+        p = queue_pop(&rp->pending_out);
+        sleep_until(p->due);
+        xfer = p->xfer;
+        e = replay_out(rp, xfer->buffer, xfer->length);
+        xfer->status = e < 0 ? e : 0;
+        xfer->actual_length = e < 0 ? 0 : e;
+    } else if (rp->pending_in.head) {
+        p = queue_pop(&rp->pending_in);
+        sleep_until(p->due);
+        xfer = p->xfer;
+        xfer->status = replay_in(rp, xfer->buffer, xfer->length,
+                &xfer->actual_length);
+    } else {
+        return 0;
+    }
+
+    free(p);
+    xfer->callback(xfer);
+    return 0;
+}
+
+static int replay_next_timeout(void *priv)
+{
+    struct replay *rp = priv;
+    uint64_t due = UINT64_MAX, now;
+
+    if (rp->done.head)
+        return 0;
+    if (rp->pending_out.head)
+        due = rp->pending_out.head->due;
+    if (rp->pending_in.head)
+        due = min(due, rp->pending_in.head->due);
+    if (due == UINT64_MAX)
+        return -1;
+    now = now_us();
+    return due <= now ? 0 : (due - now + 999) / 1000;
+}
+
+static void replay_free(struct replay *rp)
+{
+    struct replay_pending *p;
+    int i;
+
+    while ((p = queue_pop(&rp->done)) || (p = queue_pop(&rp->pending_out)) ||
+            (p = queue_pop(&rp->pending_in)))
+        free(p);
+    for (i = 0; i < rp->out.count; i++)
+        free(rp->out.records[i].data);
+    for (i = 0; i < rp->in.count; i++)
+        free(rp->in.records[i].data);
+    free(rp->out.records);
+    free(rp->in.records);
+    free(rp);
+}
+
+static void replay_close(void *priv)
+{
+    struct replay *rp = priv;
+
+    printf("Replayed %d of %d transfers (%d differed), recorded over %dms\n",
+            rp->transfers, rp->out.count + rp->in.count, rp->diverged,
+            (int)(rp->recorded / 1000));
+    replay_free(rp);
+}
+
+static const struct imx_transport_ops replay_transport_ops = {
+    .name = "replay",
+    .set_report = replay_set_report,
+    .read_report = replay_read_report,
+    .submit = replay_submit,
+    .cancel = replay_cancel,
+    .release = replay_release,
+    .handle_events = replay_handle_events,
+    .next_timeout = replay_next_timeout,
+    .close = replay_close,
+};
+
+struct imx_device *imx_replay_connect(const char *filename, double scale)
+{
+    const struct imx_soc *soc;
+    struct imx_device *h;
+    struct replay *rp;
+    uint8_t header[4 + 7];
+    FILE *fp;
+    int e;
+
+    fp = fopen(filename, "rb");
+    if (!fp) {
+        fprintf(stderr, "Unable to open %s: %s\n", filename, strerror(errno));
+        return NULL;
+    }
+
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header) ||
+            memcmp(header, CAPTURE_MAGIC, 4) != 0 ||
+            header[4] != CAPTURE_VERSION) {
+        fprintf(stderr, "%s is not a capture log\n", filename);
+        fclose(fp);
+        return NULL;
+    }
+    soc = imx_find_soc(header[5] | (header[6] << 8),
+            header[7] | (header[8] << 8));
+    if (!soc) {
+        fprintf(stderr, "%s was captured from an unknown device\n", filename);
+        fclose(fp);
+        return NULL;
+    }
+
+    rp = calloc(1, sizeof(*rp));
+    if (!rp) {
+        fclose(fp);
+        return NULL;
+    }
+    rp->scale = scale;
+    e = replay_load(rp, fp);
+    fclose(fp);
+    if (e < 0) {
+        fprintf(stderr, "Invalid capture log %s\n", filename);
+        replay_free(rp);
+        return NULL;
+    }
+
+    h = imx_device_create(&replay_transport_ops, rp, soc, header[9]);
+    if (!h)
+        replay_free(rp);
+    return h;
+}
@@ -0,0 +1,34 @@
+/**
+ * \file	imx_usb_console/imx_capture.h
+ * \date	2026-Oct-16
+ * \author	Andre Renaud
+ * \copyright	Aiotec Ltd/Bluewater Systems
+ * \brief       Recording of SDP sessions, and replaying them without hardware
+ */
+#ifndef IMX_CAPTURE_H
+#define IMX_CAPTURE_H
+
+#include "imx_usb_lib.h"
+
+/**
+ * Start recording every transfer made on a connection to a log file.
+ * Recording stops when the device is disconnected
+ * @param h i.MX?? USB connection handle
+ * @param filename Log file to create
+ * @param full Non-zero to record all data sent to the device. Otherwise
+ *             only commands are recorded in full, and data reports are
+ *             recorded as a hash
+ * @return < 0 on failure, >= 0 on success
+ */
+int imx_capture_start(struct imx_device *h, const char *filename, int full);
+
+/**
+ * Connect to a device which replays the responses from a recorded session
+ * @param filename Log file created by imx_capture_start
+ * @param scale Factor to apply to the recorded timing (ie: 1.0 for the
+ *              original timing, 0 to replay as fast as possible)
+ * @return Device handle, to be released with imx_disconnect, or NULL
+ */
+struct imx_device *imx_replay_connect(const char *filename, double scale);
+
+#endif
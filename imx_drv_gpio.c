@@ -38,7 +38,7 @@ static uint32_t gpio_to_base(uint32_t gpio)
 	return gpio_base[bank];
 }
 
-int gpio_set_direction(libusb_device_handle *h, uint32_t gpio, int output)
+int gpio_set_direction(struct imx_device *h, uint32_t gpio, int output)
 {
 	uint32_t val;
 	int e;
@@ -56,7 +56,7 @@ int gpio_set_direction(libusb_device_handle *h, uint32_t gpio, int output)
 	return e;
 }
 
-int gpio_get_direction(libusb_device_handle *h, uint32_t gpio)
+int gpio_get_direction(struct imx_device *h, uint32_t gpio)
 {
 	uint32_t val;
 	int e;
@@ -69,7 +69,7 @@ int gpio_get_direction(libusb_device_handle *h, uint32_t gpio)
 	return (val & mask) ? 1 : 0;
 }
 
-int gpio_get_value(libusb_device_handle *h, uint32_t gpio)
+int gpio_get_value(struct imx_device *h, uint32_t gpio)
 {
 	uint32_t val;
 	int e;
@@ -82,7 +82,7 @@ int gpio_get_value(libusb_device_handle *h, uint32_t gpio)
 	return (val & mask) ? 1 : 0;
 }
 
-int gpio_set_value(libusb_device_handle *h, uint32_t gpio, int value)
+int gpio_set_value(struct imx_device *h, uint32_t gpio, int value)
 {
 	uint32_t val;
 	int e;
@@ -12,9 +12,9 @@
 
 #define MXC_GPIO(bank,pin) ((((bank) - 1) << 5) | (pin))
 
-int gpio_set_direction(libusb_device_handle *h, uint32_t gpio, int output);
-int gpio_get_direction(libusb_device_handle *h, uint32_t gpio);
-int gpio_get_value(libusb_device_handle *h, uint32_t gpio);
-int gpio_set_value(libusb_device_handle *h, uint32_t gpio, int value);
+int gpio_set_direction(struct imx_device *h, uint32_t gpio, int output);
+int gpio_get_direction(struct imx_device *h, uint32_t gpio);
+int gpio_get_value(struct imx_device *h, uint32_t gpio);
+int gpio_set_value(struct imx_device *h, uint32_t gpio, int value);
 
 #endif
@@ -31,13 +31,13 @@ static uint32_t ecspi_base_addr[] = {
 	0x02018000,
 };
 
-static int ecspi_write(struct libusb_device_handle *h, int spi_dev,
+static int ecspi_write(struct imx_device *h, int spi_dev,
 		int reg, uint32_t val)
 {
 	return imx_write_reg32(h, ecspi_base_addr[spi_dev] + reg, val);
 }
 
-static int ecspi_read(struct libusb_device_handle *h, int spi_dev,
+static int ecspi_read(struct imx_device *h, int spi_dev,
 		int reg, uint32_t *val)
 {
 	//return imx_read_reg32(h, ecspi_base_addr[spi_dev] + reg, val);
@@ -45,7 +45,7 @@ static int ecspi_read(struct libusb_device_handle *h, int spi_dev,
 				(uint8_t *)val, 1, 0x20);
 }
 
-static int ecspi_setbits(struct libusb_device_handle *h, int spi_dev,
+static int ecspi_setbits(struct imx_device *h, int spi_dev,
 		int reg, uint32_t bits)
 {
 	int e;
@@ -61,7 +61,7 @@ static int ecspi_setbits(struct libusb_device_handle *h, int spi_dev,
 
 }
 
-int imx_spi_init(struct libusb_device_handle *h, int spi_dev,
+int imx_spi_init(struct imx_device *h, int spi_dev,
 		int cs, int speed, unsigned int mode)
 {
 	uint32_t con_reg =
@@ -100,7 +100,7 @@ int imx_spi_init(struct libusb_device_handle *h, int spi_dev,
 	return 0;
 }
 
-static int imx_spi_xfer_block(struct libusb_device_handle *h, int spi_dev,
+static int imx_spi_xfer_block(struct imx_device *h, int spi_dev,
 	uint8_t *tx, uint8_t *rx, int len)
 {
 	int i;
@@ -207,7 +207,7 @@ static int imx_spi_xfer_block(struct libusb_device_handle *h, int spi_dev,
 	return 0;
 }
 
-int imx_spi_xfer(struct libusb_device_handle *h, int spi_dev,
+int imx_spi_xfer(struct imx_device *h, int spi_dev,
 		unsigned int gpio_cs, uint8_t *tx, uint8_t *rx, int len)
 {
 	/* FIXME: Break it down into separate transfers */
@@ -233,7 +233,7 @@ int imx_spi_xfer(struct libusb_device_handle *h, int spi_dev,
 	return 0;
 }
 
-int imx_spi_close(struct libusb_device_handle *h, int spi_dev)
+int imx_spi_close(struct imx_device *h, int spi_dev)
 {
 	/* Disable the whole thing */
 	if (ecspi_write(h, spi_dev, ECSPI_CONREG, 0) < 0)
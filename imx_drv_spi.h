@@ -11,10 +11,10 @@
 
 #include "imx_usb_lib.h"
 
-int imx_spi_init(struct libusb_device_handle *h, int spi_dev,
+int imx_spi_init(struct imx_device *h, int spi_dev,
 		int cs, int speed, unsigned int mode);
-int imx_spi_xfer(struct libusb_device_handle *h, int spi_dev,
+int imx_spi_xfer(struct imx_device *h, int spi_dev,
 		unsigned int gpio_cs, uint8_t *tx, uint8_t *rx, int len);
-int imx_spi_close(struct libusb_device_handle *h, int spi_dev);
+int imx_spi_close(struct imx_device *h, int spi_dev);
 
 #endif
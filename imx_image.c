@@ -0,0 +1,784 @@
+/**
+ * \file	imx_usb_console/imx_image.c
+ * \date	2026-Oct-16
+ * \author	Andre Renaud
+ * \copyright	Aiotec Ltd/Bluewater Systems
+ * \brief       Parsing of ELF, Motorola S-record & Intel HEX images into
+ *              the segments which need to be loaded, and of i.MX boot
+ *              images
+ * \description
+ * Record based formats describe memory a few bytes at a time. Records are
+ * decoded into a single data buffer, and records which carry on from the
+ * previous one extend its segment, so a typical image ends up as a handful
+ * of segments. ELF images are kept as read, with each segment pointing into
+ * the file.
+ */
+
+#include <ctype.h>
+#include <endian.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "imx_image.h"
+#include "imx_transport.h"
+
+#define PT_LOAD 1
+
+#define min_size(a,b) (((a) < (b)) ? (a) : (b))
+#define max_size(a,b) (((a) > (b)) ? (a) : (b))
+
+static int image_grow(struct imx_image *image)
+{
+    struct imx_segment *segments;
+    int size;
+
+    if (image->count < image->size)
+        return 0;
+    size = image->size ? image->size * 2 : 16;
+    segments = realloc(image->segments, size * sizeof(*segments));
+    if (!segments)
+        return -ENOMEM;
+    image->segments = segments;
+    image->size = size;
+    return 0;
+}
+
+static int image_add_segment(struct imx_image *image, uint32_t addr,
+        uint32_t length, size_t offset)
+{
+    struct imx_segment *s;
+    int e = image_grow(image);
+
+    if (e < 0)
+        return e;
+    s = &image->segments[image->count++];
+    s->addr = addr;
+    s->length = length;
+    s->offset = offset;
+    return 0;
+}
+
+/**
+ * Add a record's data to the image
+ */
+static int image_add_data(struct imx_image *image, uint32_t addr,
+        const uint8_t *data, int length)
+{
+    struct imx_segment *last = image->count ?
+        &image->segments[image->count - 1] : NULL;
+
+    if (!length)
+        return 0;
+    if (image->data_len + length > image->data_size) {
+        size_t size = image->data_size ? image->data_size * 2 : 65536;
+        uint8_t *buffer;
+
+        while (size < image->data_len + length)
+            size *= 2;
+        buffer = realloc(image->data, size);
+        if (!buffer)
+            return -ENOMEM;
+        image->data = buffer;
+        image->data_size = size;
+    }
+    memcpy(image->data + image->data_len, data, length);
+
+    if (last && last->addr + last->length == addr &&
+            last->offset + last->length == image->data_len) {
+        last->length += length;
+    } else {
+        int e = image_add_segment(image, addr, length, image->data_len);
+        if (e < 0)
+            return e;
+    }
+    image->data_len += length;
+    return 0;
+}
+
+/*
+ * ELF
+ * 32 & 64-bit, either byte order. Segments are loaded at their physical
+ * addresses, which is where the linker puts the load image
+ */
+static uint64_t elf_get(const uint8_t *p, int size, int big_endian)
+{
+    uint64_t value = 0;
+    int i;
+
+    for (i = 0; i < size; i++)
+        value |= (uint64_t)p[big_endian ? size - 1 - i : i] << (i * 8);
+    return value;
+}
+
+static int elf_parse(const char *filename, struct imx_image *image)
+{
+    const uint8_t *d = image->data;
+    size_t len = image->data_len;
+    int is64, be, addr_size;
+    uint64_t phoff;
+    int phentsize, phnum, i;
+
+    if (len < 52 || (d[4] != 1 && d[4] != 2) || (d[5] != 1 && d[5] != 2)) {
+        fprintf(stderr, "%s: unsupported ELF file\n", filename);
+        return -EINVAL;
+    }
+    is64 = d[4] == 2;
+    be = d[5] == 2;
+    addr_size = is64 ? 8 : 4;
+    if (is64 && len < 64) {
+        fprintf(stderr, "%s: truncated ELF header\n", filename);
+        return -EINVAL;
+    }
+
+    image->entry = elf_get(&d[24], addr_size, be);
+    image->has_entry = 1;
+    phoff = elf_get(&d[is64 ? 32 : 28], addr_size, be);
+    phentsize = elf_get(&d[is64 ? 54 : 42], 2, be);
+    phnum = elf_get(&d[is64 ? 56 : 44], 2, be);
+    if (phentsize < (is64 ? 56 : 32) || phoff > len ||
+            (uint64_t)phentsize * phnum > len - phoff) {
+        fprintf(stderr, "%s: invalid program headers\n", filename);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < phnum; i++) {
+        const uint8_t *ph = d + phoff + (size_t)i * phentsize;
+        uint64_t offset, paddr, filesz, memsz;
+        int e = 0;
+
+        if (elf_get(ph, 4, be) != PT_LOAD)
+            continue;
+        if (is64) {
+            offset = elf_get(ph + 8, 8, be);
+            paddr = elf_get(ph + 24, 8, be);
+            filesz = elf_get(ph + 32, 8, be);
+            memsz = elf_get(ph + 40, 8, be);
+        } else {
+            offset = elf_get(ph + 4, 4, be);
+            paddr = elf_get(ph + 12, 4, be);
+            filesz = elf_get(ph + 16, 4, be);
+            memsz = elf_get(ph + 20, 4, be);
+        }
+        if (offset > len || filesz > len - offset || filesz > memsz ||
+                paddr + memsz > 0x100000000ULL) {
+            fprintf(stderr, "%s: invalid program header %d\n", filename, i);
+            return -EINVAL;
+        }
+        if (filesz)
+            e = image_add_segment(image, paddr, filesz, offset);
+        /* .bss and friends */
+        if (e >= 0 && memsz > filesz)
+            e = image_add_segment(image, paddr + filesz, memsz - filesz,
+                    IMX_SEGMENT_ZERO);
+        if (e < 0)
+            return e;
+    }
+    image->format = "ELF";
+    return 0;
+}
+
+/*
+ * Record based formats
+ */
+static int hex_nibble(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c = tolower(c);
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/**
+ * Decode a string of hex digit pairs (ie: a record, after its marker)
+ * @return < 0 on failure, otherwise the number of bytes decoded
+ */
+static int hex_bytes(const char *s, uint8_t *out, int max)
+{
+    int n = 0;
+
+    while (isxdigit((unsigned char)s[0])) {
+        int hi = hex_nibble(s[0]), lo = hex_nibble(s[1]);
+
+        if (lo < 0 || n == max)
+            return -EINVAL;
+        out[n++] = (hi << 4) | lo;
+        s += 2;
+    }
+    /* Only line endings may follow */
+    while (*s == '\r' || *s == '\n' || *s == ' ' || *s == '\t')
+        s++;
+    return *s ? -EINVAL : n;
+}
+
+static uint32_t get_be(const uint8_t *p, int size)
+{
+    uint32_t value = 0;
+    int i;
+
+    for (i = 0; i < size; i++)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+/**
+ * Motorola S-record
+ * S<type><count><address><data><checksum>, where count covers the address,
+ * data & checksum, and the checksum is the one's complement of the sum of
+ * everything after the type
+ */
+static int srec_record(struct imx_image *image, const char *line)
+{
+    static const int addr_sizes[10] = {2, 2, 3, 4, 0, 2, 3, 4, 3, 2};
+    uint8_t rec[256];
+    uint8_t sum = 0;
+    int type, n, addr_size, i;
+
+    if (line[0] != 'S' || !isdigit((unsigned char)line[1]))
+        return -EINVAL;
+    type = line[1] - '0';
+    n = hex_bytes(&line[2], rec, sizeof(rec));
+    addr_size = addr_sizes[type];
+    if (n < 1 || rec[0] != n - 1 || n < 1 + addr_size + 1)
+        return -EINVAL;
+    for (i = 0; i < n - 1; i++)
+        sum += rec[i];
+    if ((uint8_t)~sum != rec[n - 1])
+        return -EINVAL;
+
+    switch (type) {
+    case 1:
+    case 2:
+    case 3:
+        return image_add_data(image, get_be(&rec[1], addr_size),
+                &rec[1 + addr_size], n - 2 - addr_size);
+    case 7:
+    case 8:
+    case 9:
+        image->entry = get_be(&rec[1], addr_size);
+        image->has_entry = 1;
+        break;
+    }
+    /* S0 header, S5/S6 record counts */
+    return 0;
+}
+
+/**
+ * Intel HEX
+ * :<count><address><type><data><checksum>, where the bytes (including the
+ * checksum) sum to zero. Extended address records set the upper bits of
+ * the following data records' addresses
+ * @param base Current extended address
+ * @return < 0 on failure, 1 at the end of the file, otherwise 0
+ */
+static int ihex_record(struct imx_image *image, const char *line,
+        uint32_t *base)
+{
+    uint8_t rec[260];
+    uint8_t sum = 0;
+    int n, i;
+
+    if (line[0] != ':')
+        return -EINVAL;
+    n = hex_bytes(&line[1], rec, sizeof(rec));
+    if (n < 5 || rec[0] != n - 5)
+        return -EINVAL;
+    for (i = 0; i < n; i++)
+        sum += rec[i];
+    if (sum)
+        return -EINVAL;
+
+    switch (rec[3]) {
+    case 0x00:
+        return image_add_data(image, *base + get_be(&rec[1], 2), &rec[4],
+                rec[0]);
+    case 0x01:
+        return 1;
+    case 0x02:
+        if (rec[0] != 2)
+            return -EINVAL;
+        *base = get_be(&rec[4], 2) << 4;
+        break;
+    case 0x03:
+        if (rec[0] != 4)
+            return -EINVAL;
+        image->entry = (get_be(&rec[4], 2) << 4) + get_be(&rec[6], 2);
+        image->has_entry = 1;
+        break;
+    case 0x04:
+        if (rec[0] != 2)
+            return -EINVAL;
+        *base = get_be(&rec[4], 2) << 16;
+        break;
+    case 0x05:
+        if (rec[0] != 4)
+            return -EINVAL;
+        image->entry = get_be(&rec[4], 4);
+        image->has_entry = 1;
+        break;
+    default:
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int records_parse(const char *filename, FILE *fp,
+        struct imx_image *image)
+{
+    char line[600];
+    uint32_t base = 0;
+    int lineno = 0, ihex = -1;
+
+    while (fgets(line, sizeof(line), fp)) {
+        int e;
+
+        lineno++;
+        if (line[strspn(line, " \t\r\n")] == '\0')
+            continue;
+        if (ihex < 0)
+            ihex = line[0] == ':';
+        e = ihex ? ihex_record(image, line, &base) :
+            srec_record(image, line);
+        if (e == -ENOMEM)
+            return e;
+        if (e < 0) {
+            fprintf(stderr, "%s:%d: invalid %s record\n", filename, lineno,
+                    ihex ? "HEX" : "S-record");
+            return e;
+        }
+        if (e > 0)
+            break;
+    }
+    image->format = ihex ? "Intel HEX" : "S-record";
+    return 0;
+}
+
+int imx_image_load(const char *filename, struct imx_image *image)
+{
+    uint8_t magic[4] = {0};
+    FILE *fp;
+    int e;
+
+    memset(image, 0, sizeof(*image));
+    fp = fopen(filename, "rb");
+    if (!fp) {
+        fprintf(stderr, "Unable to open %s: %s\n", filename, strerror(errno));
+        return -ENOENT;
+    }
+
+    if (fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+            memcmp(magic, "\177ELF", 4) == 0) {
+        long length;
+
+        /* Segments are taken straight from the file */
+        fseek(fp, 0, SEEK_END);
+        length = ftell(fp);
+        rewind(fp);
+        image->data = malloc(length);
+        if (!image->data) {
+            e = -ENOMEM;
+        } else if (fread(image->data, 1, length, fp) != length) {
+            e = -EIO;
+        } else {
+            image->data_len = image->data_size = length;
+            e = elf_parse(filename, image);
+        }
+    } else if (magic[0] == 'S' || magic[0] == ':') {
+        rewind(fp);
+        e = records_parse(filename, fp, image);
+    } else {
+        fprintf(stderr, "%s: not an ELF, S-record or Intel HEX file\n",
+                filename);
+        e = -EINVAL;
+    }
+    fclose(fp);
+    if (e < 0)
+        imx_image_free(image);
+    return e;
+}
+
+void imx_image_free(struct imx_image *image)
+{
+    free(image->segments);
+    free(image->data);
+    memset(image, 0, sizeof(*image));
+}
+
+static int segment_compare(const void *a, const void *b)
+{
+    const struct imx_segment *sa = a, *sb = b;
+
+    return sa->addr < sb->addr ? -1 : sa->addr > sb->addr;
+}
+
+static uint64_t segment_end(const struct imx_segment *s)
+{
+    return (uint64_t)s->addr + s->length;
+}
+
+int imx_image_coalesce(struct imx_image *image, uint32_t max_gap,
+        int zero_fill)
+{
+    struct imx_segment *merged;
+    uint8_t *data;
+    size_t data_len = 0;
+    int i, j, count = 0;
+
+    if (!zero_fill) {
+        for (i = j = 0; i < image->count; i++)
+            if (image->segments[i].offset != IMX_SEGMENT_ZERO)
+                image->segments[j++] = image->segments[i];
+        image->count = j;
+    }
+    qsort(image->segments, image->count, sizeof(*image->segments),
+            segment_compare);
+
+    /* Work out how big the merged data will be */
+    for (i = 0; i < image->count; i = j) {
+        uint64_t end = segment_end(&image->segments[i]);
+
+        for (j = i + 1; j < image->count; j++) {
+            const struct imx_segment *s = &image->segments[j];
+
+            if (s->addr < end) {
+                fprintf(stderr, "Segments overlap at 0x%8.8x\n", s->addr);
+                return -EINVAL;
+            }
+            if (s->addr - end > max_gap)
+                break;
+            end = segment_end(s);
+        }
+        data_len += end - image->segments[i].addr;
+        count++;
+    }
+
+    merged = calloc(count ? count : 1, sizeof(*merged));
+    data = calloc(data_len ? data_len : 1, 1);
+    if (!merged || !data) {
+        free(merged);
+        free(data);
+        return -ENOMEM;
+    }
+
+    /* Copy each group of segments into place, leaving the gaps zeroed */
+    data_len = 0;
+    count = 0;
+    for (i = 0; i < image->count; i = j) {
+        struct imx_segment *m = &merged[count++];
+        uint64_t end = segment_end(&image->segments[i]);
+
+        m->addr = image->segments[i].addr;
+        m->offset = data_len;
+        for (j = i; j < image->count; j++) {
+            const struct imx_segment *s = &image->segments[j];
+
+            if (j > i && s->addr - end > max_gap)
+                break;
+            if (s->offset != IMX_SEGMENT_ZERO)
+                memcpy(data + data_len + (s->addr - m->addr),
+                        image->data + s->offset, s->length);
+            end = segment_end(s);
+        }
+        m->length = end - m->addr;
+        data_len += m->length;
+    }
+
+    free(image->segments);
+    free(image->data);
+    image->segments = merged;
+    image->count = image->size = count;
+    image->data = data;
+    image->data_len = image->data_size = data_len;
+    return 0;
+}
+
+/*
+ * i.MX boot images
+ * The IVT is at the start of the file, and everything else is found from
+ * the addresses in it, relative to the IVT's own address
+ */
+
+/**
+ * Add the commands from a DCD to a table
+ * @param table DCD, starting with its header
+ * @param avail Bytes available from the start of the DCD
+ * @param table_len Returns the size of the DCD
+ */
+static int dcd_parse(const char *filename, const uint8_t *table, size_t avail,
+        struct imx_dcd *dcd, size_t *table_len)
+{
+    size_t len, pos = 4;
+
+    if (avail < 4 || table[0] != DCD_TAG_HEADER ||
+            (table[3] & 0xf0) != DCD_VERSION) {
+        fprintf(stderr, "%s: invalid DCD header\n", filename);
+        return -EINVAL;
+    }
+    len = get_be(&table[1], 2);
+    if (len < 4 || len > avail) {
+        fprintf(stderr, "%s: invalid DCD length %zd\n", filename, len);
+        return -EINVAL;
+    }
+
+    while (pos < len) {
+        const uint8_t *c = &table[pos];
+        size_t clen = len - pos >= 4 ? get_be(&c[1], 2) : 0;
+        int width = (c[3] & 7) * 8;
+        size_t i;
+        int e = 0;
+
+        if (clen < 4 || clen > len - pos) {
+            fprintf(stderr, "%s: invalid DCD command at offset %zd\n",
+                    filename, pos);
+            return -EINVAL;
+        }
+
+        switch (c[0]) {
+        case DCD_TAG_WRITE:
+            for (i = 4; i + 8 <= clen && e >= 0; i += 8)
+                e = imx_dcd_write_data(dcd, width, c[3] >> 3,
+                        get_be(&c[i], 4), get_be(&c[i + 4], 4));
+            break;
+        case DCD_TAG_CHECK:
+            if (clen != 12 && clen != 16) {
+                e = -EINVAL;
+                break;
+            }
+            e = imx_dcd_check_data(dcd, width, (c[3] >> 3) & 3,
+                    get_be(&c[4], 4), get_be(&c[8], 4),
+                    clen == 16 ? get_be(&c[12], 4) : 0);
+            break;
+        case DCD_TAG_NOP:
+            e = imx_dcd_nop(dcd);
+            break;
+        default:
+            fprintf(stderr, "%s: unsupported DCD command 0x%2.2x\n",
+                    filename, c[0]);
+            return -EINVAL;
+        }
+        if (e < 0) {
+            fprintf(stderr, "%s: invalid DCD command at offset %zd\n",
+                    filename, pos);
+            return e;
+        }
+        pos += clen;
+    }
+    *table_len = len;
+    return 0;
+}
+
+int imx_boot_image_parse(const char *filename, const uint8_t *data,
+        size_t length, struct imx_boot_image *image, struct imx_dcd *dcd)
+{
+    struct imx_image_ivt ivt;
+    struct imx_image_boot_data boot_data;
+    uint32_t self, bd_addr, dcd_addr;
+    size_t header_end = sizeof(ivt);
+    uint64_t end;
+
+    if (length < sizeof(ivt)) {
+        fprintf(stderr, "%s: too short to be a boot image\n", filename);
+        return -EINVAL;
+    }
+    memcpy(&ivt, data, sizeof(ivt));
+    if (ivt.header.tag != IMX_IMAGE_TAG_FILE_HEADER ||
+            (ivt.header.version & 0xf0) != IMX_IMAGE_VERSION) {
+        fprintf(stderr, "%s: no IVT at the start of the file\n", filename);
+        return -EINVAL;
+    }
+    self = le32toh(ivt.self);
+    bd_addr = le32toh(ivt.boot_data);
+    dcd_addr = le32toh(ivt.dcd);
+
+    if (bd_addr < self || bd_addr - self > length - sizeof(boot_data)) {
+        fprintf(stderr, "%s: boot data is outside the file\n", filename);
+        return -EINVAL;
+    }
+    memcpy(&boot_data, data + (bd_addr - self), sizeof(boot_data));
+    if (le32toh(boot_data.plugin)) {
+        fprintf(stderr, "%s: plugin images aren't supported\n", filename);
+        return -EINVAL;
+    }
+    header_end = max_size(header_end, bd_addr - self + sizeof(boot_data));
+    image->header_length = header_end;
+
+    if (dcd_addr) {
+        size_t dcd_len;
+        int e;
+
+        if (dcd_addr < self || dcd_addr - self >= length) {
+            fprintf(stderr, "%s: DCD is outside the file\n", filename);
+            return -EINVAL;
+        }
+        e = dcd_parse(filename, data + (dcd_addr - self),
+                length - (dcd_addr - self), dcd, &dcd_len);
+        if (e < 0)
+            return e;
+        header_end = max_size(header_end, dcd_addr - self + dcd_len);
+    }
+
+    /* The image may start ahead of the IVT (ie: at the start of an SD
+     * card), but only the part after the headers needs to be loaded */
+    end = (uint64_t)le32toh(boot_data.start) + le32toh(boot_data.length);
+    end = end > self ? min_size(end - self, length) : 0;
+    image->self = self;
+    image->entry = le32toh(ivt.entry);
+
+    /* mkimage pads the headers out to a fixed size, and the padding
+     * doesn't need to be sent */
+    if (image->entry >= self && image->entry - self > header_end &&
+            image->entry - self < end) {
+        size_t i, entry_offset = image->entry - self;
+
+        for (i = header_end; i < entry_offset && !data[i]; i++)
+            ;
+        if (i == entry_offset)
+            header_end = entry_offset;
+    }
+
+    image->payload_offset = header_end;
+    image->payload_addr = self + header_end;
+    image->payload_length = end > header_end ? end - header_end : 0;
+    return 0;
+}
+
+/*
+ * imximage configuration files
+ */
+struct cfg_command {
+    const char *name;
+    int check;          /* Non-zero for checks, zero for writes */
+    int op;             /* IMX_DCD_xxx */
+};
+
+static const struct cfg_command cfg_commands[] = {
+    {"DATA", 0, IMX_DCD_WRITE},
+    {"CLR_BIT", 0, IMX_DCD_CLEAR_BITS},
+    {"SET_BIT", 0, IMX_DCD_SET_BITS},
+    {"CHECK_BITS_CLR", 1, IMX_DCD_ALL_CLEAR},
+    {"CHECK_ANY_BIT_CLR", 1, IMX_DCD_ANY_CLEAR},
+    {"CHECK_BITS_SET", 1, IMX_DCD_ALL_SET},
+    {"CHECK_ANY_BIT_SET", 1, IMX_DCD_ANY_SET},
+};
+#define NCFG_COMMANDS ((sizeof(cfg_commands)) / sizeof(cfg_commands[0]))
+/* Most words on a line: a check's command, width, address, mask & count */
+#define CFG_MAX_ARGS 5
+
+/**
+ * Remove comments from a line. C style comments may carry on over several
+ * lines, so whether one is open is tracked in in_comment
+ */
+static void cfg_strip(char *line, int *in_comment)
+{
+    char *in = line, *out = line;
+
+    while (*in) {
+        if (*in_comment) {
+            if (in[0] == '*' && in[1] == '/') {
+                *in_comment = 0;
+                in++;
+            }
+            in++;
+        } else if (in[0] == '/' && in[1] == '*') {
+            *in_comment = 1;
+            in += 2;
+        } else if ((in[0] == '/' && in[1] == '/') || in[0] == '#') {
+            break;
+        } else {
+            *out++ = *in++;
+        }
+    }
+    *out = '\0';
+}
+
+static int cfg_line(struct imx_dcd *dcd, char **args, int nargs)
+{
+    uint32_t width, addr, value;
+    int i;
+
+    if (strcasecmp(args[0], "IMAGE_VERSION") == 0) {
+        if (nargs != 2 || (strcmp(args[1], "1") && strcmp(args[1], "2")))
+            return -EINVAL;
+        return 0;
+    }
+    if (strcasecmp(args[0], "BOOT_FROM") == 0 ||
+            strcasecmp(args[0], "BOOT_OFFSET") == 0)
+        return nargs == 2 ? 0 : -EINVAL;
+    if (strcasecmp(args[0], "NOP") == 0)
+        return nargs == 1 ? imx_dcd_nop(dcd) : -EINVAL;
+
+    for (i = 0; i < NCFG_COMMANDS; i++) {
+        const struct cfg_command *c = &cfg_commands[i];
+
+        if (strcasecmp(args[0], c->name) != 0)
+            continue;
+        if (nargs != 4 && !(c->check && nargs == 5))
+            return -EINVAL;
+        width = strtoul(args[1], NULL, 0);
+        addr = strtoul(args[2], NULL, 0);
+        value = strtoul(args[3], NULL, 0);
+        if (width != 1 && width != 2 && width != 4)
+            return -EINVAL;
+        if (c->check)
+            return imx_dcd_check_data(dcd, width * 8, c->op, addr, value,
+                    nargs == 5 ? strtoul(args[4], NULL, 0) : 0);
+        return imx_dcd_write_data(dcd, width * 8, c->op, addr, value);
+    }
+    return -ENOENT;
+}
+
+int imx_cfg_parse(const char *filename, struct imx_dcd *dcd)
+{
+    char line[512];
+    FILE *fp;
+    int lineno = 0, in_comment = 0, e = 0;
+
+    fp = fopen(filename, "r");
+    if (!fp) {
+        fprintf(stderr, "Unable to open %s: %s\n", filename, strerror(errno));
+        return -ENOENT;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        char *args[CFG_MAX_ARGS], *arg, *save;
+        int nargs = 0;
+
+        lineno++;
+        cfg_strip(line, &in_comment);
+        /* Files are parsed from several threads at once, so no strtok */
+        for (arg = strtok_r(line, " \t\r\n", &save); arg;
+                arg = strtok_r(NULL, " \t\r\n", &save)) {
+            if (nargs == CFG_MAX_ARGS) {
+                nargs++;
+                break;
+            }
+            args[nargs++] = arg;
+        }
+        if (!nargs)
+            continue;
+        if (nargs > CFG_MAX_ARGS) {
+            fprintf(stderr, "%s:%d: too many arguments to %s\n", filename,
+                    lineno, args[0]);
+            e = -EINVAL;
+            break;
+        }
+
+        e = cfg_line(dcd, args, nargs);
+        if (e == -ENOENT) {
+            fprintf(stderr, "%s:%d: unsupported command %s\n", filename,
+                    lineno, args[0]);
+            break;
+        }
+        if (e < 0) {
+            fprintf(stderr, "%s:%d: invalid %s\n", filename, lineno,
+                    args[0]);
+            break;
+        }
+    }
+    fclose(fp);
+    return e;
+}
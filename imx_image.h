@@ -0,0 +1,142 @@
+/**
+ * \file	imx_usb_console/imx_image.h
+ * \date	2026-Oct-16
+ * \author	Andre Renaud
+ * \copyright	Aiotec Ltd/Bluewater Systems
+ * \brief       Parsing of ELF, Motorola S-record & Intel HEX images into
+ *              the segments which need to be loaded, and of i.MX boot
+ *              images
+ */
+#ifndef IMX_IMAGE_H
+#define IMX_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "imx_usb_lib.h"
+
+/**
+ * Offset of a segment which is all zeroes (ie: ELF .bss)
+ */
+#define IMX_SEGMENT_ZERO ((size_t)-1)
+
+/**
+ * A block of memory to be loaded
+ */
+struct imx_segment {
+    uint32_t addr;
+    uint32_t length;
+    size_t offset;      /* Of the data in imx_image.data, or IMX_SEGMENT_ZERO */
+};
+
+struct imx_image {
+    const char *format; /* ie: "ELF" */
+    struct imx_segment *segments;
+    int count;
+    int size;
+    uint8_t *data;
+    size_t data_len, data_size;
+    uint32_t entry;
+    int has_entry;      /* Non-zero if the image gave an entry point */
+};
+
+/**
+ * Read an image, working out its format from its contents. Only the
+ * loadable parts of the image are kept: the ELF PT_LOAD segments (with
+ * their zero-filled tails), or the S-record/HEX data records
+ * @param filename Image to read
+ * @param image Returns the segments, to be released with imx_image_free
+ * @return < 0 on failure, >= 0 on success
+ */
+int imx_image_load(const char *filename, struct imx_image *image);
+
+/**
+ * Release all memory used by an image
+ */
+void imx_image_free(struct imx_image *image);
+
+/**
+ * Sort the segments into address order, and merge those which are close
+ * together, so that each merged segment can be sent as a single write.
+ * Gaps inside merged segments are filled with zeroes. After this, no
+ * segment is IMX_SEGMENT_ZERO
+ * @param max_gap Largest gap to fill in
+ * @param zero_fill Non-zero to load the zero-filled segments, zero to drop
+ *                  them (ie: when the image's start-up code clears its own
+ *                  .bss)
+ * @return < 0 on failure (ie: segments overlap), >= 0 on success
+ */
+int imx_image_coalesce(struct imx_image *image, uint32_t max_gap,
+        int zero_fill);
+
+/**
+ * Compile the board set-up in an imximage configuration file (as used by
+ * mkimage -T imximage) into a DCD table. The DATA, CLR_BIT, SET_BIT,
+ * CHECK_BITS_xxx, CHECK_ANY_BIT_xxx and NOP entries are added to the
+ * table. IMAGE_VERSION, BOOT_FROM & BOOT_OFFSET only affect the layout of
+ * a boot image, so are accepted and otherwise ignored
+ * @param filename Configuration file to read
+ * @param dcd Initialised table to add the entries to
+ * @return < 0 on failure, >= 0 on success
+ */
+int imx_cfg_parse(const char *filename, struct imx_dcd *dcd);
+
+/*
+ * Constants to do with the IMXIMAGE file foramt
+ */
+#define IMX_IMAGE_VERSION                  0x40
+#define IMX_IMAGE_FILE_HEADER_LENGTH     0x2000
+#define IMX_IMAGE_TAG_FILE_HEADER          0xD1
+
+struct imx_image_header
+{
+    uint8_t tag;               // see IMX_IMAGE_TAG_xxx
+    uint16_t length;           // BigEndian format
+    uint8_t version;           // for the i.MX6 this should be either 0x40 or 0x41
+} __attribute__((packed));
+
+struct imx_image_ivt
+{
+    struct imx_image_header header;
+    uint32_t entry;               // Absolute address of the first instruction to execute from the image
+    uint32_t reserved1;
+    uint32_t dcd;              // Absolute address of the image DCD. The DCD is optional so this field may be set to NULL if no DCD is required
+    uint32_t boot_data;        // Absolute address of the Boot Data
+    uint32_t self;             // Absolute address of the IVT
+    uint32_t csf;              // Absolute address of Command Sequence File (CSF) used by the HAB library
+    uint32_t reserved2;
+} __attribute__((packed));
+
+struct imx_image_boot_data
+{
+    uint32_t start;            // Absolute address the image is loaded to, including the IVT
+    uint32_t length;           // Size of the image
+    uint32_t plugin;           // Non-zero if the image is a plugin
+} __attribute__((packed));
+
+/**
+ * Layout of an i.MX boot image (ie: u-boot.imx), as described by its IVT
+ */
+struct imx_boot_image {
+    uint32_t self;              /* Address of the IVT */
+    uint32_t entry;
+    size_t header_length;       /* Of the IVT & boot data, from the start */
+    uint32_t payload_addr;      /* Where the code & data after the headers go */
+    size_t payload_offset;      /* Of the payload in the file */
+    size_t payload_length;
+};
+
+/**
+ * Find the parts of an i.MX boot image, and decode its DCD
+ * @param filename Name of the image, for error messages
+ * @param data Contents of the image file
+ * @param length Size of the file
+ * @param image Returns the layout of the image
+ * @param dcd Initialised table, which the DCD's commands are added to.
+ *            Left empty if the image has no DCD
+ * @return < 0 on failure, >= 0 on success
+ */
+int imx_boot_image_parse(const char *filename, const uint8_t *data,
+        size_t length, struct imx_boot_image *image, struct imx_dcd *dcd);
+
+#endif
@@ -0,0 +1,561 @@
+/**
+ * \file	imx_usb_console/imx_server.c
+ * \date	2026-Oct-16
+ * \author	Andre Renaud
+ * \copyright	Aiotec Ltd/Bluewater Systems
+ * \brief       Local socket server, so that a resident console can run
+ *              commands on behalf of other processes
+ * \description
+ * The server is a single poll loop. Clients are never waited on: their
+ * commands are collected as they arrive, and replies are queued until the
+ * client reads them. Commands themselves run to completion one at a time,
+ * with stdout & stderr redirected into a temporary file so that whatever
+ * they print can be sent back as the reply.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "imx_server.h"
+
+/* Longest command accepted */
+#define SERVER_LINE_MAX 1024
+/* A client's commands aren't run while this much output is waiting for it */
+#define SERVER_OUT_MAX (256 * 1024)
+#define SERVER_MAX_CLIENTS 32
+
+#define max_size(a,b) (((a) > (b)) ? (a) : (b))
+
+struct client {
+    int fd;
+    char in[SERVER_LINE_MAX];
+    int in_len;
+    char *out;
+    size_t out_len, out_sent, out_size;
+    int eof;            /* Client has finished sending */
+    int dead;           /* Connection has failed */
+    int failed;         /* A command has failed, so the rest are cancelled */
+    int overflow;       /* Discarding the rest of a command which was too long */
+};
+
+struct server {
+    int fd;
+    FILE *capture;      /* Collects the output of each command */
+    int saved_stdout, saved_stderr;
+    struct client *clients[SERVER_MAX_CLIENTS];
+    int nclients;
+    int next;           /* Client to take the next command from */
+    imx_server_cb command;
+    void *user_data;
+};
+
+static int socket_address(const char *path, struct sockaddr_un *sun)
+{
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun->sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -ENAMETOOLONG;
+    }
+    strcpy(sun->sun_path, path);
+    return 0;
+}
+
+/**
+ * Check whether anything is still listening on a socket
+ */
+static int socket_in_use(const struct sockaddr_un *sun)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int in_use;
+
+    if (fd < 0)
+        return 0;
+    in_use = connect(fd, (const struct sockaddr *)sun, sizeof(*sun)) == 0;
+    close(fd);
+    return in_use;
+}
+
+static int server_listen(const char *path)
+{
+    struct sockaddr_un sun;
+    int fd, e;
+
+    e = socket_address(path, &sun);
+    if (e < 0)
+        return e;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        e = -errno;
+        perror("socket");
+        return e;
+    }
+    e = bind(fd, (struct sockaddr *)&sun, sizeof(sun));
+    if (e < 0 && errno == EADDRINUSE && !socket_in_use(&sun)) {
+        /* Left behind by a server which didn't shut down cleanly */
+        unlink(path);
+        e = bind(fd, (struct sockaddr *)&sun, sizeof(sun));
+    }
+    if (e >= 0)
+        e = listen(fd, 16);
+    if (e < 0) {
+        e = -errno;
+        fprintf(stderr, "Unable to listen on %s: %s\n", path, strerror(-e));
+        close(fd);
+        return e;
+    }
+    return fd;
+}
+
+static int out_append(struct client *c, size_t length)
+{
+    if (c->out_len + length > c->out_size) {
+        size_t size = max_size(c->out_size * 2, c->out_len + length);
+        char *out = realloc(c->out, size);
+
+        if (!out)
+            return -ENOMEM;
+        c->out = out;
+        c->out_size = size;
+    }
+    return 0;
+}
+
+/**
+ * Length of the next complete command from a client, including its
+ * terminator, or 0 if there isn't one yet
+ */
+static int client_line(struct client *c)
+{
+    char *end = memchr(c->in, '\n', c->in_len);
+
+    if (end)
+        return end - c->in + 1;
+    /* Too long to ever be complete, or the last command had no newline */
+    if (c->in_len == sizeof(c->in) || (c->eof && c->in_len))
+        return c->in_len;
+    return 0;
+}
+
+static int client_ready(struct client *c)
+{
+    return !c->dead && client_line(c) &&
+        c->out_len - c->out_sent < SERVER_OUT_MAX;
+}
+
+/**
+ * Run a command with its output redirected into the capture file
+ * @return Result of the command
+ */
+static int server_execute(struct server *s, char *line)
+{
+    int e;
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(fileno(s->capture), STDOUT_FILENO);
+    dup2(fileno(s->capture), STDERR_FILENO);
+    e = s->command(line, s->user_data);
+    fflush(stdout);
+    fflush(stderr);
+    dup2(s->saved_stdout, STDOUT_FILENO);
+    dup2(s->saved_stderr, STDERR_FILENO);
+    return e;
+}
+
+/**
+ * Run a client's next command, and queue up the reply
+ */
+static void server_run_line(struct server *s, struct client *c)
+{
+    int len = client_line(c);
+    char line[SERVER_LINE_MAX + 1];
+    char header[32];
+    int capture = fileno(s->capture);
+    off_t output = 0;
+    int e, hlen;
+
+    memcpy(line, c->in, len);
+    line[len] = '\0';
+    c->in_len -= len;
+    memmove(c->in, c->in + len, c->in_len);
+    if (c->overflow) {
+        /* The rejected command carries on up to the next newline */
+        c->overflow = line[len - 1] != '\n';
+        return;
+    }
+    if (line[len - 1] != '\n' && !c->eof) {
+        c->overflow = 1;
+        fprintf(s->capture, "Command too long\n");
+        fflush(s->capture);
+        e = -E2BIG;
+    } else if (c->failed) {
+        e = -ECANCELED;
+    } else {
+        line[strcspn(line, "\r\n")] = '\0';
+        e = server_execute(s, line);
+    }
+    output = lseek(capture, 0, SEEK_END);
+    if (output < 0)
+        output = 0;
+    if (e < 0)
+        c->failed = 1;
+
+    hlen = snprintf(header, sizeof(header), "%d %ld\n", e, (long)output);
+    if (out_append(c, hlen + output) < 0) {
+        c->dead = 1;
+    } else {
+        memcpy(c->out + c->out_len, header, hlen);
+        c->out_len += hlen;
+        if (output > 0 &&
+                pread(capture, c->out + c->out_len, output, 0) == output)
+            c->out_len += output;
+        else if (output > 0)
+            c->dead = 1;
+    }
+    if (ftruncate(capture, 0) < 0 || lseek(capture, 0, SEEK_SET) < 0)
+        perror("capture");
+}
+
+static void client_read(struct client *c)
+{
+    ssize_t n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+
+    if (n > 0)
+        c->in_len += n;
+    else if (n == 0)
+        c->eof = 1;
+    else if (errno != EAGAIN && errno != EINTR)
+        c->dead = 1;
+}
+
+static void client_write(struct client *c)
+{
+    ssize_t n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent,
+            MSG_NOSIGNAL);
+
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EINTR)
+            c->dead = 1;
+        return;
+    }
+    c->out_sent += n;
+    if (c->out_sent == c->out_len)
+        c->out_sent = c->out_len = 0;
+}
+
+static void client_close(struct client *c)
+{
+    close(c->fd);
+    free(c->out);
+    free(c);
+}
+
+static void server_accept(struct server *s)
+{
+    struct client *c;
+    int fd;
+
+    fd = accept(s->fd, NULL, NULL);
+    if (fd < 0)
+        return;
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    c = calloc(1, sizeof(*c));
+    if (!c) {
+        close(fd);
+        return;
+    }
+    c->fd = fd;
+    s->clients[s->nclients++] = c;
+}
+
+/**
+ * Run the next command, taking turns between the clients
+ */
+static void server_run_next(struct server *s)
+{
+    int i;
+
+    for (i = 0; i < s->nclients; i++) {
+        int n = (s->next + i) % s->nclients;
+
+        if (client_ready(s->clients[n])) {
+            server_run_line(s, s->clients[n]);
+            s->next = n + 1;
+            return;
+        }
+    }
+}
+
+/**
+ * Drop clients which have gone, or which have had all their replies
+ */
+static void server_reap(struct server *s)
+{
+    int i = 0;
+
+    while (i < s->nclients) {
+        struct client *c = s->clients[i];
+
+        if (c->dead || (c->eof && !c->in_len && !c->out_len)) {
+            client_close(c);
+            s->clients[i] = s->clients[--s->nclients];
+        } else {
+            i++;
+        }
+    }
+}
+
+int imx_server_run(const char *path, imx_server_cb command, void *user_data,
+        volatile sig_atomic_t *stop)
+{
+    struct server s = {0};
+    int e = 0, i;
+
+    s.command = command;
+    s.user_data = user_data;
+    s.fd = server_listen(path);
+    if (s.fd < 0)
+        return s.fd;
+    s.capture = tmpfile();
+    s.saved_stdout = dup(STDOUT_FILENO);
+    s.saved_stderr = dup(STDERR_FILENO);
+    if (!s.capture || s.saved_stdout < 0 || s.saved_stderr < 0) {
+        e = -errno;
+        perror("Unable to capture command output");
+        goto out;
+    }
+
+    while (!*stop) {
+        struct pollfd fds[SERVER_MAX_CLIENTS + 1];
+        int ready = 0;
+
+        for (i = 0; i < s.nclients; i++) {
+            struct client *c = s.clients[i];
+
+            fds[i].fd = c->fd;
+            fds[i].events = 0;
+            if (!c->eof && c->in_len < (int)sizeof(c->in) &&
+                    c->out_len - c->out_sent < SERVER_OUT_MAX)
+                fds[i].events |= POLLIN;
+            if (c->out_len)
+                fds[i].events |= POLLOUT;
+            ready |= client_ready(c);
+        }
+        fds[i].fd = s.fd;
+        fds[i].events = s.nclients < SERVER_MAX_CLIENTS ? POLLIN : 0;
+
+        if (poll(fds, s.nclients + 1, ready ? 0 : -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            e = -errno;
+            perror("poll");
+            break;
+        }
+
+        for (i = 0; i < s.nclients; i++) {
+            if ((fds[i].events & POLLIN) &&
+                    (fds[i].revents & (POLLIN | POLLHUP)))
+                client_read(s.clients[i]);
+            if (fds[i].revents & POLLOUT)
+                client_write(s.clients[i]);
+            if (fds[i].revents & POLLERR)
+                s.clients[i]->dead = 1;
+        }
+        if (fds[s.nclients].revents & POLLIN)
+            server_accept(&s);
+        server_run_next(&s);
+        server_reap(&s);
+    }
+
+out:
+    for (i = 0; i < s.nclients; i++)
+        client_close(s.clients[i]);
+    if (s.capture)
+        fclose(s.capture);
+    if (s.saved_stdout >= 0)
+        close(s.saved_stdout);
+    if (s.saved_stderr >= 0)
+        close(s.saved_stderr);
+    close(s.fd);
+    unlink(path);
+    return e;
+}
+
+/**
+ * Print the output of each complete reply
+ * @return Number of replies reporting a failure
+ */
+static int client_replies(char *buf, size_t *len)
+{
+    int failed = 0;
+
+    for (;;) {
+        char *end = memchr(buf, '\n', *len);
+        size_t hlen, output;
+        int result;
+
+        if (!end)
+            break;
+        hlen = end - buf + 1;
+        if (sscanf(buf, "%d %zu", &result, &output) != 2)
+            return -EPROTO;
+        if (*len < hlen + output)
+            break;
+        fwrite(buf + hlen, 1, output, stdout);
+        fflush(stdout);
+        if (result < 0)
+            failed++;
+        *len -= hlen + output;
+        memmove(buf, buf + hlen + output, *len);
+    }
+    return failed;
+}
+
+int imx_client_run(const char *path, char **scripts, int count)
+{
+    struct sockaddr_un sun;
+    char send_buf[4096];
+    int send_len = 0, send_pos = 0;
+    char *reply = NULL;
+    size_t reply_len = 0, reply_size = 0;
+    int input = count ? -1 : STDIN_FILENO;
+    int next_script = 0, input_done = 0, shut = 0;
+    char last = '\n';
+    int fd, e, failed = 0;
+
+    e = socket_address(path, &sun);
+    if (e < 0)
+        return e;
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+        e = -errno;
+        fprintf(stderr, "Unable to connect to %s: %s\n", path, strerror(-e));
+        if (fd >= 0)
+            close(fd);
+        return e;
+    }
+
+    for (;;) {
+        struct pollfd fds[2];
+        int nfds = 1;
+
+        /* Move on to the next script once the last one has been sent */
+        while (send_pos == send_len && input < 0 && !input_done) {
+            if (next_script == count) {
+                input_done = 1;
+                break;
+            }
+            input = open(scripts[next_script], O_RDONLY | O_CLOEXEC);
+            if (input < 0) {
+                fprintf(stderr, "Unable to open %s: %s\n",
+                        scripts[next_script], strerror(errno));
+                failed++;
+                input_done = 1;
+            }
+            next_script++;
+        }
+        if (send_pos == send_len && input_done && !shut) {
+            /* Lets the server know it has all the commands */
+            shutdown(fd, SHUT_WR);
+            shut = 1;
+        }
+
+        fds[0].fd = fd;
+        fds[0].events = POLLIN | (send_pos < send_len ? POLLOUT : 0);
+        if (send_pos == send_len && input >= 0) {
+            fds[1].fd = input;
+            fds[1].events = POLLIN;
+            nfds = 2;
+        }
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            e = -errno;
+            perror("poll");
+            break;
+        }
+
+        if (nfds == 2 && fds[1].revents) {
+            ssize_t n = read(input, send_buf, sizeof(send_buf));
+
+            send_pos = 0;
+            send_len = n > 0 ? n : 0;
+            if (n > 0) {
+                last = send_buf[n - 1];
+            } else {
+                /* Each script's last command is complete, even without
+                 * a newline */
+                if (last != '\n') {
+                    send_buf[send_len++] = '\n';
+                    last = '\n';
+                }
+                if (input != STDIN_FILENO)
+                    close(input);
+                else
+                    input_done = 1;
+                input = -1;
+            }
+        }
+
+        if (fds[0].revents & POLLOUT) {
+            ssize_t n = send(fd, send_buf + send_pos, send_len - send_pos,
+                    MSG_NOSIGNAL);
+
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                e = -errno;
+                fprintf(stderr, "Lost connection to %s\n", path);
+                break;
+            }
+            if (n > 0)
+                send_pos += n;
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n;
+            int f;
+
+            if (reply_size - reply_len < 4096) {
+                char *r = realloc(reply, reply_size + 65536);
+
+                if (!r) {
+                    e = -ENOMEM;
+                    break;
+                }
+                reply = r;
+                reply_size += 65536;
+            }
+            n = recv(fd, reply + reply_len, reply_size - reply_len, 0);
+            if (n <= 0) {
+                if (n < 0 || reply_len || !input_done) {
+                    e = n < 0 ? -errno : -ECONNRESET;
+                    fprintf(stderr, "Lost connection to %s\n", path);
+                }
+                break;
+            }
+            reply_len += n;
+            f = client_replies(reply, &reply_len);
+            if (f < 0) {
+                e = f;
+                fprintf(stderr, "Invalid reply from %s\n", path);
+                break;
+            }
+            failed += f;
+        }
+    }
+
+    if (input >= 0 && input != STDIN_FILENO)
+        close(input);
+    free(reply);
+    close(fd);
+    return e < 0 ? e : failed;
+}
@@ -0,0 +1,55 @@
+/**
+ * \file	imx_usb_console/imx_server.h
+ * \date	2026-Oct-16
+ * \author	Andre Renaud
+ * \copyright	Aiotec Ltd/Bluewater Systems
+ * \brief       Local socket server, so that a resident console can run
+ *              commands on behalf of other processes
+ * \description
+ * Clients connect to a UNIX domain socket and send commands, one per line.
+ * They don't need to wait for one reply before sending the next command.
+ * Every command gets a reply, in the order the commands were sent:
+ *      <result> <length>\n
+ *      <length bytes of output>
+ * where result is the command's return value (< 0 on failure), and the
+ * output is everything the command printed to stdout & stderr. Once a
+ * command has failed, the rest of the commands on that connection are not
+ * run, and are answered with -ECANCELED, as for a script.
+ */
+#ifndef IMX_SERVER_H
+#define IMX_SERVER_H
+
+#include <signal.h>
+
+/**
+ * Run a single command
+ * @param line Command, without the trailing newline. May be modified
+ * @return < 0 on failure, >= 0 on success
+ */
+typedef int (*imx_server_cb)(char *line, void *user_data);
+
+/**
+ * Accept connections on a socket, running each client's commands as they
+ * arrive. Commands are run one at a time, taking turns between clients.
+ * Returns once stop has been set (ie: from a signal handler)
+ * @param path Filesystem path of the socket. A stale socket left behind by
+ *             a previous server is replaced
+ * @param command Called to run each command
+ * @param stop Set to non-zero to shut the server down
+ * @return < 0 if the server could not be started, otherwise 0
+ */
+int imx_server_run(const char *path, imx_server_cb command, void *user_data,
+        volatile sig_atomic_t *stop);
+
+/**
+ * Send commands to a server, printing the output of each as it comes back
+ * @param path Filesystem path of the server's socket
+ * @param scripts Files to send the commands from. If there are none, they
+ *                are read from stdin
+ * @param count Number of entries in scripts
+ * @return < 0 if the server could not be reached, otherwise the number of
+ *         commands which failed
+ */
+int imx_client_run(const char *path, char **scripts, int count);
+
+#endif
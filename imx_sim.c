@@ -0,0 +1,875 @@
+/**
+ * \file	imx_usb_console/imx_sim.c
+ * \date	2026-Oct-16
+ * \author	Andre Renaud
+ * \copyright	Aiotec Ltd/Bluewater Systems
+ * \brief       Simulated i.MX?? boot ROM, for running without hardware
+ * \description
+ * Implements the transport operations on top of a model of the ROM's Serial
+ * Download Protocol handler. Reports sent to the device are decoded as they
+ * complete, and the replies they generate are queued up for the interrupt IN
+ * endpoint, as they would be by the real ROM.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "imx_sim.h"
+#include "imx_transport.h"
+
+#define min(a,b) (((a) < (b)) ? (a) : (b))
+#define max(a,b) (((a) > (b)) ? (a) : (b))
+
+#define SIM_PAGE_SIZE   4096
+#define SIM_HASH_SIZE   1024
+/* How long an IN transfer waits for a reply before timing out */
+#define SIM_TIMEOUT_US  1000000
+/* Throughput of the bus, which limits how closely transfers can follow
+ * each other (roughly that of USB 2.0 high speed) */
+#define SIM_BYTES_PER_US 40
+/* Status reported when a DCD or jump fails */
+#define SIM_STATUS_FAILED 0x33333333
+/* Tag the ROM expects to find at a jump address */
+#define SIM_IVT_TAG     0xD1
+
+enum {
+    SIM_IDLE,           /* Waiting for a command */
+    SIM_WRITE_FILE,     /* Receiving WRITE_FILE data */
+    SIM_DCD_WRITE,      /* Receiving a DCD table */
+    SIM_SDPS,           /* Receiving an SDPS boot image */
+    SIM_BOOTED,         /* Jumped out of the ROM; the device has gone */
+};
+
+struct sim_page {
+    uint32_t base;
+    struct sim_page *next;
+    uint8_t data[SIM_PAGE_SIZE];
+};
+
+/* Report waiting to be read from the interrupt IN endpoint */
+struct sim_reply {
+    struct sim_reply *next;
+    uint64_t ready;     /* Time the device produced it */
+    int len;
+    uint8_t report[65];
+};
+
+/* Asynchronous transfer in flight */
+struct sim_pending {
+    struct sim_pending *next;
+    struct imx_transfer *xfer;
+    uint64_t due;       /* Time the transfer completes */
+};
+
+struct sim_queue {
+    struct sim_pending *head;
+    struct sim_pending *tail;
+};
+
+struct sim_device {
+    const struct imx_soc *soc;
+    uint64_t latency;
+    struct sim_page *pages[SIM_HASH_SIZE];
+
+    /* Command in progress */
+    int state;
+    uint32_t addr;
+    uint32_t remaining;
+    uint8_t *dcd;
+    int dcd_len;
+    uint32_t last_status;
+
+    struct sim_reply *replies;
+    struct sim_reply *replies_tail;
+
+    struct sim_queue out;       /* SET_REPORT/interrupt OUT, in order */
+    struct sim_queue in;        /* Interrupt IN, in order */
+    struct sim_queue done;      /* Cancelled/failed, awaiting callbacks */
+    uint64_t last_out;          /* Completion time of the last OUT transfer */
+    uint64_t last_in;           /* Completion time of the last IN transfer */
+    int timer_fd;               /* See sim_pollfds, or -1 */
+};
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Work out when a transfer submitted now completes, given the transfers
+ * ahead of it on the same endpoint
+ * @param last Completion time of the previous transfer, updated
+ */
+static uint64_t sim_due(struct sim_device *sim, uint64_t *last, int len,
+        uint64_t ready)
+{
+    uint64_t due = max(now_us() + sim->latency, ready);
+
+    due = max(due, *last + len / SIM_BYTES_PER_US);
+    *last = due;
+    return due;
+}
+
+static void sleep_until(uint64_t when)
+{
+    struct timespec ts;
+
+    if (when <= now_us())
+        return;
+    ts.tv_sec = when / 1000000;
+    ts.tv_nsec = (when % 1000000) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/*
+ * Target memory
+ */
+static struct sim_page *sim_page(struct sim_device *sim, uint32_t addr,
+        int create)
+{
+    uint32_t base = addr & ~(SIM_PAGE_SIZE - 1);
+    int bucket = (base / SIM_PAGE_SIZE) % SIM_HASH_SIZE;
+    struct sim_page *page;
+
+    for (page = sim->pages[bucket]; page; page = page->next)
+        if (page->base == base)
+            return page;
+    if (!create)
+        return NULL;
+
+    page = calloc(1, sizeof(*page));
+    if (!page)
+        return NULL;
+    page->base = base;
+    page->next = sim->pages[bucket];
+    sim->pages[bucket] = page;
+    return page;
+}
+
+static void sim_write(struct sim_device *sim, uint32_t addr,
+        const uint8_t *data, uint32_t len)
+{
+    while (len) {
+        struct sim_page *page = sim_page(sim, addr, 1);
+        uint32_t offset = addr & (SIM_PAGE_SIZE - 1);
+        uint32_t this_len = min(len, SIM_PAGE_SIZE - offset);
+
+        if (!page)
+            return;
+        memcpy(&page->data[offset], data, this_len);
+        addr += this_len;
+        data += this_len;
+        len -= this_len;
+    }
+}
+
+static void sim_read(struct sim_device *sim, uint32_t addr, uint8_t *data,
+        uint32_t len)
+{
+    while (len) {
+        struct sim_page *page = sim_page(sim, addr, 0);
+        uint32_t offset = addr & (SIM_PAGE_SIZE - 1);
+        uint32_t this_len = min(len, SIM_PAGE_SIZE - offset);
+
+        if (page)
+            memcpy(data, &page->data[offset], this_len);
+        else
+            memset(data, 0, this_len);
+        addr += this_len;
+        data += this_len;
+        len -= this_len;
+    }
+}
+
+static uint32_t sim_read_reg(struct sim_device *sim, uint32_t addr, int bytes)
+{
+    uint32_t value = 0;
+
+    sim_read(sim, addr, (uint8_t *)&value, bytes);
+    return le32toh(value);
+}
+
+static void sim_write_reg(struct sim_device *sim, uint32_t addr, int bytes,
+        uint32_t value)
+{
+    value = htole32(value);
+    sim_write(sim, addr, (uint8_t *)&value, bytes);
+}
+
+/*
+ * Replies
+ */
+static void sim_reply(struct sim_device *sim, uint64_t when, uint8_t id,
+        const uint8_t *data, int len)
+{
+    struct sim_reply *r = calloc(1, sizeof(*r));
+
+    if (!r)
+        return;
+    r->ready = when;
+    r->report[0] = id;
+    memcpy(&r->report[1], data, len);
+    r->len = len + 1;
+    if (sim->replies_tail)
+        sim->replies_tail->next = r;
+    else
+        sim->replies = r;
+    sim->replies_tail = r;
+}
+
+static void sim_reply_word(struct sim_device *sim, uint64_t when, uint8_t id,
+        uint32_t word, int len)
+{
+    uint8_t data[64] = {0};
+
+    word = htonl(word);
+    memcpy(data, &word, sizeof(word));
+    sim_reply(sim, when, id, data, len);
+}
+
+static void sim_reply_hab(struct sim_device *sim, uint64_t when)
+{
+    sim_reply_word(sim, when, 3, HAB_ENGINEERING_STATUS, 4);
+}
+
+static void sim_reply_status(struct sim_device *sim, uint64_t when,
+        uint32_t status)
+{
+    sim->last_status = status;
+    sim_reply_word(sim, when, 4, status, 64);
+}
+
+static void sim_flush_replies(struct sim_device *sim)
+{
+    while (sim->replies) {
+        struct sim_reply *r = sim->replies;
+        sim->replies = r->next;
+        free(r);
+    }
+    sim->replies_tail = NULL;
+}
+
+/*
+ * DCD execution
+ */
+static uint32_t get_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+        ((uint32_t)p[2] << 8) | p[3];
+}
+
+static int sim_dcd_check(struct sim_device *sim, int cond, int bytes,
+        uint32_t addr, uint32_t mask)
+{
+    uint32_t value = sim_read_reg(sim, addr, bytes) & mask;
+    int pass = 0;
+
+    /* Nothing else changes memory while the DCD runs, so a check which
+     * fails the first time would only ever time out */
+    switch (cond) {
+    case IMX_DCD_ALL_CLEAR:
+        pass = value == 0;
+        break;
+    case IMX_DCD_ANY_CLEAR:
+        pass = value != mask;
+        break;
+    case IMX_DCD_ALL_SET:
+        pass = value == mask;
+        break;
+    case IMX_DCD_ANY_SET:
+        pass = value != 0;
+        break;
+    }
+    if (pass)
+        return 0;
+
+    fprintf(stderr, "sim: DCD check of 0x%8.8x & 0x%8.8x never passed\n",
+            addr, mask);
+    return -ETIMEDOUT;
+}
+
+static int sim_dcd_run(struct sim_device *sim, const uint8_t *dcd, int len)
+{
+    int pos = 4;
+
+    if (len < 4 || dcd[0] != DCD_TAG_HEADER || dcd[3] != DCD_VERSION ||
+            ((dcd[1] << 8) | dcd[2]) != len) {
+        fprintf(stderr, "sim: Invalid DCD header\n");
+        return -EINVAL;
+    }
+
+    while (pos + 4 <= len) {
+        uint8_t tag = dcd[pos];
+        int cmd_len = (dcd[pos + 1] << 8) | dcd[pos + 2];
+        uint8_t param = dcd[pos + 3];
+        int bytes = param & 7;
+        const uint8_t *p = &dcd[pos + 4];
+        int e = 0;
+
+        if (cmd_len < 4 || pos + cmd_len > len) {
+            fprintf(stderr, "sim: Invalid DCD command length %d\n", cmd_len);
+            return -EINVAL;
+        }
+        if (tag != DCD_TAG_NOP && bytes != 1 && bytes != 2 && bytes != 4) {
+            fprintf(stderr, "sim: Invalid DCD width %d\n", bytes);
+            return -EINVAL;
+        }
+
+        if (tag == DCD_TAG_WRITE) {
+            for (; p + 8 <= &dcd[pos + cmd_len]; p += 8) {
+                uint32_t addr = get_be32(p);
+                uint32_t value = get_be32(p + 4);
+                uint32_t old = sim_read_reg(sim, addr, bytes);
+
+                switch (param >> 3) {
+                case IMX_DCD_WRITE:
+                    break;
+                case IMX_DCD_CLEAR_BITS:
+                    value = old & ~value;
+                    break;
+                case IMX_DCD_SET_BITS:
+                    value = old | value;
+                    break;
+                default:
+                    fprintf(stderr, "sim: Invalid DCD write flags 0x%x\n",
+                            param);
+                    return -EINVAL;
+                }
+                sim_write_reg(sim, addr, bytes, value);
+            }
+        } else if (tag == DCD_TAG_CHECK) {
+            uint32_t addr, mask;
+
+            if (cmd_len != 12 && cmd_len != 16) {
+                fprintf(stderr, "sim: Invalid DCD check length %d\n", cmd_len);
+                return -EINVAL;
+            }
+            addr = get_be32(p);
+            mask = get_be32(p + 4);
+            e = sim_dcd_check(sim, param >> 3, bytes, addr, mask);
+        } else if (tag != DCD_TAG_NOP) {
+            fprintf(stderr, "sim: Invalid DCD tag 0x%x\n", tag);
+            return -EINVAL;
+        }
+        if (e < 0)
+            return e;
+        pos += cmd_len;
+    }
+
+    return 0;
+}
+
+/*
+ * Command handling
+ */
+static void sim_command(struct sim_device *sim, uint64_t when,
+        const struct sdp_command *cmd)
+{
+    uint32_t addr = ntohl(cmd->address);
+    uint32_t count = ntohl(cmd->data_count);
+    uint8_t data[64];
+
+    sim->state = SIM_IDLE;
+    switch (ntohs(cmd->command_type)) {
+    case SDP_READ_REGISTER:
+        sim_reply_hab(sim, when);
+        while (count) {
+            int this_len = min(count, sizeof(data));
+
+            memset(data, 0, sizeof(data));
+            sim_read(sim, addr, data, this_len);
+            sim_reply(sim, when, 4, data, sizeof(data));
+            addr += this_len;
+            count -= this_len;
+        }
+        break;
+
+    case SDP_WRITE_REGISTER:
+        sim_write_reg(sim, addr, cmd->format / 8, ntohl(cmd->data));
+        sim_reply_hab(sim, when);
+        sim_reply_status(sim, when, STATUS_WRITE_COMPLETE);
+        break;
+
+    case SDP_WRITE_FILE:
+        sim->state = SIM_WRITE_FILE;
+        sim->addr = addr;
+        sim->remaining = count;
+        break;
+
+    case SDP_DCD_WRITE:
+        if (count > DCD_MAX_BYTES) {
+            sim_reply_hab(sim, when);
+            sim_reply_status(sim, when, SIM_STATUS_FAILED);
+            break;
+        }
+        sim->state = SIM_DCD_WRITE;
+        sim->addr = addr;
+        sim->remaining = count;
+        sim->dcd_len = 0;
+        break;
+
+    case SDP_ERROR_STATUS:
+        sim_reply_hab(sim, when);
+        sim_reply_word(sim, when, 4, sim->last_status, 64);
+        break;
+
+    case SDP_JUMP_ADDRESS:
+        sim_reply_hab(sim, when);
+        sim_read(sim, addr, data, 1);
+        if (data[0] == SIM_IVT_TAG) {
+            sim->state = SIM_BOOTED;
+        } else {
+            fprintf(stderr, "sim: No IVT at 0x%8.8x\n", addr);
+            sim_reply_status(sim, when, SIM_STATUS_FAILED);
+        }
+        break;
+
+    default:
+        fprintf(stderr, "sim: Unknown command 0x%4.4x\n",
+                ntohs(cmd->command_type));
+        break;
+    }
+}
+
+static void sim_data(struct sim_device *sim, uint64_t when,
+        const uint8_t *data, int len)
+{
+    len = min(len, sim->remaining);
+    switch (sim->state) {
+    case SIM_WRITE_FILE:
+    case SIM_SDPS:
+        sim_write(sim, sim->addr, data, len);
+        break;
+    case SIM_DCD_WRITE:
+        memcpy(sim->dcd + sim->dcd_len, data, len);
+        sim->dcd_len += len;
+        break;
+    default:
+        return;
+    }
+    sim->addr += len;
+    sim->remaining -= len;
+    if (sim->remaining)
+        return;
+
+    switch (sim->state) {
+    case SIM_WRITE_FILE:
+        sim_reply_hab(sim, when);
+        sim_reply_status(sim, when, STATUS_FILE_COMPLETE);
+        sim->state = SIM_IDLE;
+        break;
+    case SIM_DCD_WRITE:
+        sim_write(sim, sim->addr - sim->dcd_len, sim->dcd, sim->dcd_len);
+        sim_reply_hab(sim, when);
+        if (sim_dcd_run(sim, sim->dcd, sim->dcd_len) < 0)
+            sim_reply_status(sim, when, SIM_STATUS_FAILED);
+        else
+            sim_reply_status(sim, when, STATUS_WRITE_COMPLETE);
+        sim->state = SIM_IDLE;
+        break;
+    case SIM_SDPS:
+        /* The image boots as soon as it has all arrived */
+        sim->state = SIM_BOOTED;
+        break;
+    }
+}
+
+/**
+ * Process a report sent to the device
+ * @return < 0 if the device rejected it
+ */
+static int sim_out(struct sim_device *sim, uint64_t when,
+        const uint8_t *report, int len)
+{
+    if (sim->state == SIM_BOOTED)
+        return LIBUSB_ERROR_NO_DEVICE;
+    if (len < 1)
+        return LIBUSB_ERROR_PIPE;
+
+    if (report[0] == 1 && sim->soc->protocol == IMX_PROTOCOL_SDPS) {
+        const struct sdps_command *cmd = (const struct sdps_command *)report;
+
+        if (len < sizeof(*cmd) || le32toh(cmd->signature) != BLTC_SIGNATURE ||
+                cmd->command != BLTC_DOWNLOAD_FW)
+            return LIBUSB_ERROR_PIPE;
+        sim->state = SIM_SDPS;
+        sim->addr = 0;
+        sim->remaining = ntohl(cmd->length);
+        return len;
+    }
+
+    switch (report[0]) {
+    case 1:
+        if (len < sizeof(struct sdp_command))
+            return LIBUSB_ERROR_PIPE;
+        sim_command(sim, when, (const struct sdp_command *)report);
+        return len;
+    case 2:
+        if (sim->state == SIM_IDLE)
+            return LIBUSB_ERROR_PIPE;
+        sim_data(sim, when, &report[1], len - 1);
+        return len;
+    default:
+        return LIBUSB_ERROR_PIPE;
+    }
+}
+
+/**
+ * Take the next reply from the interrupt IN endpoint
+ * @return Number of bytes copied to report
+ */
+static int sim_in(struct sim_device *sim, uint8_t *report, int len)
+{
+    struct sim_reply *r = sim->replies;
+
+    sim->replies = r->next;
+    if (!sim->replies)
+        sim->replies_tail = NULL;
+    len = min(len, r->len);
+    memcpy(report, r->report, len);
+    free(r);
+    return len;
+}
+
+/*
+ * Transport operations
+ */
+static int sim_set_report(void *priv, uint8_t *report, int len,
+        unsigned int timeout)
+{
+    struct sim_device *sim = priv;
+    uint64_t when = sim_due(sim, &sim->last_out, len, 0);
+
+    sleep_until(when);
+    return sim_out(sim, when, report, len);
+}
+
+static int sim_read_report(void *priv, uint8_t *report, int len, int *actual,
+        unsigned int timeout)
+{
+    struct sim_device *sim = priv;
+
+    *actual = 0;
+    if (!sim->replies) {
+        if (sim->state == SIM_BOOTED)
+            return LIBUSB_ERROR_NO_DEVICE;
+        sleep_until(now_us() + timeout * 1000);
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+
+    sleep_until(sim_due(sim, &sim->last_in, len, sim->replies->ready));
+    *actual = sim_in(sim, report, len);
+    return 0;
+}
+
+static void queue_add(struct sim_queue *q, struct sim_pending *p)
+{
+    p->next = NULL;
+    if (q->tail)
+        q->tail->next = p;
+    else
+        q->head = p;
+    q->tail = p;
+}
+
+static struct sim_pending *queue_pop(struct sim_queue *q)
+{
+    struct sim_pending *p = q->head;
+
+    if (p) {
+        q->head = p->next;
+        if (!q->head)
+            q->tail = NULL;
+    }
+    return p;
+}
+
+static int queue_remove(struct sim_queue *q, struct imx_transfer *xfer,
+        struct sim_pending **removed)
+{
+    struct sim_pending **pp, *prev = NULL;
+
+    for (pp = &q->head; *pp; prev = *pp, pp = &(*pp)->next) {
+        if ((*pp)->xfer != xfer)
+            continue;
+        *removed = *pp;
+        *pp = (*pp)->next;
+        if (q->tail == *removed)
+            q->tail = prev;
+        return 0;
+    }
+    return -1;
+}
+
+static int sim_submit(void *priv, struct imx_transfer *xfer)
+{
+    struct sim_device *sim = priv;
+    struct sim_pending *p;
+
+    if (sim->state == SIM_BOOTED)
+        return LIBUSB_ERROR_NO_DEVICE;
+
+    p = calloc(1, sizeof(*p));
+    if (!p)
+        return LIBUSB_ERROR_NO_MEM;
+    p->xfer = xfer;
+    if (xfer->type == IMX_TRANSFER_READ) {
+        /* Completes once a reply is ready, see sim_handle_events */
+        p->due = now_us() + sim->latency;
+        queue_add(&sim->in, p);
+    } else {
+        p->due = sim_due(sim, &sim->last_out, xfer->length, 0);
+        queue_add(&sim->out, p);
+    }
+    return 0;
+}
+
+static int sim_cancel(void *priv, struct imx_transfer *xfer)
+{
+    struct sim_device *sim = priv;
+    struct sim_pending *p;
+
+    if (queue_remove(&sim->in, xfer, &p) < 0 &&
+            queue_remove(&sim->out, xfer, &p) < 0)
+        return LIBUSB_ERROR_NOT_FOUND;
+    xfer->status = LIBUSB_ERROR_INTERRUPTED;
+    queue_add(&sim->done, p);
+    return 0;
+}
+
+static void sim_release(void *priv, struct imx_transfer *xfer)
+{
+}
+
+static void sim_complete(struct sim_pending *p, int status, int actual)
+{
+    struct imx_transfer *xfer = p->xfer;
+
+    free(p);
+    xfer->status = status;
+    xfer->actual_length = actual;
+    xfer->callback(xfer);
+}
+
+/**
+ * Work out when the next IN and OUT transfers complete (UINT64_MAX if there
+ * are none)
+ */
+static void sim_next_due(struct sim_device *sim, uint64_t *out_due,
+        uint64_t *in_due)
+{
+    *out_due = *in_due = UINT64_MAX;
+    if (sim->out.head)
+        *out_due = sim->out.head->due;
+    if (sim->in.head) {
+        *in_due = sim->in.head->due;
+        if (sim->replies)
+            *in_due = max(max(*in_due, sim->replies->ready),
+                    sim->last_in + sim->replies->len / SIM_BYTES_PER_US);
+        else
+            *in_due += SIM_TIMEOUT_US;
+    }
+}
+
+static int sim_handle_events(void *priv);
+
+/**
+ * Work out when sim_handle_events next has something to do
+ * @return Time, or UINT64_MAX if nothing is outstanding
+ */
+static uint64_t sim_next_event(struct sim_device *sim)
+{
+    uint64_t out_due, in_due;
+
+    if (sim->done.head)
+        return 0;
+    if (sim->state == SIM_BOOTED)
+        return sim->out.head || sim->in.head ? 0 : UINT64_MAX;
+    sim_next_due(sim, &out_due, &in_due);
+    return min(out_due, in_due);
+}
+
+static int sim_next_timeout(void *priv)
+{
+    struct sim_device *sim = priv;
+    uint64_t due = sim_next_event(sim), now;
+
+    if (due == UINT64_MAX)
+        return -1;
+    now = now_us();
+    return due <= now ? 0 : (due - now + 999) / 1000;
+}
+
+/**
+ * Event loops get a timer which fires when the next transfer completes,
+ * since millisecond timeouts are too coarse for the simulated bus
+ */
+static int sim_pollfds(void *priv, struct pollfd *fds, int max)
+{
+    struct sim_device *sim = priv;
+    struct itimerspec its = {{0, 0}, {0, 0}};
+    uint64_t due;
+
+    if (max < 1)
+        return 0;
+    if (sim->timer_fd < 0) {
+        sim->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if (sim->timer_fd < 0)
+            return -errno;
+    }
+
+    due = sim_next_event(sim);
+    if (due != UINT64_MAX) {
+        /* A zero time would disarm the timer */
+        due = max(due, 1);
+        its.it_value.tv_sec = due / 1000000;
+        its.it_value.tv_nsec = (due % 1000000) * 1000;
+    }
+    if (timerfd_settime(sim->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        return -errno;
+
+    fds[0].fd = sim->timer_fd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    return 1;
+}
+
+static int sim_poll_events(void *priv)
+{
+    struct sim_device *sim = priv;
+    uint64_t expirations;
+
+    if (sim->timer_fd >= 0 &&
+            read(sim->timer_fd, &expirations, sizeof(expirations)) < 0 &&
+            errno != EAGAIN)
+        return -errno;
+    while (sim_next_event(sim) <= now_us())
+        sim_handle_events(sim);
+    return 0;
+}
+
+static int sim_handle_events(void *priv)
+{
+    struct sim_device *sim = priv;
+    struct sim_pending *p;
+    uint64_t out_due, in_due;
+    int e;
+
+    p = queue_pop(&sim->done);
+    if (p) {
+        sim_complete(p, p->xfer->status, 0);
+        return 0;
+    }
+
+    if (sim->state == SIM_BOOTED) {
+        /* Replies sent before the jump still arrive, but everything else
+         * fails once the device has gone */
+        if (sim->in.head && sim->replies) {
+            p = queue_pop(&sim->in);
+            sim_complete(p, 0, sim_in(sim, p->xfer->buffer, p->xfer->length));
+            return 0;
+        }
+        p = queue_pop(&sim->out);
+        if (!p)
+            p = queue_pop(&sim->in);
+        if (p)
+            sim_complete(p, LIBUSB_ERROR_NO_DEVICE, 0);
+        return 0;
+    }
+
+    sim_next_due(sim, &out_due, &in_due);
+    if (out_due == UINT64_MAX && in_due == UINT64_MAX)
+        return 0;
+
+    if (out_due <= in_due) {
+        p = queue_pop(&sim->out);
+        sleep_until(out_due);
+        e = sim_out(sim, out_due, p->xfer->buffer, p->xfer->length);
+        sim_complete(p, min(e, 0), e < 0 ? 0 : e);
+    } else {
+        p = queue_pop(&sim->in);
+        sleep_until(in_due);
+        sim->last_in = in_due;
+        if (sim->replies)
+            sim_complete(p, 0, sim_in(sim, p->xfer->buffer, p->xfer->length));
+        else
+            sim_complete(p, LIBUSB_ERROR_TIMEOUT, 0);
+    }
+    return 0;
+}
+
+static void sim_close(void *priv)
+{
+    struct sim_device *sim = priv;
+    struct sim_pending *p;
+    int i;
+
+    while ((p = queue_pop(&sim->done)) || (p = queue_pop(&sim->out)) ||
+            (p = queue_pop(&sim->in)))
+        free(p);
+    sim_flush_replies(sim);
+    for (i = 0; i < SIM_HASH_SIZE; i++) {
+        while (sim->pages[i]) {
+            struct sim_page *page = sim->pages[i];
+            sim->pages[i] = page->next;
+            free(page);
+        }
+    }
+    if (sim->timer_fd >= 0)
+        close(sim->timer_fd);
+    free(sim->dcd);
+    free(sim);
+}
+
+static const struct imx_transport_ops sim_transport_ops = {
+    .name = "sim",
+    .set_report = sim_set_report,
+    .read_report = sim_read_report,
+    .submit = sim_submit,
+    .cancel = sim_cancel,
+    .release = sim_release,
+    .handle_events = sim_handle_events,
+    .pollfds = sim_pollfds,
+    .next_timeout = sim_next_timeout,
+    .poll_events = sim_poll_events,
+    .close = sim_close,
+};
+
+struct imx_device *imx_sim_connect(const struct imx_soc *soc, int latency_us)
+{
+    struct sim_device *sim;
+    struct imx_device *h;
+
+    if (!soc)
+        soc = imx_find_soc(0x15a2, 0x0054);
+
+    sim = calloc(1, sizeof(*sim));
+    if (!sim)
+        return NULL;
+    sim->dcd = malloc(DCD_MAX_BYTES);
+    if (!sim->dcd) {
+        free(sim);
+        return NULL;
+    }
+    sim->soc = soc;
+    sim->latency = max(latency_us, 0);
+    sim->timer_fd = -1;
+
+    /* SDPS ROMs take the image on an interrupt OUT endpoint */
+    h = imx_device_create(&sim_transport_ops, sim, soc,
+            soc->protocol == IMX_PROTOCOL_SDPS ? 0x01 : 0);
+    if (!h)
+        sim_close(sim);
+    return h;
+}
@@ -0,0 +1,25 @@
+/**
+ * \file	imx_usb_console/imx_sim.h
+ * \date	2026-Oct-16
+ * \author	Andre Renaud
+ * \copyright	Aiotec Ltd/Bluewater Systems
+ * \brief       Simulated i.MX?? boot ROM, for running without hardware
+ */
+#ifndef IMX_SIM_H
+#define IMX_SIM_H
+
+#include "imx_usb_lib.h"
+
+/**
+ * Connect to a simulated device. The device has sparse memory covering the
+ * whole 32-bit address space (initially zero), answers every SDP command,
+ * executes DCD tables, and disconnects once it has jumped to a valid IVT
+ * @param soc Boot ROM to simulate, or NULL for an i.MX6Q
+ * @param latency_us Time each transfer takes to complete. Transfers which
+ *                   are in flight together overlap, as they would on a real
+ *                   bus
+ * @return Device handle, to be released with imx_disconnect, or NULL
+ */
+struct imx_device *imx_sim_connect(const struct imx_soc *soc, int latency_us);
+
+#endif
@@ -0,0 +1,197 @@
+/**
+ * \file	imx_usb_console/imx_transport.h
+ * \date	2026-Oct-16
+ * \author	Andre Renaud
+ * \copyright	Aiotec Ltd/Bluewater Systems
+ * \brief       Interface between the SDP protocol code and the transport
+ *              used to reach the device (libusb, or a simulated device)
+ */
+#ifndef IMX_TRANSPORT_H
+#define IMX_TRANSPORT_H
+
+#include <poll.h>
+
+#include "imx_usb_lib.h"
+
+/*
+ * Wire format of the reports exchanged with the boot ROM
+ */
+struct sdp_command {
+    uint8_t report_id;
+    uint16_t command_type;
+    uint32_t address;
+    uint8_t format;
+    uint32_t data_count;
+    uint32_t data;
+    uint8_t reserved;
+} __attribute__((packed));
+
+#define SDP_READ_REGISTER 0x0101
+#define SDP_WRITE_REGISTER 0x0202
+#define SDP_WRITE_FILE 0x0404
+#define SDP_ERROR_STATUS 0x0505
+#define SDP_DCD_WRITE 0x0a0a
+#define SDP_JUMP_ADDRESS 0x0b0b
+
+#define STATUS_WRITE_COMPLETE 0x128a8a12
+#define STATUS_FILE_COMPLETE 0x88888888
+
+#define HAB_ENGINEERING_STATUS 0x56787856
+#define HAB_PRODUCTION_STATUS 0x12343412
+
+#define DCD_TAG_HEADER  0xD2
+#define DCD_TAG_WRITE   0xCC
+#define DCD_TAG_CHECK   0xCF
+#define DCD_TAG_NOP     0xC0
+#define DCD_VERSION     0x40
+
+/* Largest DCD the ROM will accept in one go (HAB_MAX_DCD_SIZE) */
+#define DCD_MAX_BYTES   IMX_DCD_MAX_BYTES
+
+#define BLTC_SIGNATURE 0x43544c42 /* "BLTC" */
+#define BLTC_DOWNLOAD_FW 2
+
+struct sdps_command {
+    uint8_t report_id;
+    uint32_t signature;         /* Little endian */
+    uint32_t tag;
+    uint32_t xfer_length;
+    uint8_t flags;
+    uint8_t reserved[2];
+    uint8_t command;            /* Start of the CDB */
+    uint32_t length;            /* Big endian */
+    uint8_t cdb_reserved[11];
+} __attribute__((packed));
+
+/**
+ * Kinds of transfer a transport has to carry out
+ */
+enum {
+    IMX_TRANSFER_SET_REPORT,    /* HID SET_REPORT on the control endpoint */
+    IMX_TRANSFER_READ,          /* Report from the interrupt IN endpoint */
+    IMX_TRANSFER_WRITE,         /* Report to the interrupt OUT endpoint */
+};
+
+struct imx_transfer;
+typedef void (*imx_transfer_cb)(struct imx_transfer *xfer);
+
+/**
+ * An asynchronous transfer. Reports include their report ID as the
+ * first byte
+ */
+struct imx_transfer {
+    struct imx_device *dev;
+    int type;           /* One of IMX_TRANSFER_xxx */
+    int endpoint;       /* IMX_TRANSFER_WRITE: endpoint to write to */
+    uint8_t *buffer;
+    int length;
+    int actual_length;
+    int status;         /* 0 on success, otherwise LIBUSB_ERROR_xxx */
+    imx_transfer_cb callback;
+    void *user_data;
+    void *priv;         /* Owned by the transport */
+};
+
+/**
+ * Operations a transport provides. Return values follow libusb, ie: >= 0
+ * on success, LIBUSB_ERROR_xxx on failure
+ */
+struct imx_transport_ops {
+    const char *name;
+    /* Synchronous transfers */
+    int (*set_report)(void *priv, uint8_t *report, int len,
+            unsigned int timeout);
+    int (*read_report)(void *priv, uint8_t *report, int len, int *actual,
+            unsigned int timeout);
+    /* Asynchronous transfers. Callbacks are only made from handle_events,
+     * and transfers complete in the order they were submitted */
+    int (*submit)(void *priv, struct imx_transfer *xfer);
+    int (*cancel)(void *priv, struct imx_transfer *xfer);
+    /* Release anything the transport attached to xfer->priv */
+    void (*release)(void *priv, struct imx_transfer *xfer);
+    /* Wait for, and complete, at least one transfer */
+    int (*handle_events)(void *priv);
+    /* For driving the transport from an event loop (see imx_async.h).
+     * pollfds fills in the file descriptors to wait on (NULL if there are
+     * none), next_timeout gives the time (ms) until events must be handled
+     * regardless, or -1 if there is nothing to wait for but the file
+     * descriptors. poll_events handles whatever is ready without blocking;
+     * if NULL, handle_events is called while next_timeout is 0 */
+    int (*pollfds)(void *priv, struct pollfd *fds, int max);
+    int (*next_timeout)(void *priv);
+    int (*poll_events)(void *priv);
+    void (*close)(void *priv);
+};
+
+/**
+ * Create a device handle on top of a transport
+ * @param ops Transport operations
+ * @param priv Transport private data, passed to each operation
+ * @param soc Boot ROM the device is running
+ * @param ep_out Interrupt OUT endpoint, or 0 to use SET_REPORT
+ * @return New device handle (released by imx_disconnect), or NULL
+ */
+struct imx_device *imx_device_create(const struct imx_transport_ops *ops,
+        void *priv, const struct imx_soc *soc, int ep_out);
+
+/**
+ * Get the transport a device is using
+ * @param priv Returns the transport private data
+ */
+const struct imx_transport_ops *imx_device_ops(struct imx_device *h,
+        void **priv);
+/**
+ * Replace the transport a device is using, ie: to layer another transport
+ * on top of it. Must only be called while no transfers are in flight
+ */
+void imx_device_set_ops(struct imx_device *h,
+        const struct imx_transport_ops *ops, void *priv);
+/**
+ * Get the interrupt OUT endpoint a device uses, or 0 if it uses SET_REPORT
+ */
+int imx_device_ep_out(struct imx_device *h);
+/**
+ * Record the result of a transfer a device made outside the library, so
+ * that its link health is kept up to date
+ * @return e
+ */
+int imx_device_link_result(struct imx_device *h, int e);
+
+/**
+ * Handle any transport events which are ready, without blocking
+ */
+int imx_transport_poll_events(const struct imx_transport_ops *ops,
+        void *priv);
+
+/*
+ * Protocol helpers shared with the other users of the transport
+ */
+/**
+ * Check a HAB report (report ID 3)
+ * @return < 0 if it is invalid
+ */
+int imx_check_hab(const uint8_t *hab, int len);
+/**
+ * Check the status report which completes a write command
+ * @param expected Status word the ROM reports on success
+ * @return < 0 if it doesn't match
+ */
+int imx_check_status(const uint8_t *status, int len, uint32_t expected);
+/**
+ * Encode as many entries as will fit into a single DCD packet (of at most
+ * DCD_MAX_BYTES)
+ * @param pos Index of the first entry to encode, updated past those encoded
+ * @return Number of bytes in the packet
+ */
+int imx_dcd_encode(const struct imx_dcd *dcd, int *pos, uint8_t *buffer);
+
+#define IMX_JUMP_IVT_SIZE 32
+/**
+ * Build the IVT which JUMP_ADDRESS needs just before the code to run
+ * @param entry Address to start executing at
+ * @param buffer Returns the IVT (IMX_JUMP_IVT_SIZE bytes)
+ * @return Address to write the IVT to, and to pass to JUMP_ADDRESS
+ */
+uint32_t imx_jump_ivt(uint32_t entry, uint8_t *buffer);
+
+#endif
@@ -7,7 +7,10 @@
  *              via USB bootloader
  */
 #include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -15,27 +18,260 @@
 #include <readline/history.h>
 
 #include "imx_usb_lib.h"
+#include "imx_sim.h"
+#include "imx_capture.h"
+#include "imx_image.h"
+#include "imx_server.h"
 #include "imx_drv_spi.h"
 #include "imx_drv_gpio.h"
 #include "parser.h"
 
+/* write_file sends large images in pieces of at least this size (bytes) */
+#define WRITE_FILE_CHUNK (4 * 1024 * 1024)
+
+/* verify_file reads back & checks this much at a time (bytes) */
+#define VERIFY_WINDOW (64 * 1024)
+/* Differences closer together than this are reported as a single range */
+#define VERIFY_GAP 16
+/* Ranges listed by verify_file before it just counts them */
+#define VERIFY_MAX_RANGES 32
+
+/* save_file reads into each of its two buffers this much at a time */
+#define SAVE_WINDOW (1024 * 1024)
+
+/* load_manifest reads the images this far ahead of the upload (bytes) */
+#define MANIFEST_AHEAD (64 * 1024 * 1024)
+#define MANIFEST_READ (1024 * 1024)
+
+/* load sends segments less than this far apart as one write (bytes) */
+#define LOAD_MERGE_GAP 2048
+
+/* How long to wait for a device to come back before retrying (ms) */
+#define RECONNECT_TIMEOUT 10000
+
+#define min(a,b) (((a) < (b)) ? (a) : (b))
+#define max(a,b) (((a) > (b)) ? (a) : (b))
 #define mseconds() (int)({struct timeval _tv; gettimeofday(&_tv, NULL); _tv.tv_sec * 1000 + _tv.tv_usec / 1000; })
 
-static libusb_device_handle *h = NULL;
+/* Each thread drives its own device, see run_parallel */
+static __thread struct imx_device *h = NULL;
+
+/* Consecutive register writes from scripts are collected into DCD writes */
+static int batch_writes = 1;
+static __thread int batching = 0;
+static __thread struct imx_write_batch batch;
+
+static int queue_writes = 0;
+
+/*
+ * Where the last failed write_file got to, so that running it again (ie:
+ * when a script is rerun after the device reconnects) can carry on from
+ * there. Sessions on the same port share it
+ */
+static __thread struct {
+    char device[32];
+    char file[256];
+    uint32_t addr;
+    size_t length;
+    uint32_t hash;      /* Of the data which had been written */
+    int acked;
+} checkpoint;
+
+/*
+ * The DCD table compiled from the last imximage .cfg file run, so that
+ * running it again (ie: for each board, or each time a script is rerun)
+ * doesn't have to parse it again. Recompiled if the file changes
+ */
+static __thread struct {
+    char file[256];
+    time_t mtime;
+    off_t size;
+    int valid;
+    struct imx_dcd dcd;
+} cfg_cache;
+
+/*
+ * What write_file has uploaded this session, so that writing the same
+ * contents to the same place again can be skipped. Anything which may have
+ * changed the memory since (writes, DCDs, jumps & reconnects) drops the
+ * entries it overlaps
+ */
+struct upload {
+    uint32_t addr;
+    size_t length;
+    uint64_t hash;
+};
+static __thread struct upload *uploads = NULL;
+static __thread int nuploads = 0, uploads_size = 0;
+
+static uint32_t fnv1a(const uint8_t *data, size_t length)
+{
+    uint32_t hash = 0x811c9dc5;
+
+    while (length--)
+        hash = (hash ^ *data++) * 0x01000193;
+    return hash;
+}
+
+#define FNV64_BASIS 0xcbf29ce484222325ULL
+
+static uint64_t fnv1a64(uint64_t hash, const uint8_t *data, size_t length)
+{
+    while (length--)
+        hash = (hash ^ *data++) * 0x100000001b3ULL;
+    return hash;
+}
+
+/**
+ * Forget any uploads which overlap a region of memory being changed
+ */
+static void uploads_forget(uint32_t addr, size_t length)
+{
+    uint64_t end = (uint64_t)addr + length;
+    int i;
+
+    for (i = 0; i < nuploads; i++) {
+        struct upload *u = &uploads[i];
+
+        if (addr < u->addr + (uint64_t)u->length && u->addr < end) {
+            *u = uploads[--nuploads];
+            i--;
+        }
+    }
+}
+
+static void uploads_clear(void)
+{
+    nuploads = 0;
+}
+
+/**
+ * Forget the uploads which sending a DCD table may have changed: the ROM
+ * copies the table to the DCD address before running it
+ */
+static void uploads_forget_staging(void)
+{
+    uploads_forget(imx_get_dcd_address(h), IMX_DCD_MAX_BYTES);
+}
+
+/**
+ * ... and the writes in the table may change more
+ */
+static void uploads_forget_dcd(const struct imx_dcd *dcd)
+{
+    int i;
+
+    uploads_forget_staging();
+    for (i = 0; i < dcd->count && nuploads; i++)
+        uploads_forget(dcd->entries[i].addr, 4);
+}
+
+/**
+ * Find an upload of the same size to the same place, whose hash can then
+ * be compared
+ */
+static struct upload *uploads_find(uint32_t addr, size_t length)
+{
+    int i;
+
+    for (i = 0; i < nuploads; i++)
+        if (uploads[i].addr == addr && uploads[i].length == length)
+            return &uploads[i];
+    return NULL;
+}
+
+static void uploads_add(uint32_t addr, size_t length, uint64_t hash)
+{
+    uploads_forget(addr, length);
+    if (nuploads >= uploads_size) {
+        int new_size = uploads_size ? uploads_size * 2 : 8;
+        struct upload *new_uploads;
+
+        new_uploads = realloc(uploads, new_size * sizeof(*uploads));
+        if (!new_uploads)
+            return;
+        uploads = new_uploads;
+        uploads_size = new_size;
+    }
+    uploads[nuploads].addr = addr;
+    uploads[nuploads].length = length;
+    uploads[nuploads].hash = hash;
+    nuploads++;
+}
 
 #define REQUIRE_PARAMS(n) if (argc < n) { fprintf(stderr, "Requires %d params\n", n);  return -EINVAL; }
+#define SYNC_WRITES() { int _e = sync_writes(); if (_e < 0) return _e; }
+
+/**
+ * Report a command being used once the device has jumped away
+ */
+static int no_device(void)
+{
+    fprintf(stderr, "No device: it has already been started\n");
+    return -ENODEV;
+}
+
+/**
+ * Forget the uploads overwritten by any DCD writes the batch has staged
+ * since staged was sampled
+ */
+static void batch_staged(int staged)
+{
+    if (batch.staged != staged)
+        uploads_forget_staging();
+}
+
+/**
+ * Push out any register writes that have been batched up, so that
+ * subsequent commands see them
+ */
+static int sync_writes(void)
+{
+    int e, staged = batch.staged;
+
+    if (!h)
+        return no_device();
+    e = imx_batch_flush(h, &batch);
+    batch_staged(staged);
+    if (e < 0)
+        return e;
+    return imx_write_barrier(h);
+}
+
+static int write_reg(int width, uint32_t addr, uint32_t value)
+{
+    int e, staged = batch.staged;
+
+    if (!h)
+        return no_device();
+    uploads_forget(addr, width / 8);
+    if (batching) {
+        e = imx_batch_write(h, &batch, width, addr, value);
+        batch_staged(staged);
+        return e;
+    }
+    if (width == 32)
+        return imx_write_reg32(h, addr, value);
+    if (width == 16)
+        return imx_write_reg16(h, addr, value);
+    return imx_write_reg8(h, addr, value);
+}
 
 struct define_rec {
 	const char *name;
 	const char *value;
 };
 
-static struct define_rec **defines = NULL;
-static int ndefines = 0;
+static __thread struct define_rec **defines = NULL;
+static __thread int ndefines = 0;
 
 static uint32_t val2addr(const char *val)
 {
 	int i;
+
+	/* Plain numbers are by far the most common, so don't search for them */
+	if (isdigit(*val))
+		return strtoul(val, NULL, 0);
 	for (i = 0; i < ndefines; i++) {
 		if (strcmp(val, defines[i]->name) == 0) {
 			val = defines[i]->value;
@@ -73,6 +309,7 @@ static int read_reg32(int argc, char *argv[])
     int e;
 
     REQUIRE_PARAMS(2);
+    SYNC_WRITES();
 
     addr = val2addr(argv[1]);
     e = imx_read_reg32(h, addr, &value);
@@ -93,7 +330,7 @@ static int write_reg32(int argc, char *argv[])
     REQUIRE_PARAMS(3);
     addr = val2addr(argv[1]);
     value = strtoul(argv[2], NULL, 0);
-    e = imx_write_reg32(h, addr, value);
+    e = write_reg(32, addr, value);
     if (e < 0)
         fprintf(stderr, "Failed to write 0x%8.8x = 0x%8.8x\n",
                 addr, value);
@@ -109,7 +346,7 @@ static int write_reg16(int argc, char *argv[])
     REQUIRE_PARAMS(3);
     addr = val2addr(argv[1]);
     value = strtoul(argv[2], NULL, 0);
-    e = imx_write_reg16(h, addr, value);
+    e = write_reg(16, addr, value);
     if (e < 0)
         fprintf(stderr, "Failed to write 0x%8.8x = 0x%4.4x\n",
                 addr, value);
@@ -123,6 +360,7 @@ static int read_reg16(int argc, char *argv[])
     int e;
 
     REQUIRE_PARAMS(2);
+    SYNC_WRITES();
 
     addr = val2addr(argv[1]);
     e = imx_read_reg16(h, addr, &value);
@@ -143,7 +381,7 @@ static int write_reg8(int argc, char *argv[])
     REQUIRE_PARAMS(3);
     addr = val2addr(argv[1]);
     value = strtoul(argv[2], NULL, 0);
-    e = imx_write_reg8(h, addr, value);
+    e = write_reg(8, addr, value);
     if (e < 0)
         fprintf(stderr, "Failed to write 0x%8.8x = 0x%2.2x\n",
                 addr, value);
@@ -157,6 +395,7 @@ static int read_reg8(int argc, char *argv[])
     int e;
 
     REQUIRE_PARAMS(2);
+    SYNC_WRITES();
 
     addr = val2addr(argv[1]);
     e = imx_read_reg8(h, addr, &value);
@@ -168,6 +407,53 @@ static int read_reg8(int argc, char *argv[])
     return 0;
 }
 
+static const char *check_conds[] = {
+    [IMX_DCD_ALL_CLEAR] = "all_clear",
+    [IMX_DCD_ANY_CLEAR] = "any_clear",
+    [IMX_DCD_ALL_SET] = "all_set",
+    [IMX_DCD_ANY_SET] = "any_set",
+};
+#define NCHECK_CONDS ((sizeof(check_conds)) / sizeof(check_conds[0]))
+
+/**
+ * Have the device poll a 32-bit register until the masked bits match.
+ * This runs on the device as part of the DCD, so when batching it is
+ * sent in the same transaction as the surrounding writes
+ */
+static int check_reg32(int argc, char *argv[])
+{
+    uint32_t addr, mask, count = 0;
+    int cond = IMX_DCD_ALL_SET;
+    int e, staged;
+
+    REQUIRE_PARAMS(3);
+    if (!h)
+        return no_device();
+    addr = val2addr(argv[1]);
+    mask = strtoul(argv[2], NULL, 0);
+    if (argc >= 4) {
+        for (cond = 0; cond < NCHECK_CONDS; cond++)
+            if (strcmp(argv[3], check_conds[cond]) == 0)
+                break;
+        if (cond == NCHECK_CONDS) {
+            fprintf(stderr, "Invalid check condition: %s\n", argv[3]);
+            return -EINVAL;
+        }
+    }
+    if (argc >= 5)
+        count = strtoul(argv[4], NULL, 0);
+
+    staged = batch.staged;
+    e = imx_batch_check(h, &batch, 32, cond, addr, mask, count);
+    batch_staged(staged);
+    if (e >= 0 && !batching)
+        e = sync_writes();
+    if (e < 0)
+        fprintf(stderr, "Failed to check 0x%8.8x & 0x%8.8x %s\n",
+                addr, mask, check_conds[cond]);
+    return e;
+}
+
 static void *buffer_file(const char *file, size_t *file_size)
 {
     struct stat file_stat;
@@ -198,50 +484,268 @@ static void *buffer_file(const char *file, size_t *file_size)
     return buffer;
 }
 
+static const char *write_modes[] = {
+    [IMX_WRITE_SYNC] = "sync",
+    [IMX_WRITE_ASYNC] = "async",
+    [IMX_WRITE_STREAM] = "stream",
+};
+#define NWRITE_MODES ((sizeof(write_modes)) / sizeof(write_modes[0]))
+
+static int find_write_mode(const char *name)
+{
+    int i;
+
+    for (i = 0; i < NWRITE_MODES; i++)
+        if (strcmp(name, write_modes[i]) == 0)
+            return i;
+
+    fprintf(stderr, "Invalid write mode: %s\n", name);
+    return -EINVAL;
+}
+
+/**
+ * Map a file into memory, to be read through from start to finish
+ * @return Mapping, or NULL if the file can't be mapped (ie: it isn't a
+ *         regular file)
+ */
+static void *map_file(const char *file, size_t *file_size)
+{
+    struct stat file_stat;
+    void *data;
+    int fd;
+
+    fd = open(file, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode) ||
+            !file_stat.st_size) {
+        close(fd);
+        return NULL;
+    }
+    data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+    madvise(data, file_stat.st_size, MADV_SEQUENTIAL);
+    *file_size = file_stat.st_size;
+    return data;
+}
+
+/**
+ * Size of the pieces write_file sends an image in. Only the piece being
+ * sent and the one being read in behind it are held in memory
+ */
+static size_t write_chunk(size_t length)
+{
+    size_t window = imx_get_write_window(h);
+
+    /* SDPS ROMs take the whole image in a single write */
+    if (imx_soc(h)->protocol == IMX_PROTOCOL_SDPS)
+        return length;
+    return ((WRITE_FILE_CHUNK + window - 1) / window) * window;
+}
+
+/**
+ * Hash the contents of a file, a piece at a time so that a mapped file
+ * doesn't all stay in memory
+ */
+static uint64_t hash_file(uint8_t *data, size_t length, int mapped)
+{
+    uint64_t hash = FNV64_BASIS;
+    size_t pos, this_len;
+
+    for (pos = 0; pos < length; pos += this_len) {
+        this_len = min(WRITE_FILE_CHUNK, length - pos);
+        hash = fnv1a64(hash, data + pos, this_len);
+        if (mapped)
+            madvise(data + pos, this_len, MADV_DONTNEED);
+    }
+    return hash;
+}
+
+/**
+ * Send an image in pieces (see write_chunk), dropping each piece from
+ * memory once it has been sent
+ * @param pos Offset to start from. Updated as each piece is sent, so on
+ *            failure it is the start of the piece which failed
+ * @param hash Updated with the contents of each piece as it is sent, or
+ *             NULL
+ * @param progress Called with the size of each piece once it has been
+ *                 sent, or NULL
+ * @return < 0 on failure, >= 0 on success
+ */
+static int write_pieces(uint32_t addr, uint8_t *data, size_t length,
+        size_t *pos, int mapped, uint64_t *hash,
+        void (*progress)(size_t bytes, void *arg), void *arg)
+{
+    size_t chunk = write_chunk(length);
+
+    uploads_forget(addr + *pos, length - *pos);
+    while (*pos < length) {
+        size_t this_len = min(chunk, length - *pos);
+        int e;
+
+        /* Have the next piece read in while this one is being sent */
+        if (mapped && *pos + this_len < length)
+            madvise(data + *pos + this_len,
+                    min(chunk, length - *pos - this_len), MADV_WILLNEED);
+        e = imx_write_bulk(h, addr + *pos, data + *pos, this_len);
+        if (e < 0)
+            return e;
+        if (hash)
+            *hash = fnv1a64(*hash, data + *pos, this_len);
+        if (mapped)
+            madvise(data + *pos, this_len, MADV_DONTNEED);
+        *pos += this_len;
+        if (progress)
+            progress(this_len, arg);
+    }
+    return 0;
+}
+
 static int write_file(int argc, char *argv[])
 {
     const char *file;
     uint32_t addr;
-    size_t length;
+    size_t length, chunk, pos = 0;
+    uint64_t hash = FNV64_BASIS;
+    struct upload *prev;
     uint8_t *data;
-    int e;
+    int e = 0, hashed = 0;
     int start, duration;
+    int old_mode, mode;
+    int mapped = 1;
 
     REQUIRE_PARAMS(3);
+    SYNC_WRITES();
 
+    old_mode = mode = imx_get_write_mode(h);
     addr = val2addr(argv[1]);
     file = argv[2];
+    if (argc >= 4) {
+        mode = find_write_mode(argv[3]);
+        if (mode < 0)
+            return mode;
+    }
 
-    data = buffer_file(file, &length);
+    data = map_file(file, &length);
+    if (!data) {
+        mapped = 0;
+        data = buffer_file(file, &length);
+    }
     if (!data) {
         perror("buffer file");
         return -EINVAL;
     }
 
     start = mseconds();
-    e = imx_write_bulk(h, addr, data, length);
-    free(data);
-    if (e < 0)
+    prev = uploads_find(addr, length);
+    if (prev) {
+        /* Only read the file through before sending it if it might not
+         * need sending. Otherwise it is hashed as it goes */
+        hash = hash_file(data, length, mapped);
+        hashed = 1;
+        if (hash == prev->hash) {
+            printf("Skipped writing %s to 0x%8.8x [%zd bytes]: already uploaded\n",
+                    file, addr, length);
+            goto out;
+        }
+    }
+    uploads_forget(addr, length);
+
+    imx_set_write_mode(h, mode);
+    chunk = write_chunk(length);
+    if (checkpoint.acked && strcmp(checkpoint.device, imx_name(h)) == 0 &&
+            strcmp(checkpoint.file, file) == 0 && checkpoint.addr == addr &&
+            checkpoint.length == length &&
+            checkpoint.hash == fnv1a(data, checkpoint.acked)) {
+        /* Finish off the piece the last attempt stopped in */
+        size_t end = min(length, (checkpoint.acked / chunk + 1) * chunk);
+
+        printf("Resuming at 0x%8.8x\n", addr + checkpoint.acked);
+        e = imx_write_bulk_resume(h, addr, data, end, checkpoint.acked);
+        if (e >= 0) {
+            printf("Resumed, skipping %dB already written\n", e);
+            pos = end;
+            if (!hashed)
+                hash = fnv1a64(hash, data, end);
+        }
+    }
+    if (e >= 0)
+        e = write_pieces(addr, data, length, &pos, mapped,
+                hashed ? NULL : &hash, NULL, NULL);
+    imx_set_write_mode(h, old_mode);
+
+    checkpoint.acked = 0;
+    if (e < 0) {
         fprintf(stderr, "Failed to write %s to 0x%8.8x [%zd bytes]\n",
                 file, addr, length);
+        checkpoint.acked = pos + imx_write_acked(h);
+        if (checkpoint.acked) {
+            snprintf(checkpoint.device, sizeof(checkpoint.device), "%s",
+                    imx_name(h));
+            snprintf(checkpoint.file, sizeof(checkpoint.file), "%s", file);
+            checkpoint.addr = addr;
+            checkpoint.length = length;
+            checkpoint.hash = fnv1a(data, checkpoint.acked);
+            fprintf(stderr, "%dB were written, which will be skipped if this is run again\n",
+                    checkpoint.acked);
+        }
+    } else {
+        uploads_add(addr, length, hash);
+    }
     duration = mseconds() - start;
-    printf("Took %dms to write %zdB: %zdkB/s\n",
-        duration, length, ((length / 1024) * 1000) / duration);
+    printf("Took %dms to write %zdB: %zdkB/s [%s]\n",
+        duration, length, ((length / 1024) * 1000) / max(duration, 1),
+        write_modes[mode]);
+
+out:
+    if (mapped)
+        munmap(data, length);
+    else
+        free(data);
     return e;
 }
 
-static int verify_file(int argc, char *argv[])
+static int write_mode_func(int argc, char *argv[])
+{
+    int mode;
+
+    if (!h)
+        return no_device();
+    if (argc < 2) {
+        printf("%s (window %d bytes)\n", write_modes[imx_get_write_mode(h)],
+                imx_get_write_window(h));
+        return 0;
+    }
+
+    mode = find_write_mode(argv[1]);
+    if (mode < 0)
+        return mode;
+    imx_set_write_mode(h, mode);
+    if (argc >= 3)
+        imx_set_write_window(h, strtoul(argv[2], NULL, 0));
+    return 0;
+}
+
+/**
+ * Write the same file with each of the write methods, and compare the
+ * throughput achieved
+ */
+static int write_bench(int argc, char *argv[])
 {
     const char *file;
     uint32_t addr;
     size_t length;
     uint8_t *data;
-    uint8_t *read_back;
-    int e, i;
-    int start, duration;
+    int old_mode;
+    int rate[NWRITE_MODES];
+    int e = 0, i;
 
     REQUIRE_PARAMS(3);
+    SYNC_WRITES();
 
+    old_mode = imx_get_write_mode(h);
     addr = val2addr(argv[1]);
     file = argv[2];
 
@@ -250,100 +754,749 @@ static int verify_file(int argc, char *argv[])
         perror("buffer file");
         return -EINVAL;
     }
-
-    read_back = malloc(length);
-    if (!read_back) {
-        perror("malloc");
-        free(data);
-        return -ENOMEM;
+    uploads_forget(addr, length);
+
+    for (i = 0; i < NWRITE_MODES; i++) {
+        int start, duration;
+
+        imx_set_write_mode(h, i);
+        start = mseconds();
+        e = imx_write_bulk(h, addr, data, length);
+        duration = mseconds() - start;
+        if (e < 0) {
+            fprintf(stderr, "%s write of %s failed\n", write_modes[i], file);
+            break;
+        }
+        rate[i] = ((length / 1024) * 1000) / max(duration, 1);
+        printf("%-6s %6dms %8dkB/s (%d%% of sync)\n", write_modes[i],
+                duration, rate[i], (rate[i] * 100) / max(rate[0], 1));
     }
 
-    start = mseconds();
-    e = imx_read_bulk(h, addr, read_back, length, 8);
-    if (e < 0)
-        fprintf(stderr, "Failed to write %s to 0x%8.8x [%zd bytes]\n",
-                file, addr, length);
-    duration = mseconds() - start;
-    printf("Took %dms to read %zdB: %zdkB/s\n",
-        duration, length, ((length / 1024) * 1000) / duration);
-    if (e >= 0 && memcmp(read_back, data, length) != 0) {
-        for (i = 0; i < length; i++)
-            if (read_back[i] != data[i]) {
-                printf("Mismatch @ 0x%8.8x: 0x%2.2x != 0x%2.2x\n",
-                        addr + i, read_back[i], data[i]);
-                break;
-            }
-        e = -EINVAL;
-    }
-    free(read_back);
+    imx_set_write_mode(h, old_mode);
     free(data);
     return e;
 }
 
-static int dump_mem32(int argc, char *argv[])
+static int read_depth_func(int argc, char *argv[])
 {
-    uint32_t addr;
-    int length;
-    uint32_t *data;
-    int i, e;
-
-    REQUIRE_PARAMS(3);
-
-    addr = val2addr(argv[1]);
-    length = strtoul(argv[2], NULL, 0);
-
-    data = malloc(length * 4);
-    if (!data) {
-        perror("malloc");
-        return -ENOMEM;
-    }
+    if (!h)
+        return no_device();
+    if (argc < 2)
+        printf("%d\n", imx_get_read_depth(h));
+    else
+        imx_set_read_depth(h, strtoul(argv[1], NULL, 0));
+    return 0;
+}
 
-    e = imx_read_bulk(h, addr, (uint8_t *)data, length * 4, 32);
-    if (e < 0) {
-        free(data);
-        return e;
+/**
+ * Show or change where DCD tables (including batched register writes) are
+ * staged on the device
+ */
+static int dcd_addr_func(int argc, char *argv[])
+{
+    if (!h)
+        return no_device();
+    if (argc < 2) {
+        printf("0x%8.8x\n", imx_get_dcd_address(h));
+        return 0;
     }
+    SYNC_WRITES();
+    imx_set_dcd_address(h, val2addr(argv[1]));
+    return 0;
+}
 
-    for (i = 0; i < length; i++) {
-        if ((i % 4) == 0)
-            printf("%8.8x:", addr + i * 4);
-        printf(" %8.8x", data[i]);
-        if ((i % 4) == 3)
-            printf("\n");
-    }
-    if ((length % 4) != 0)
-        printf("\n");
+/**
+ * Differences found by verify_file. Nearby differing bytes are gathered
+ * into ranges, which are printed as they're completed
+ */
+struct mismatch {
+    uint32_t addr;
+    size_t start, end;  /* Current range (end is exclusive) */
+    size_t count;       /* Differing bytes in the current range */
+    uint8_t bits;       /* Bits which differ in the current range */
+    int ranges;
+    size_t total;
+};
 
-    free(data);
+static void mismatch_flush(struct mismatch *m)
+{
+    if (!m->count)
+        return;
+    if (m->ranges <= VERIFY_MAX_RANGES)
+        printf("Mismatch @ 0x%8.8zx-0x%8.8zx: %zd bytes differ (bits 0x%2.2x)\n",
+                m->addr + m->start, m->addr + m->end - 1, m->count, m->bits);
+    m->count = 0;
+}
 
-    return e;
+static void mismatch_add(struct mismatch *m, size_t offset, uint8_t diff)
+{
+    if (!m->count || offset - m->end >= VERIFY_GAP) {
+        mismatch_flush(m);
+        m->start = offset;
+        m->bits = 0;
+        m->ranges++;
+    }
+    m->end = offset + 1;
+    m->count++;
+    m->bits |= diff;
+    m->total++;
 }
 
-static int dump_mem(int argc, char *argv[])
+static int verify_file(int argc, char *argv[])
 {
+    const char *file;
     uint32_t addr;
-    int length;
+    size_t length, pos;
     uint8_t *data;
-    int i, e;
+    uint8_t *read_back;
+    struct mismatch m = {0};
+    int e = 0, stop_early = 0, mapped = 1;
+    int start, duration;
 
     REQUIRE_PARAMS(3);
+    SYNC_WRITES();
 
     addr = val2addr(argv[1]);
-    length = strtoul(argv[2], NULL, 0);
+    file = argv[2];
+    if (argc >= 4) {
+        if (strcmp(argv[3], "first") == 0) {
+            stop_early = 1;
+        } else if (strcmp(argv[3], "all") != 0) {
+            fprintf(stderr, "Invalid verify mode: %s\n", argv[3]);
+            return -EINVAL;
+        }
+    }
 
-    data = malloc(length);
+    data = map_file(file, &length);
+    if (!data) {
+        mapped = 0;
+        data = buffer_file(file, &length);
+    }
     if (!data) {
+        perror("buffer file");
+        return -EINVAL;
+    }
+
+    read_back = malloc(VERIFY_WINDOW);
+    if (!read_back) {
         perror("malloc");
+        if (mapped)
+            munmap(data, length);
+        else
+            free(data);
         return -ENOMEM;
     }
 
-    e = imx_read_bulk(h, addr, data, length, 8);
-    if (e < 0) {
-        free(data);
-        return e;
+    /* Each window is checked as soon as it has been read back */
+    start = mseconds();
+    m.addr = addr;
+    for (pos = 0; pos < length; pos += VERIFY_WINDOW) {
+        size_t this_len = min(VERIFY_WINDOW, length - pos);
+        size_t i;
+
+        e = imx_read_bulk(h, addr + pos, read_back, this_len, 8);
+        if (e < 0) {
+            fprintf(stderr, "Failed to read %s from 0x%8.8zx [%zd bytes]\n",
+                    file, addr + pos, this_len);
+            break;
+        }
+        if (memcmp(read_back, data + pos, this_len) != 0) {
+            for (i = 0; i < this_len; i++)
+                if (read_back[i] != data[pos + i])
+                    mismatch_add(&m, pos + i, read_back[i] ^ data[pos + i]);
+            if (stop_early) {
+                pos += this_len;
+                break;
+            }
+        }
+        if (mapped)
+            madvise(data + pos, this_len, MADV_DONTNEED);
     }
-
-    for (i = 0; i < length; i++) {
+    mismatch_flush(&m);
+    duration = mseconds() - start;
+    printf("Took %dms to read %zdB: %zdkB/s\n",
+        duration, min(pos, length),
+        ((min(pos, length) / 1024) * 1000) / max(duration, 1));
+
+    if (m.total) {
+        if (m.ranges > VERIFY_MAX_RANGES)
+            printf("... and %d more ranges\n", m.ranges - VERIFY_MAX_RANGES);
+        printf("%zd bytes differ in %d range%s%s\n", m.total, m.ranges,
+                m.ranges == 1 ? "" : "s",
+                pos < length ? " (stopped early)" : "");
+        e = -EINVAL;
+    }
+    free(read_back);
+    if (mapped)
+        munmap(data, length);
+    else
+        free(data);
+    return e;
+}
+
+/**
+ * Writes the data save_file has read to disk, from its own thread, while
+ * the next window is being read. The two buffers are filled alternately
+ */
+struct save_writer {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int fd;
+    uint8_t *buffers[2];
+    size_t lengths[2];  /* Data waiting to be written, or 0 */
+    int done;
+    int error;
+    pthread_t thread;
+};
+
+static void *save_writer_run(void *arg)
+{
+    struct save_writer *w = arg;
+    int next = 0;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        uint8_t *data = w->buffers[next];
+        size_t length = w->lengths[next];
+        size_t pos = 0;
+        int e = -EIO;
+
+        if (!length) {
+            if (w->done)
+                break;
+            pthread_cond_wait(&w->cond, &w->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&w->lock);
+        while (pos < length) {
+            ssize_t n = write(w->fd, data + pos, length - pos);
+
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                if (n < 0)
+                    e = -errno;
+                break;
+            }
+            pos += n;
+        }
+        pthread_mutex_lock(&w->lock);
+        if (pos < length && !w->error)
+            w->error = e;
+        w->lengths[next] = 0;
+        next ^= 1;
+        pthread_cond_signal(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/**
+ * Wait for a buffer to have been written out, so it can be refilled
+ * @return < 0 if any write has failed
+ */
+static int save_writer_wait(struct save_writer *w, int buffer)
+{
+    int e;
+
+    pthread_mutex_lock(&w->lock);
+    while (w->lengths[buffer] && !w->error)
+        pthread_cond_wait(&w->cond, &w->lock);
+    e = w->error;
+    pthread_mutex_unlock(&w->lock);
+    return e;
+}
+
+static void save_writer_queue(struct save_writer *w, int buffer,
+        size_t length)
+{
+    pthread_mutex_lock(&w->lock);
+    w->lengths[buffer] = length;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/**
+ * Show how a transfer is going, at most a few times a second
+ */
+static void show_progress(size_t done, size_t total, int start, int *last)
+{
+    int now = mseconds();
+
+    if (!isatty(fileno(stdout)) || (now - *last < 250 && done < total))
+        return;
+    *last = now;
+    printf("\r%zd/%zdkB %zdkB/s ", done / 1024, total / 1024,
+            ((done / 1024) * 1000) / max(now - start, 1));
+    fflush(stdout);
+}
+
+static int save_file(int argc, char *argv[])
+{
+    struct save_writer w = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+    };
+    const char *file;
+    uint32_t addr;
+    size_t length, pos;
+    int start, last = 0, duration;
+    int e = 0, i = 0;
+
+    REQUIRE_PARAMS(4);
+    SYNC_WRITES();
+
+    addr = val2addr(argv[1]);
+    length = strtoul(argv[2], NULL, 0);
+    file = argv[3];
+
+    w.fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w.fd < 0) {
+        e = -errno;
+        fprintf(stderr, "Unable to create %s: %s\n", file, strerror(errno));
+        return e;
+    }
+    w.buffers[0] = malloc(SAVE_WINDOW);
+    w.buffers[1] = malloc(SAVE_WINDOW);
+    if (!w.buffers[0] || !w.buffers[1]) {
+        perror("malloc");
+        e = -ENOMEM;
+        goto out;
+    }
+    if (pthread_create(&w.thread, NULL, save_writer_run, &w) != 0) {
+        e = -EAGAIN;
+        goto out;
+    }
+
+    start = mseconds();
+    for (pos = 0; pos < length && e >= 0; pos += SAVE_WINDOW, i ^= 1) {
+        size_t this_len = min(SAVE_WINDOW, length - pos);
+
+        e = save_writer_wait(&w, i);
+        if (e < 0) {
+            fprintf(stderr, "Unable to write to %s: %s\n", file,
+                    strerror(-e));
+            break;
+        }
+        e = imx_read_bulk(h, addr + pos, w.buffers[i], this_len, 8);
+        if (e < 0) {
+            fprintf(stderr, "Failed to read 0x%8.8zx [%zd bytes]\n",
+                    addr + pos, this_len);
+            break;
+        }
+        save_writer_queue(&w, i, this_len);
+        show_progress(pos + this_len, length, start, &last);
+    }
+
+    pthread_mutex_lock(&w.lock);
+    w.done = 1;
+    pthread_cond_signal(&w.cond);
+    pthread_mutex_unlock(&w.lock);
+    pthread_join(w.thread, NULL);
+    if (e >= 0 && w.error < 0) {
+        e = w.error;
+        fprintf(stderr, "Unable to write to %s: %s\n", file, strerror(-e));
+    }
+    if (last)
+        printf("\n");
+
+    duration = mseconds() - start;
+    if (e >= 0)
+        printf("Took %dms to save %zdB: %zdkB/s\n", duration, length,
+            ((length / 1024) * 1000) / max(duration, 1));
+
+out:
+    free(w.buffers[0]);
+    free(w.buffers[1]);
+    if (close(w.fd) < 0 && e >= 0) {
+        e = -errno;
+        fprintf(stderr, "Unable to write to %s: %s\n", file, strerror(errno));
+    }
+    return e;
+}
+
+/*
+ * Manifest uploads
+ * A manifest lists images to load, one "<address> <file>" per line. While
+ * one image is being sent, a background thread reads the ones after it
+ * into the page cache, so the link never waits on the disk
+ */
+struct manifest_entry {
+    uint32_t addr;
+    char file[256];
+    size_t length;
+};
+
+struct manifest {
+    struct manifest_entry *entries;
+    int count;
+    size_t total;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t sent;        /* Bytes uploaded so far */
+    int stop;
+    pthread_t thread;
+
+    int start, last;    /* For show_progress */
+};
+
+static int manifest_compare(const void *a, const void *b)
+{
+    const struct manifest_entry *ea = a, *eb = b;
+
+    return ea->addr < eb->addr ? -1 : ea->addr > eb->addr;
+}
+
+/**
+ * Read a manifest, checking that every image exists and that none of them
+ * overlap. Relative paths are relative to the manifest
+ * @return < 0 on failure, otherwise the number of entries
+ */
+static int manifest_read(const char *filename, struct manifest *m)
+{
+    char line[512], dir[256] = "";
+    const char *slash = strrchr(filename, '/');
+    FILE *fp;
+    int lineno = 0, i, e = 0;
+
+    if (slash)
+        snprintf(dir, sizeof(dir), "%.*s/", (int)(slash - filename),
+                filename);
+    fp = fopen(filename, "r");
+    if (!fp) {
+        fprintf(stderr, "Unable to open %s: %s\n", filename, strerror(errno));
+        return -ENOENT;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        struct manifest_entry *entry;
+        struct stat file_stat;
+        char *addr, *file, *save;
+
+        lineno++;
+        line[strcspn(line, "#")] = '\0';
+        /* Worker threads may load manifests at once, so no strtok */
+        addr = strtok_r(line, " \t\r\n", &save);
+        if (!addr)
+            continue;
+        file = strtok_r(NULL, " \t\r\n", &save);
+        if (!file) {
+            fprintf(stderr, "%s:%d: expected <address> <file>\n", filename,
+                    lineno);
+            e = -EINVAL;
+            break;
+        }
+
+        entry = realloc(m->entries, (m->count + 1) * sizeof(*entry));
+        if (!entry) {
+            e = -ENOMEM;
+            break;
+        }
+        m->entries = entry;
+        entry = &m->entries[m->count++];
+        entry->addr = val2addr(addr);
+        snprintf(entry->file, sizeof(entry->file), "%s%s",
+                file[0] == '/' ? "" : dir, file);
+        if (stat(entry->file, &file_stat) < 0) {
+            fprintf(stderr, "%s:%d: %s: %s\n", filename, lineno,
+                    entry->file, strerror(errno));
+            e = -ENOENT;
+            break;
+        }
+        entry->length = file_stat.st_size;
+    }
+    fclose(fp);
+    if (e < 0)
+        return e;
+
+    qsort(m->entries, m->count, sizeof(*m->entries), manifest_compare);
+    for (i = 0; i < m->count; i++) {
+        struct manifest_entry *entry = &m->entries[i];
+
+        if (i + 1 < m->count &&
+                entry->addr + entry->length > m->entries[i + 1].addr) {
+            fprintf(stderr, "%s overlaps %s at 0x%8.8x\n", entry->file,
+                    m->entries[i + 1].file, m->entries[i + 1].addr);
+            return -EINVAL;
+        }
+        m->total += entry->length;
+    }
+    return m->count;
+}
+
+/**
+ * Read each image in upload order, staying no more than MANIFEST_AHEAD
+ * bytes ahead of the upload
+ */
+static void *manifest_prefetch(void *arg)
+{
+    struct manifest *m = arg;
+    size_t fetched = 0;
+    uint8_t *buffer;
+    int i;
+
+    buffer = malloc(MANIFEST_READ);
+    if (!buffer)
+        return NULL;
+    for (i = 0; i < m->count; i++) {
+        int fd = open(m->entries[i].file, O_RDONLY);
+        ssize_t n;
+
+        if (fd < 0)
+            continue;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        while ((n = read(fd, buffer, MANIFEST_READ)) > 0) {
+            int stop;
+
+            fetched += n;
+            pthread_mutex_lock(&m->lock);
+            while (!m->stop && fetched > m->sent + MANIFEST_AHEAD)
+                pthread_cond_wait(&m->cond, &m->lock);
+            stop = m->stop;
+            pthread_mutex_unlock(&m->lock);
+            if (stop)
+                break;
+        }
+        close(fd);
+    }
+    free(buffer);
+    return NULL;
+}
+
+static void manifest_progress(size_t bytes, void *arg)
+{
+    struct manifest *m = arg;
+
+    pthread_mutex_lock(&m->lock);
+    m->sent += bytes;
+    pthread_cond_signal(&m->cond);
+    pthread_mutex_unlock(&m->lock);
+    show_progress(m->sent, m->total, m->start, &m->last);
+}
+
+static int load_manifest(int argc, char *argv[])
+{
+    struct manifest m = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+    };
+    int old_mode, mode, prefetching;
+    int e, i, duration;
+
+    REQUIRE_PARAMS(2);
+    SYNC_WRITES();
+
+    old_mode = mode = imx_get_write_mode(h);
+    if (argc >= 3) {
+        mode = find_write_mode(argv[2]);
+        if (mode < 0)
+            return mode;
+    }
+
+    e = manifest_read(argv[1], &m);
+    if (e < 0) {
+        free(m.entries);
+        return e;
+    }
+
+    prefetching = pthread_create(&m.thread, NULL, manifest_prefetch, &m) == 0;
+    m.start = mseconds();
+    imx_set_write_mode(h, mode);
+    for (i = 0; i < m.count && e >= 0; i++) {
+        struct manifest_entry *entry = &m.entries[i];
+        size_t length, pos = 0;
+        uint8_t *data;
+        int mapped = 1;
+
+        if (!entry->length)
+            continue;
+        data = map_file(entry->file, &length);
+        if (!data) {
+            mapped = 0;
+            data = buffer_file(entry->file, &length);
+        }
+        if (!data || length != entry->length) {
+            fprintf(stderr, "Unable to read %s\n", entry->file);
+            e = -EINVAL;
+        } else {
+            e = write_pieces(entry->addr, data, length, &pos, mapped, NULL,
+                    manifest_progress, &m);
+            if (e < 0)
+                fprintf(stderr, "Failed to write %s to 0x%8.8x [%zd bytes]\n",
+                        entry->file, entry->addr, length);
+        }
+        if (mapped && data)
+            munmap(data, length);
+        else
+            free(data);
+    }
+    imx_set_write_mode(h, old_mode);
+
+    if (prefetching) {
+        pthread_mutex_lock(&m.lock);
+        m.stop = 1;
+        pthread_cond_signal(&m.cond);
+        pthread_mutex_unlock(&m.lock);
+        pthread_join(m.thread, NULL);
+    }
+    if (m.last)
+        printf("\n");
+
+    duration = mseconds() - m.start;
+    if (e >= 0)
+        printf("Took %dms to load %d files, %zdB: %zdkB/s [%s]\n", duration,
+            m.count, m.total, ((m.total / 1024) * 1000) / max(duration, 1),
+            write_modes[mode]);
+    free(m.entries);
+    return e;
+}
+
+/**
+ * Progress through a load, for show_progress
+ */
+struct load_progress {
+    size_t sent, total;
+    int start, last;
+};
+
+static void load_progress(size_t bytes, void *arg)
+{
+    struct load_progress *p = arg;
+
+    p->sent += bytes;
+    show_progress(p->sent, p->total, p->start, &p->last);
+}
+
+static int load_image(int argc, char *argv[])
+{
+    struct imx_image image;
+    struct load_progress p = {0};
+    int zero_fill = 1;
+    uint64_t span;
+    int e, i, duration;
+
+    REQUIRE_PARAMS(2);
+    SYNC_WRITES();
+
+    if (argc >= 3) {
+        if (strcmp(argv[2], "nobss") == 0) {
+            zero_fill = 0;
+        } else {
+            fprintf(stderr, "Invalid load option: %s\n", argv[2]);
+            return -EINVAL;
+        }
+    }
+
+    e = imx_image_load(argv[1], &image);
+    if (e < 0)
+        return e;
+    e = imx_image_coalesce(&image, LOAD_MERGE_GAP, zero_fill);
+    if (e < 0 || !image.count) {
+        if (e >= 0)
+            fprintf(stderr, "%s: nothing to load\n", argv[1]);
+        imx_image_free(&image);
+        return e < 0 ? e : -EINVAL;
+    }
+
+    p.total = image.data_len;
+    span = (uint64_t)image.segments[image.count - 1].addr +
+        image.segments[image.count - 1].length - image.segments[0].addr;
+    printf("%s image: %d segment%s, %zdB to send (%lldB as a flat binary)\n",
+            image.format, image.count, image.count == 1 ? "" : "s",
+            p.total, (long long)span);
+
+    p.start = mseconds();
+    for (i = 0; i < image.count && e >= 0; i++) {
+        struct imx_segment *seg = &image.segments[i];
+        size_t pos = 0;
+
+        e = write_pieces(seg->addr, image.data + seg->offset, seg->length,
+                &pos, 0, NULL, load_progress, &p);
+        if (e < 0)
+            fprintf(stderr, "Failed to write segment at 0x%8.8x [%d bytes]\n",
+                    seg->addr + (uint32_t)pos, seg->length);
+    }
+    if (p.last)
+        printf("\n");
+
+    duration = mseconds() - p.start;
+    if (e >= 0) {
+        printf("Took %dms to load %zdB: %zdkB/s\n", duration, p.total,
+            ((p.total / 1024) * 1000) / max(duration, 1));
+        if (image.has_entry)
+            printf("Entry point 0x%8.8x\n", image.entry);
+    }
+    imx_image_free(&image);
+    return e;
+}
+
+static int dump_mem32(int argc, char *argv[])
+{
+    uint32_t addr;
+    int length;
+    uint32_t *data;
+    int i, e;
+
+    REQUIRE_PARAMS(3);
+    SYNC_WRITES();
+
+    addr = val2addr(argv[1]);
+    length = strtoul(argv[2], NULL, 0);
+
+    data = malloc(length * 4);
+    if (!data) {
+        perror("malloc");
+        return -ENOMEM;
+    }
+
+    e = imx_read_bulk(h, addr, (uint8_t *)data, length * 4, 32);
+    if (e < 0) {
+        free(data);
+        return e;
+    }
+
+    for (i = 0; i < length; i++) {
+        if ((i % 4) == 0)
+            printf("%8.8x:", addr + i * 4);
+        printf(" %8.8x", data[i]);
+        if ((i % 4) == 3)
+            printf("\n");
+    }
+    if ((length % 4) != 0)
+        printf("\n");
+
+    free(data);
+
+    return e;
+}
+
+static int dump_mem(int argc, char *argv[])
+{
+    uint32_t addr;
+    int length;
+    uint8_t *data;
+    int i, e;
+
+    REQUIRE_PARAMS(3);
+    SYNC_WRITES();
+
+    addr = val2addr(argv[1]);
+    length = strtoul(argv[2], NULL, 0);
+
+    data = malloc(length);
+    if (!data) {
+        perror("malloc");
+        return -ENOMEM;
+    }
+
+    e = imx_read_bulk(h, addr, data, length, 8);
+    if (e < 0) {
+        free(data);
+        return e;
+    }
+
+    for (i = 0; i < length; i++) {
         if ((i % 16) == 0)
             printf("%8.8x:", addr + i);
         printf(" %2.2x", data[i]);
@@ -360,7 +1513,7 @@ static int dump_mem(int argc, char *argv[])
 
 static inline void dump_percentage(int percentage)
 {
-	static int last_percentage = -1;
+	static __thread int last_percentage = -1;
 
 	if (percentage != last_percentage) {
 		printf("%03d%%\b\b\b\b", percentage);
@@ -378,6 +1531,7 @@ static int mtest(int argc, char *argv[])
 	uint32_t value;
 
 	REQUIRE_PARAMS(3);
+	SYNC_WRITES();
 
 	start = strtoul(argv[1], NULL, 0);
 	len = strtoul(argv[2], NULL, 0);
@@ -385,6 +1539,7 @@ static int mtest(int argc, char *argv[])
 		size = strtoul(argv[3], NULL, 0);
 	else
 		size = 4; // default to 32-bit access
+	uploads_forget(start, len);
 
 	printf("Write: ");
 	for (i = 0; i < len / size; i+=size) {
@@ -415,15 +1570,17 @@ static int mtest(int argc, char *argv[])
 	return 0;
 }
 
-static int jump(int argc, char *argv[])
+/**
+ * Start the code at an address, which ends the session
+ * @param image Non-zero if addr is the IVT of a boot image already on the
+ *              device, rather than the code itself
+ */
+static int jump_to(uint32_t addr, int image)
 {
-    uint32_t addr;
     int e;
 
-    REQUIRE_PARAMS(2);
-
-    addr = val2addr(argv[1]);
-    e = imx_jump_address(h, addr);
+    uploads_clear();
+    e = image ? imx_jump_image(h, addr) : imx_jump_address(h, addr);
     if (e < 0)
         fprintf(stderr, "Failed to jump to 0x%8.8x\n", addr);
     else {
@@ -434,9 +1591,127 @@ static int jump(int argc, char *argv[])
     return e;
 }
 
+static int jump(int argc, char *argv[])
+{
+    REQUIRE_PARAMS(2);
+    SYNC_WRITES();
+
+    return jump_to(val2addr(argv[1]), 0);
+}
+
+/**
+ * Write a boot image's IVT & boot data, for the ROM to start it from. The
+ * DCD has already been applied, so the IVT no longer points to it
+ */
+static int write_boot_headers(const struct imx_boot_image *image,
+        const uint8_t *data)
+{
+    struct imx_image_ivt *ivt;
+    uint8_t *header;
+    int e;
+
+    header = malloc(image->header_length);
+    if (!header)
+        return -ENOMEM;
+    memcpy(header, data, image->header_length);
+    ivt = (struct imx_image_ivt *)header;
+    ivt->dcd = 0;
+    uploads_forget(image->self, image->header_length);
+    e = imx_write_bulk(h, image->self, header, image->header_length);
+    if (e < 0)
+        fprintf(stderr, "Failed to write the IVT to 0x%8.8x\n",
+                image->self);
+    free(header);
+    return e;
+}
+
+static int boot_image(int argc, char *argv[])
+{
+    struct imx_boot_image image;
+    struct imx_dcd dcd;
+    struct load_progress p = {0};
+    const char *file;
+    size_t length, pos = 0;
+    uint8_t *data;
+    int e, mapped = 1, start_jump = 1;
+
+    REQUIRE_PARAMS(2);
+    SYNC_WRITES();
+
+    file = argv[1];
+    if (argc >= 3) {
+        if (strcmp(argv[2], "nojump") == 0) {
+            start_jump = 0;
+        } else {
+            fprintf(stderr, "Invalid boot option: %s\n", argv[2]);
+            return -EINVAL;
+        }
+    }
+
+    data = map_file(file, &length);
+    if (!data) {
+        mapped = 0;
+        data = buffer_file(file, &length);
+    }
+    if (!data) {
+        perror("buffer file");
+        return -EINVAL;
+    }
+
+    p.start = mseconds();
+    if (imx_soc(h)->protocol == IMX_PROTOCOL_SDPS) {
+        /* The ROM does all of this itself */
+        p.total = length;
+        uploads_clear();
+        e = imx_write_bulk(h, 0, data, length);
+        goto out;
+    }
+
+    imx_dcd_init(&dcd);
+    e = imx_boot_image_parse(file, data, length, &image, &dcd);
+    if (e >= 0 && dcd.count) {
+        uploads_forget_dcd(&dcd);
+        e = imx_dcd_send(h, &dcd);
+        if (e >= 0)
+            printf("Applied %d DCD entries in %d DCD write%s\n", dcd.count,
+                    e, e == 1 ? "" : "s");
+    }
+    imx_dcd_free(&dcd);
+
+    if (e >= 0) {
+        printf("Loading 0x%8.8x-0x%8.8zx, entry point 0x%8.8x\n",
+                image.payload_addr,
+                image.payload_addr + image.payload_length - 1, image.entry);
+        p.total = image.payload_length;
+        e = write_pieces(image.payload_addr, data + image.payload_offset,
+                image.payload_length, &pos, mapped, NULL, load_progress, &p);
+        if (p.last)
+            printf("\n");
+        if (e < 0)
+            fprintf(stderr, "Failed to write %s to 0x%8.8x [%zd bytes]\n",
+                    file, image.payload_addr, image.payload_length);
+    }
+    if (e >= 0)
+        e = write_boot_headers(&image, data);
+
+out:
+    if (e >= 0)
+        printf("Took %dms to load %zdB: %zdkB/s\n", mseconds() - p.start,
+                p.total, ((p.total / 1024) * 1000) /
+                max(mseconds() - p.start, 1));
+    if (mapped)
+        munmap(data, length);
+    else
+        free(data);
+    if (e >= 0 && start_jump && imx_soc(h)->protocol != IMX_PROTOCOL_SDPS)
+        e = jump_to(image.self, 1);
+    return e;
+}
+
 static int usleep_func(int argc, char *argv[])
 {
 	REQUIRE_PARAMS(1);
+	SYNC_WRITES();
 	usleep(atoi(argv[1]));
 	return 0;
 }
@@ -465,6 +1740,7 @@ static int spi_func(int argc, char *argv[])
 	uint32_t mode = 0; // FIXME: VALUE?
 
 	REQUIRE_PARAMS(5);
+	SYNC_WRITES();
 
 	dev = strtoul(argv[1], NULL, 0);
 	cs = strtoul(argv[2], NULL, 0);
@@ -512,6 +1788,7 @@ static int gpio_func(int argc, char *argv[])
 	int e;
 
 	REQUIRE_PARAMS(4);
+	SYNC_WRITES();
 
 	command = argv[1];
 	bank = strtoul(argv[2], NULL, 0);
@@ -543,6 +1820,71 @@ static int gpio_func(int argc, char *argv[])
 	return e;
 }
 
+/**
+ * Return the compiled DCD table for an imximage .cfg file, from cfg_cache
+ * if it is up to date
+ */
+static struct imx_dcd *cfg_compile(const char *file)
+{
+    struct stat st;
+
+    if (stat(file, &st) < 0) {
+        fprintf(stderr, "Unable to open %s: %s\n", file, strerror(errno));
+        return NULL;
+    }
+    if (cfg_cache.valid && strcmp(cfg_cache.file, file) == 0 &&
+            cfg_cache.mtime == st.st_mtime && cfg_cache.size == st.st_size)
+        return &cfg_cache.dcd;
+
+    imx_dcd_reset(&cfg_cache.dcd);
+    cfg_cache.valid = 0;
+    if (imx_cfg_parse(file, &cfg_cache.dcd) < 0)
+        return NULL;
+    if (strlen(file) < sizeof(cfg_cache.file)) {
+        strcpy(cfg_cache.file, file);
+        cfg_cache.mtime = st.st_mtime;
+        cfg_cache.size = st.st_size;
+        cfg_cache.valid = 1;
+    }
+    return &cfg_cache.dcd;
+}
+
+static int run_cfg(int argc, char *argv[])
+{
+    struct imx_dcd *dcd;
+    int e, start;
+
+    REQUIRE_PARAMS(2);
+    SYNC_WRITES();
+
+    dcd = cfg_compile(argv[1]);
+    if (!dcd)
+        return -EINVAL;
+    if (!dcd->count)
+        return 0;
+
+    start = mseconds();
+    uploads_forget_dcd(dcd);
+    e = imx_dcd_send(h, dcd);
+    if (e < 0) {
+        fprintf(stderr, "Failed to apply %s\n", argv[1]);
+        return e;
+    }
+    printf("Applied %d DCD entries in %d DCD write%s (%dms)\n", dcd->count,
+            e, e == 1 ? "" : "s", mseconds() - start);
+    return 0;
+}
+
+/**
+ * Whether a file is an imximage configuration, rather than a script
+ */
+static int is_cfg(const char *file)
+{
+    size_t len = strlen(file);
+
+    return len > 4 && strcmp(file + len - 4, ".cfg") == 0;
+}
+
 static int include_script(int argc, char *argv[]);
 
 struct parser_function functions[] = {
@@ -552,10 +1894,19 @@ struct parser_function functions[] = {
     {"r16", read_reg16},
     {"w8", write_reg8},
     {"r8", read_reg8},
+    {"check32", check_reg32},
     {"write_file", write_file},
+    {"write_mode", write_mode_func},
+    {"write_bench", write_bench},
     {"verify_file", verify_file},
+    {"read_depth", read_depth_func},
+    {"dcd_addr", dcd_addr_func},
     {"usleep", usleep_func},
-    //{"save_file", save_file},
+    {"save_file", save_file},
+    {"load_manifest", load_manifest},
+    {"load", load_image},
+    {"boot_image", boot_image},
+    {"run_cfg", run_cfg},
     {"dump", dump_mem},
     {"dump32", dump_mem32},
     {"mtest", mtest},
@@ -574,37 +1925,735 @@ static int include_script(int argc, char *argv[])
 
     REQUIRE_PARAMS(2);
 
+    if (is_cfg(argv[1]))
+        return run_cfg(argc, argv);
     e = parse_filename(argv[1], 0, functions, NFUNCTIONS);
     return e;
 }
+
+/**
+ * Set up the console state for the device this thread is driving
+ */
+static void session_start(struct imx_device *dev)
+{
+    h = dev;
+    imx_batch_init(&batch);
+    uploads_clear();
+    imx_set_queued_writes(h, queue_writes);
+}
+
+/**
+ * Register writes are batched into DCD writes, where the boot ROM has them
+ */
+static int can_batch(void)
+{
+    return batch_writes && (imx_soc(h)->caps & IMX_CAP_DCD_WRITE);
+}
+
+/**
+ * Finish with the device this thread is driving (unless a jump has already
+ * disconnected it)
+ * @return < 0 if the final writes failed
+ */
+static int session_end(void)
+{
+    int e = 0;
+
+    if (h) {
+        e = sync_writes();
+        imx_disconnect(h);
+        h = NULL;
+    }
+    return e;
+}
+
+/**
+ * Release everything this thread keeps from one session to the next, once
+ * it has finished with its last one
+ */
+static void thread_end(void)
+{
+    int i;
+
+    imx_batch_free(&batch);
+    imx_dcd_free(&cfg_cache.dcd);
+    memset(&cfg_cache, 0, sizeof(cfg_cache));
+    free(uploads);
+    uploads = NULL;
+    nuploads = uploads_size = 0;
+    for (i = 0; i < ndefines; i++) {
+        free((char *)defines[i]->name);
+        free((char *)defines[i]->value);
+        free(defines[i]);
+    }
+    free(defines);
+    defines = NULL;
+    ndefines = 0;
+}
+
+static int run_scripts(char **scripts, int count)
+{
+    int i, e = 0;
+
+    batching = can_batch();
+    for (i = 0; i < count && e >= 0; i++) {
+        if (is_cfg(scripts[i]))
+            e = run_cfg(2, (char *[]){"run_cfg", scripts[i]});
+        else
+            e = parse_filename(scripts[i], 0, functions, NFUNCTIONS);
+    }
+    return e;
+}
+
+/**
+ * A device being driven by run_parallel
+ */
+struct worker {
+    struct imx_device *dev;
+    char name[32];
+    const char *soc;
+    char **scripts;
+    int nscripts;
+    pthread_t thread;
+    int result;
+    int duration;
+    char failed_at[256];
+    int writes, transactions;
+};
+
+static void *worker_run(void *arg)
+{
+    struct worker *w = arg;
+    int start = mseconds();
+    int e;
+
+    session_start(w->dev);
+    parser_set_prefix(w->name);
+    e = run_scripts(w->scripts, w->nscripts);
+    if (e < 0)
+        snprintf(w->failed_at, sizeof(w->failed_at), "%s",
+                parser_error_location());
+    if (session_end() < 0 && e >= 0) {
+        snprintf(w->failed_at, sizeof(w->failed_at), "final writes");
+        e = -EIO;
+    }
+    w->result = e;
+    w->duration = mseconds() - start;
+    w->writes = batch.writes;
+    w->transactions = batch.transactions;
+    thread_end();
+    return NULL;
+}
+
+/**
+ * Run the same scripts on several devices at once, one thread per device,
+ * and summarise how each one went
+ * @return Number of devices which failed
+ */
+static int run_parallel(struct imx_device **devs, int count, char **scripts,
+        int nscripts)
+{
+    struct worker *workers;
+    int start = mseconds();
+    int i, failed = 0;
+
+    workers = calloc(count, sizeof(*workers));
+    if (!workers) {
+        for (i = 0; i < count; i++)
+            imx_disconnect(devs[i]);
+        return count;
+    }
+
+    for (i = 0; i < count; i++) {
+        struct worker *w = &workers[i];
+
+        w->dev = devs[i];
+        snprintf(w->name, sizeof(w->name), "%s", imx_name(devs[i]));
+        w->soc = imx_soc(devs[i])->name;
+        w->scripts = scripts;
+        w->nscripts = nscripts;
+        if (pthread_create(&w->thread, NULL, worker_run, w) != 0) {
+            perror("pthread_create");
+            imx_disconnect(w->dev);
+            w->dev = NULL;
+            w->result = -EAGAIN;
+            snprintf(w->failed_at, sizeof(w->failed_at), "thread creation");
+        }
+    }
+
+    for (i = 0; i < count; i++)
+        if (workers[i].dev)
+            pthread_join(workers[i].thread, NULL);
+
+    printf("\n%-16s %-10s %8s  %s\n", "Device", "SoC", "Time", "Result");
+    for (i = 0; i < count; i++) {
+        struct worker *w = &workers[i];
+
+        printf("%-16s %-10s %6dms  ", w->name, w->soc, w->duration);
+        if (w->result < 0) {
+            printf("FAIL (%s)\n", w->failed_at);
+            failed++;
+        } else {
+            printf("PASS\n");
+        }
+    }
+    printf("%d of %d devices passed in %dms\n", count - failed, count,
+            mseconds() - start);
+
+    free(workers);
+    return failed;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-BQFa] [-d location] [-R retries] [-w [-u units]] [-s latency_us [-n count]] [-c capture] [-r capture [-t scale]] [-D socket | -C socket] [-K cache_dir] [script...]\n", prog);
+    fprintf(stderr, "\t-B\tDon't batch consecutive register writes in scripts\n");
+    fprintf(stderr, "\t-Q\tQueue register writes, checking their status later\n");
+    fprintf(stderr, "\t-a\tRun the scripts on every attached device at once\n");
+    fprintf(stderr, "\t-d\tUse the device at this port path (ie: 1-2.3) or bus:address (ie: 1:5)\n");
+    fprintf(stderr, "\t-R\tRun the scripts again if they fail, resuming interrupted uploads\n");
+    fprintf(stderr, "\t-w\tWait for each device to attach, run the scripts on it, and repeat\n");
+    fprintf(stderr, "\t-u\tStop waiting after this many devices\n");
+    fprintf(stderr, "\t-s\tUse a simulated device, with the given latency per transfer\n");
+    fprintf(stderr, "\t-n\tNumber of simulated devices (implies -a)\n");
+    fprintf(stderr, "\t-c\tRecord every transfer to a capture log\n");
+    fprintf(stderr, "\t-F\tRecord all data in the capture log, not just a hash of it\n");
+    fprintf(stderr, "\t-r\tReplay the responses from a capture log, instead of using a device\n");
+    fprintf(stderr, "\t-t\tScale the replayed timing (0 replays as fast as possible)\n");
+    fprintf(stderr, "\t-D\tKeep the device open, running commands sent to this socket\n");
+    fprintf(stderr, "\t-C\tSend the scripts (or stdin) to the daemon on this socket\n");
+    fprintf(stderr, "\t-K\tKeep compiled scripts in this directory (default ~/.cache/imx_usb_console, \"\" for none)\n");
+}
+
+/*
+ * Production station mode
+ * Stays resident, running the scripts on each board as it enters the USB
+ * bootloader, and keeps track of how long each one takes
+ */
+static volatile sig_atomic_t stop_waiting = 0;
+
+static void stop_handler(int sig)
+{
+    stop_waiting = 1;
+}
+
+struct cycle_stats {
+    int units;
+    int passed;
+    int min, max;
+    long total;
+    int first;          /* Time the first unit arrived */
+};
+
+static void print_stats(struct cycle_stats *st)
+{
+    int elapsed = max(mseconds() - st->first, 1);
+
+    if (!st->units)
+        return;
+    printf("%d units, %d passed; cycle min/avg/max %d/%ld/%dms; %ld units/hour\n",
+            st->units, st->passed, st->min, st->total / st->units, st->max,
+            (st->units * 3600000L) / elapsed);
+}
+
+/**
+ * Open a device which has just arrived. Its device node may not be usable
+ * straight away, so keep trying for a little while
+ */
+static struct imx_device *open_arrival(const struct imx_device_id *id)
+{
+    struct imx_device *dev;
+    int i;
+
+    for (i = 0; i < 50; i++) {
+        dev = imx_open(id);
+        if (dev)
+            return dev;
+        usleep(10000);
+    }
+    return NULL;
+}
+
+/**
+ * Wait for a device which has dropped off the bus to come back on the
+ * same port
+ */
+static struct imx_device *reconnect(const char *location, int timeout_ms)
+{
+    struct imx_monitor *m;
+    struct imx_device *dev = NULL;
+    int start = mseconds();
+
+    m = imx_monitor_start();
+    if (!m)
+        return NULL;
+    while (!dev && mseconds() - start < timeout_ms) {
+        struct imx_device_id id;
+        int e = imx_monitor_wait(m, &id, 100);
+
+        if (e < 0)
+            break;
+        if (e > 0 && strcmp(id.path, location) == 0)
+            dev = open_arrival(&id);
+    }
+    imx_monitor_stop(m);
+    return dev;
+}
+
+/**
+ * Run the scripts, running them again if they fail (after waiting for the
+ * device to come back, if it has gone). Uploads which were cut short carry
+ * on from where they got to
+ * @param retries Maximum number of times to rerun the scripts
+ * @param can_reconnect Non-zero if the device is a real one, which can be
+ *                      reopened
+ */
+static int run_scripts_retrying(char **scripts, int count, int retries,
+        int can_reconnect)
+{
+    int e;
+
+    while ((e = run_scripts(scripts, count)) < 0 && retries-- > 0 && h) {
+        if (!imx_connected(h)) {
+            char location[32];
+            struct imx_device *dev;
+
+            snprintf(location, sizeof(location), "%s", imx_name(h));
+            session_end();
+            imx_batch_free(&batch);
+            if (!can_reconnect)
+                break;
+            printf("Waiting for %s to reconnect\n", location);
+            dev = reconnect(location, RECONNECT_TIMEOUT);
+            if (!dev) {
+                fprintf(stderr, "%s did not reconnect\n", location);
+                break;
+            }
+            session_start(dev);
+        }
+        printf("Running scripts again (%d retries left)\n", retries);
+    }
+    return e;
+}
+
+/**
+ * Wait for boards to arrive, and run the scripts on each one in turn
+ * @param units Number of boards to run, or 0 to carry on until interrupted
+ * @return Number of boards which failed
+ */
+static int run_waiting(char **scripts, int nscripts, int units,
+        const char *capture, int capture_full)
+{
+    struct imx_monitor *m;
+    struct cycle_stats st = {0};
+
+    m = imx_monitor_start();
+    if (!m) {
+        fprintf(stderr, "Unable to watch for devices\n");
+        return -1;
+    }
+
+    signal(SIGINT, stop_handler);
+    printf("Waiting for devices...\n");
+    while (!stop_waiting && (!units || st.units < units)) {
+        struct imx_device_id id;
+        struct imx_device *dev;
+        int attached, cycle, e;
+
+        e = imx_monitor_wait(m, &id, 100);
+        if (e < 0)
+            break;
+        if (e == 0)
+            continue;
+
+        attached = mseconds();
+        if (!st.units)
+            st.first = attached;
+        dev = open_arrival(&id);
+        if (!dev) {
+            fprintf(stderr, "Unable to open %s\n", id.path);
+            continue;
+        }
+        printf("Unit %d: %s %s (opened in %dms)\n", st.units + 1,
+                id.soc->name, id.path, mseconds() - attached);
+
+        if (capture) {
+            char filename[256];
+            snprintf(filename, sizeof(filename), "%s.%d", capture,
+                    st.units + 1);
+            imx_capture_start(dev, filename, capture_full);
+        }
+
+        session_start(dev);
+        e = run_scripts(scripts, nscripts);
+        if (session_end() < 0)
+            e = -EIO;
+        imx_batch_free(&batch);
+        cycle = mseconds() - attached;
+
+        st.units++;
+        if (e >= 0)
+            st.passed++;
+        st.total += cycle;
+        st.min = st.units == 1 ? cycle : min(st.min, cycle);
+        st.max = max(st.max, cycle);
+        printf("Unit %d: %s in %dms\n", st.units, e < 0 ? "FAIL" : "PASS",
+                cycle);
+        print_stats(&st);
+    }
+    signal(SIGINT, SIG_DFL);
+
+    imx_monitor_stop(m);
+    return st.units - st.passed;
+}
+
+/*
+ * Daemon mode
+ * Keeps the session open, and runs commands sent to it by clients (-C), so
+ * that each command only costs its own transfers
+ */
+struct daemon {
+    char location[32];  /* Where to look for the device if it goes away */
+    int can_reconnect;
+};
+
+/**
+ * Open the device again once it has been reset or has jumped away, so
+ * that clients don't need to restart the daemon
+ */
+static void daemon_reopen(struct daemon *d)
+{
+    struct imx_device_id id;
+    struct imx_device *dev;
+
+    if (imx_parse_location(d->location, &id) < 0)
+        return;
+    dev = imx_open(&id);
+    if (!dev)
+        return;
+    imx_batch_free(&batch);
+    session_start(dev);
+    batching = can_batch();
+    printf("Reconnected to %s %s\n", imx_soc(dev)->name, imx_name(dev));
+}
+
+static int daemon_command(char *line, void *user_data)
+{
+    struct daemon *d = user_data;
+    int e, s;
+
+    if (h && !imx_connected(h)) {
+        fprintf(stderr, "Device has gone\n");
+        session_end();
+    }
+    if (!h && d->can_reconnect)
+        daemon_reopen(d);
+
+    e = parse_line(line, functions, NFUNCTIONS);
+    /* Each reply covers everything the command did */
+    if (h) {
+        s = sync_writes();
+        if (e >= 0)
+            e = s;
+    }
+    return e;
+}
+
+/**
+ * Serve commands on a socket until interrupted
+ * @param can_reconnect Non-zero if the device is a real one, which can be
+ *                      reopened
+ */
+static int run_daemon(const char *path, int can_reconnect)
+{
+    struct daemon d;
+    int e;
+
+    snprintf(d.location, sizeof(d.location), "%s", imx_name(h));
+    d.can_reconnect = can_reconnect;
+    batching = can_batch();
+
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+    printf("Serving %s on %s\n", d.location, path);
+    fflush(stdout);
+    e = imx_server_run(path, daemon_command, &d, &stop_waiting);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    return e;
+}
+
+/**
+ * Connect to every device the scripts are to be run on
+ * @return Number of devices connected to
+ */
+static int connect_all(struct imx_device ***devs, int all, int simulate,
+        int sim_count, int latency_us, const char *replay,
+        double replay_scale, const char *location)
+{
+    struct imx_device_id *ids = NULL;
+    struct imx_device **list;
+    int count, found = 0, i;
+
+    if (replay)
+        count = 1;
+    else if (location) {
+        /* Go straight to the device, rather than enumerating the bus */
+        ids = malloc(sizeof(*ids));
+        if (!ids)
+            return 0;
+        if (imx_parse_location(location, ids) < 0) {
+            free(ids);
+            return 0;
+        }
+        count = 1;
+    }
+    else if (simulate)
+        count = all ? sim_count : 1;
+    else if (!all)
+        count = 1;      /* Opened straight from the bus, see imx_connect */
+    else
+        count = imx_enumerate(&ids);
+    if (count <= 0)
+        return 0;
+    if (!all)
+        count = 1;
+
+    list = calloc(count, sizeof(*list));
+    if (!list) {
+        free(ids);
+        return 0;
+    }
+
+    for (i = 0; i < count; i++) {
+        struct imx_device *dev;
+
+        if (replay) {
+            dev = imx_replay_connect(replay, replay_scale);
+        } else if (simulate) {
+            char name[32];
+
+            dev = imx_sim_connect(NULL, latency_us);
+            snprintf(name, sizeof(name), "sim%d", i);
+            if (dev)
+                imx_set_name(dev, name);
+        } else if (ids) {
+            dev = imx_open(&ids[i]);
+        } else {
+            dev = imx_connect();
+        }
+        if (dev)
+            list[found++] = dev;
+    }
+
+    free(ids);
+    *devs = list;
+    return found;
+}
+
+/**
+ * Start recording traffic on each device. With several devices, each gets
+ * its own log, named after the device
+ */
+static int start_capture(struct imx_device **devs, int count,
+        const char *capture, int full)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        char filename[256];
+        int e;
+
+        if (count > 1)
+            snprintf(filename, sizeof(filename), "%s.%s", capture,
+                    imx_name(devs[i]));
+        else
+            snprintf(filename, sizeof(filename), "%s", capture);
+        e = imx_capture_start(devs[i], filename, full);
+        if (e < 0)
+            return e;
+    }
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
-    h = imx_connect();
-    if (!h) {
+    int opt;
+    int simulate = 0, latency_us = 0, sim_count = 1;
+    int all = 0, wait = 0, units = 0, retries = 0;
+    const char *capture = NULL, *replay = NULL, *location = NULL;
+    const char *daemon_path = NULL, *client_path = NULL;
+    const char *cache_dir = NULL;
+    char default_cache[512];
+    int capture_full = 0;
+    double replay_scale = 1.0;
+    struct imx_device **devs = NULL;
+    int count, i, start, e = 0;
+
+    while ((opt = getopt(argc, argv, "BQawu:d:R:s:n:c:Fr:t:D:C:K:")) != -1) {
+        switch (opt) {
+        case 'B':
+            batch_writes = 0;
+            break;
+        case 'Q':
+            queue_writes = 1;
+            break;
+        case 'a':
+            all = 1;
+            break;
+        case 'w':
+            wait = 1;
+            break;
+        case 'u':
+            units = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            location = optarg;
+            break;
+        case 'R':
+            retries = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            simulate = 1;
+            latency_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            sim_count = max(strtoul(optarg, NULL, 0), 1);
+            all = 1;
+            break;
+        case 'c':
+            capture = optarg;
+            break;
+        case 'F':
+            capture_full = 1;
+            break;
+        case 'r':
+            replay = optarg;
+            break;
+        case 't':
+            replay_scale = strtod(optarg, NULL);
+            break;
+        case 'D':
+            daemon_path = optarg;
+            break;
+        case 'C':
+            client_path = optarg;
+            break;
+        case 'K':
+            cache_dir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (client_path) {
+        /* The daemon has the device, so there's nothing to set up here */
+        if (imx_client_run(client_path, &argv[optind], argc - optind) != 0)
+            return EXIT_FAILURE;
+        return EXIT_SUCCESS;
+    }
+
+    if (!cache_dir && getenv("HOME")) {
+        snprintf(default_cache, sizeof(default_cache), "%s/.cache",
+                getenv("HOME"));
+        mkdir(default_cache, 0755);
+        snprintf(default_cache, sizeof(default_cache),
+                "%s/.cache/imx_usb_console", getenv("HOME"));
+        cache_dir = default_cache;
+    }
+    parser_set_cache_dir(cache_dir);
+
+    if (daemon_path && (all || wait || optind < argc)) {
+        fprintf(stderr, "The daemon runs a single device, and takes its commands from clients\n");
+        return EXIT_FAILURE;
+    }
+
+    if ((all || wait) && optind == argc) {
+        fprintf(stderr, "Running on several devices requires a script\n");
+        return EXIT_FAILURE;
+    }
+
+    if (wait) {
+        imx_set_write_origin(parser_location);
+        if (run_waiting(&argv[optind], argc - optind, units, capture,
+                    capture_full) != 0)
+            return EXIT_FAILURE;
+        return EXIT_SUCCESS;
+    }
+
+    if (location && (all || simulate || replay)) {
+        fprintf(stderr, "A device location can only be used with a single real device\n");
+        return EXIT_FAILURE;
+    }
+
+    start = mseconds();
+    count = connect_all(&devs, all, simulate, sim_count, latency_us, replay,
+            replay_scale, location);
+    if (!count) {
         fprintf(stderr, "No i.MX device found\n");
+        free(devs);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < count; i++)
+        printf("Connected to %s %s%s\n", imx_soc(devs[i])->name,
+                imx_name(devs[i]),
+                replay ? " (replay)" : simulate ? " (simulated)" : "");
+    printf("Opened %d device%s in %dms\n", count, count == 1 ? "" : "s",
+            mseconds() - start);
+
+    if (capture && start_capture(devs, count, capture, capture_full) < 0) {
+        for (i = 0; i < count; i++)
+            imx_disconnect(devs[i]);
+        free(devs);
         return EXIT_FAILURE;
     }
 
     signal(SIGQUIT, SIG_IGN);
+    imx_set_write_origin(parser_location);
 
-    if (argc >= 2) {
-        int i;
-        for (i = 1; i < argc; i++)
-            parse_filename(argv[i], 0, functions, NFUNCTIONS);
+    if (all) {
+        int failed = run_parallel(devs, count, &argv[optind], argc - optind);
+        free(devs);
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    session_start(devs[0]);
+    free(devs);
+
+    if (daemon_path) {
+        e = run_daemon(daemon_path, !simulate && !replay);
+    } else if (optind < argc) {
+        e = run_scripts_retrying(&argv[optind], argc - optind, retries,
+                !simulate && !replay);
     } else if (isatty(fileno(stdin))) {
         while (h) {
             char *buffer = readline("IMX-USB> ");
             if (buffer && *buffer)
                 add_history(buffer);
             parse_line(buffer, functions, NFUNCTIONS);
+            if (h)
+                sync_writes();
+            if (h && !imx_connected(h)) {
+                fprintf(stderr, "Device has gone\n");
+                session_end();
+            }
             free(buffer);
         }
-    } else
+    } else {
+        batching = can_batch();
         parse_file(stdin, 0, functions, NFUNCTIONS);
+    }
 
-    if (h)
-        imx_disconnect(h);
+    session_end();
 
-    return EXIT_SUCCESS;
-}
+    if (batch.writes)
+        printf("Batched %d register writes into %d transactions, saving %d\n",
+                batch.writes, batch.transactions,
+                max(batch.writes - batch.transactions, 0));
+    thread_end();
 
+    return e < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
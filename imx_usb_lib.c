@@ -19,61 +19,66 @@
 #include <string.h>
 #include <time.h>
 #include <arpa/inet.h>
+#include <endian.h>
 
 #include "imx_usb_lib.h"
+#include "imx_transport.h"
+#include "imx_image.h"
 
 #define min(a,b) (((a) < (b)) ? (a) : (b))
 #define max(a,b) (((a) > (b)) ? (a) : (b))
-
-struct sdp_command {
-    uint8_t report_id;
-    uint16_t command_type;
-    uint32_t address;
-    uint8_t format;
-    uint32_t data_count;
-    uint32_t data;
-    uint8_t reserved;
-} __attribute__((packed));
+#define ARRAY_SIZE(a) ((sizeof(a)) / sizeof((a)[0]))
 
 enum {
     HAB_PRODUCTION,
     HAB_ENGINEERING,
 };
 
-/*
- * Constants to do with the IMXIMAGE file foramt
- */
-#define IMX_IMAGE_VERSION                  0x40
-#define IMX_IMAGE_FILE_HEADER_LENGTH     0x2000
-#define IMX_IMAGE_TAG_FILE_HEADER          0xD1
-
-struct imx_image_header
-{
-    uint8_t tag;               // see IMX_IMAGE_TAG_xxx
-    uint16_t length;           // BigEndian format
-    uint8_t version;           // for the i.MX6 this should be either 0x40 or 0x41
-} __attribute__((packed));
+/* Bytes sent per command in IMX_WRITE_STREAM mode */
+#define DEFAULT_WRITE_WINDOW (4 * 1024 * 1024)
+/* Interrupt reports kept queued by imx_read_bulk */
+#define DEFAULT_READ_DEPTH 8
 
-struct imx_image_ivt
-{
-    struct imx_image_header header;
-    uint32_t entry;               // Absolute address of the first instruction to execute from the image
-    uint32_t reserved1;
-    uint32_t dcd;              // Absolute address of the image DCD. The DCD is optional so this field may be set to NULL if no DCD is required
-    uint32_t boot_data;        // Absolute address of the Boot Data
-    uint32_t self;             // Absolute address of the IVT
-    uint32_t csf;              // Absolute address of Command Sequence File (CSF) used by the HAB library
-    uint32_t reserved2;
-} __attribute__((packed));
+struct async_block;
 
-static libusb_context *_context = NULL;
+/**
+ * A session with one device: the transport used to reach it, plus all of
+ * the settings & state for talking to it. Sessions share nothing, so
+ * different threads can each drive their own
+ */
+struct imx_device {
+    const struct imx_transport_ops *ops;
+    void *priv;
+    const struct imx_soc *soc;
+    char name[32];
+    int ep_out;         /* Interrupt OUT endpoint, or 0 to use SET_REPORT */
+    int image_loaded;   /* SDPS: an image has been downloaded */
+
+    /* Settings */
+    int queued_writes;
+    int write_mode;
+    int write_window;
+    int read_depth;
+    uint32_t dcd_addr;
+    int dcd_area_used;  /* An upload has put data where DCDs are staged */
+    int dcd_area_noted; /* The user has been told batches are going direct */
+
+    /* Link health */
+    int link_error;     /* Why the device was lost, or 0 while usable */
+    int timeouts;       /* Consecutive transfers which have timed out */
+    int srtt_us;        /* Smoothed round trip of synchronous transfers */
+    int rttvar_us;      /* ... and its variation */
+
+    /* Write state */
+    int stream_rejected;        /* The ROM can't take streamed writes */
+    int write_acked;    /* Bytes of the last bulk write the ROM has taken */
+    struct async_block *write_queue;
+    int queue_head, queue_count;
+};
 
-#define SDP_READ_REGISTER 0x0101
-#define SDP_WRITE_REGISTER 0x0202
-#define SDP_WRITE_FILE 0x0404
-#define SDP_ERROR_STATUS 0x0505
-#define SDP_DCD_WRITE 0x0a0a
-#define SDP_JUMP_ADDRESS 0x0b0b
+static int imx_queue_write_reg(struct imx_device *h, uint32_t addr,
+        uint32_t data, int format);
+static void queue_free(struct imx_device *h);
 
 
 #define HID_GET_REPORT              0x01
@@ -85,7 +90,14 @@ static libusb_context *_context = NULL;
 #define CTRL_IN                 LIBUSB_ENDPOINT_IN |LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE
 #define CTRL_OUT                LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE
 
+/* Longest any single transfer may take (ms) */
 #define TIMEOUT 1000
+/* Slack added to the measured round trip when waiting for a report (ms) */
+#define MIN_TIMEOUT 20
+/* Attempts at a synchronous transfer, doubling the timeout each time */
+#define MAX_ATTEMPTS 4
+/* Transfers in a row which must time out before the device is given up on */
+#define MAX_TIMEOUTS 3
 
 #define EP_IN 0x81
 
@@ -116,344 +128,2393 @@ static int usb_error(int e, const char *msg, ...)
 	return e;
 }
 
-void imx_disconnect(struct libusb_device_handle *h)
+/**
+ * Supported boot ROMs, the protocol they speak, and the commands they accept
+ */
+#define SDP_CAPS (IMX_CAP_REGISTERS | IMX_CAP_DCD_WRITE | IMX_CAP_JUMP)
+#define SDPS_CAPS 0
+
+static const struct imx_soc imx_socs[] = {
+    {0x15a2, 0x0052, "i.MX50", IMX_PROTOCOL_SDP, SDP_CAPS, 0xf8006000},
+    {0x15a2, 0x0054, "i.MX6Q", IMX_PROTOCOL_SDP, SDP_CAPS, 0x00910000},
+    {0x15a2, 0x0061, "i.MX6DL", IMX_PROTOCOL_SDP, SDP_CAPS, 0x00910000},
+    {0x15a2, 0x0063, "i.MX6SL", IMX_PROTOCOL_SDP, SDP_CAPS, 0x00910000},
+    {0x15a2, 0x0071, "i.MX6SX", IMX_PROTOCOL_SDP, SDP_CAPS, 0x00910000},
+    {0x1fc9, 0x0129, "i.MX8QM", IMX_PROTOCOL_SDPS, SDPS_CAPS, 0},
+    {0x1fc9, 0x012f, "i.MX8QXP", IMX_PROTOCOL_SDPS, SDPS_CAPS, 0},
+    {0x1fc9, 0x014e, "i.MX93", IMX_PROTOCOL_SDPS, SDPS_CAPS, 0},
+};
+
+const struct imx_soc *imx_find_soc(uint16_t vid, uint16_t pid)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(imx_socs); i++)
+        if (imx_socs[i].vid == vid && imx_socs[i].pid == pid)
+            return &imx_socs[i];
+    return NULL;
+}
+
+/**
+ * Find the interrupt OUT endpoint on interface 0, if there is one
+ */
+static int find_ep_out(libusb_device *dev)
+{
+    struct libusb_config_descriptor *config;
+    const struct libusb_interface_descriptor *intf;
+    int ep = 0, i;
+
+    if (libusb_get_active_config_descriptor(dev, &config) < 0)
+        return 0;
+    if (config->bNumInterfaces > 0 &&
+            config->interface[0].num_altsetting > 0) {
+        intf = &config->interface[0].altsetting[0];
+        for (i = 0; i < intf->bNumEndpoints; i++) {
+            const struct libusb_endpoint_descriptor *epd = &intf->endpoint[i];
+            if ((epd->bmAttributes & 3) == LIBUSB_TRANSFER_TYPE_INTERRUPT &&
+                    !(epd->bEndpointAddress & LIBUSB_ENDPOINT_IN)) {
+                ep = epd->bEndpointAddress;
+                break;
+            }
+        }
+    }
+    libusb_free_config_descriptor(config);
+    return ep;
+}
+
+const struct imx_soc *imx_soc(struct imx_device *h)
 {
-    libusb_release_interface(h, 0);
-    libusb_close(h);
+    return h->soc;
 }
 
-libusb_device_handle *imx_connect(void)
+int imx_connected(struct imx_device *h)
 {
-    int count, i;
+    return !h->link_error;
+}
+
+/**
+ * Check that the boot ROM accepts a command before sending it
+ * @param cap IMX_CAP_xxx flag the command needs
+ * @param what Description of the command, for the error message
+ */
+static int imx_require(struct imx_device *h, unsigned int cap,
+        const char *what)
+{
+    if (h->soc->caps & cap)
+        return 0;
+    fprintf(stderr, "%s does not support %s\n", h->soc->name, what);
+    return -EOPNOTSUPP;
+}
+
+/*
+ * Transport helpers
+ */
+struct imx_device *imx_device_create(const struct imx_transport_ops *ops,
+        void *priv, const struct imx_soc *soc, int ep_out)
+{
+    struct imx_device *h = calloc(1, sizeof(*h));
+
+    if (!h)
+        return NULL;
+    h->ops = ops;
+    h->priv = priv;
+    h->soc = soc;
+    h->ep_out = ep_out;
+    snprintf(h->name, sizeof(h->name), "%s", ops->name);
+    h->write_mode = IMX_WRITE_STREAM;
+    h->write_window = DEFAULT_WRITE_WINDOW;
+    h->read_depth = DEFAULT_READ_DEPTH;
+    h->dcd_addr = soc->dcd_addr;
+    return h;
+}
+
+void imx_set_name(struct imx_device *h, const char *name)
+{
+    snprintf(h->name, sizeof(h->name), "%s", name);
+}
+
+const char *imx_name(struct imx_device *h)
+{
+    return h->name;
+}
+
+const struct imx_transport_ops *imx_device_ops(struct imx_device *h,
+        void **priv)
+{
+    *priv = h->priv;
+    return h->ops;
+}
+
+void imx_device_set_ops(struct imx_device *h,
+        const struct imx_transport_ops *ops, void *priv)
+{
+    h->ops = ops;
+    h->priv = priv;
+}
+
+int imx_device_ep_out(struct imx_device *h)
+{
+    return h->ep_out;
+}
+
+/*
+ * Link health
+ * Once the device has gone (or stopped answering altogether), every
+ * further operation fails straight away rather than waiting out its own
+ * timeouts. A single slow reply (ie: a long DCD check) isn't enough to
+ * give up on it: that takes several timeouts in a row. Synchronous transfers wait for a multiple of the measured
+ * round trip, rather than a fixed second.
+ */
+static int64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Record the result of a transfer, noting if the device has been lost
+ * @return e
+ */
+static int link_result(struct imx_device *h, int e)
+{
+    if (e >= 0)
+        h->timeouts = 0;
+    else if (e == LIBUSB_ERROR_TIMEOUT && ++h->timeouts < MAX_TIMEOUTS)
+        return e;
+    if ((e == LIBUSB_ERROR_NO_DEVICE || e == LIBUSB_ERROR_TIMEOUT) &&
+            !h->link_error)
+        h->link_error = e;
+    return e;
+}
+
+int imx_device_link_result(struct imx_device *h, int e)
+{
+    return link_result(h, e);
+}
+
+int imx_transport_poll_events(const struct imx_transport_ops *ops,
+        void *priv)
+{
+    int e = 0;
+
+    if (ops->poll_events)
+        return ops->poll_events(priv);
+    while (e >= 0 && ops->next_timeout(priv) == 0)
+        e = ops->handle_events(priv);
+    return e;
+}
+
+/**
+ * Fold a successful transfer's duration into the round trip estimate
+ * (as for TCP's retransmit timer, RFC 6298)
+ */
+static void link_sample(struct imx_device *h, int us)
+{
+    h->timeouts = 0;
+    if (!h->srtt_us) {
+        h->srtt_us = max(us, 1);
+        h->rttvar_us = us / 2;
+    } else {
+        h->rttvar_us = (3 * h->rttvar_us + abs(h->srtt_us - us)) / 4;
+        h->srtt_us = max((7 * h->srtt_us + us) / 8, 1);
+    }
+}
+
+/**
+ * Time to allow for the first attempt at a synchronous transfer (ms)
+ */
+static unsigned int link_timeout(struct imx_device *h)
+{
+    if (!h->srtt_us)
+        return TIMEOUT;
+    return min(MIN_TIMEOUT + (h->srtt_us + 4 * h->rttvar_us) / 1000,
+            TIMEOUT);
+}
+
+/**
+ * Make a single attempt at sending a report. Only command reports may be
+ * retried (see send_report), since the device may have acted on a data
+ * report which appeared to fail
+ */
+static int dev_set_report(struct imx_device *h, void *report, int len)
+{
+    int64_t start = now_us();
+    int e;
+
+    if (h->link_error)
+        return h->link_error;
+    e = h->ops->set_report(h->priv, report, len, link_timeout(h));
+    if (e >= 0)
+        link_sample(h, now_us() - start);
+    else if (e == LIBUSB_ERROR_NO_DEVICE)
+        link_result(h, e);
+    return e;
+}
+
+/**
+ * Wait for a report from the device, giving it longer each time it is late
+ * (up to TIMEOUT in total), before deciding it has stopped answering
+ */
+static int dev_read_report(struct imx_device *h, uint8_t *report, int len,
+        int *actual)
+{
+    int64_t start = now_us();
+    unsigned int timeout = link_timeout(h);
+    int attempt, e;
+
+    if (h->link_error)
+        return h->link_error;
+    for (attempt = 0; attempt < MAX_ATTEMPTS; attempt++) {
+        int elapsed;
+
+        e = h->ops->read_report(h->priv, report, len, actual, timeout);
+        if (e >= 0) {
+            link_sample(h, now_us() - start);
+            return e;
+        }
+        elapsed = (now_us() - start) / 1000;
+        if (e != LIBUSB_ERROR_TIMEOUT || elapsed >= TIMEOUT)
+            break;
+        timeout = min(timeout * 2, TIMEOUT - elapsed);
+    }
+    return link_result(h, e);
+}
+
+static struct imx_transfer *alloc_transfer(struct imx_device *h)
+{
+    struct imx_transfer *xfer = calloc(1, sizeof(*xfer));
+
+    if (xfer)
+        xfer->dev = h;
+    return xfer;
+}
+
+static void free_transfer(struct imx_transfer *xfer)
+{
+    if (!xfer)
+        return;
+    if (xfer->priv)
+        xfer->dev->ops->release(xfer->dev->priv, xfer);
+    free(xfer);
+}
+
+static void fill_transfer(struct imx_transfer *xfer, int type, uint8_t *buffer,
+        int length, imx_transfer_cb callback, void *user_data)
+{
+    xfer->type = type;
+    xfer->endpoint = type == IMX_TRANSFER_WRITE ? xfer->dev->ep_out : 0;
+    xfer->buffer = buffer;
+    xfer->length = length;
+    xfer->actual_length = 0;
+    xfer->status = 0;
+    xfer->callback = callback;
+    xfer->user_data = user_data;
+}
+
+static int submit_transfer(struct imx_transfer *xfer)
+{
+    return xfer->dev->ops->submit(xfer->dev->priv, xfer);
+}
+
+/**
+ * Get the result of a completed transfer
+ */
+static int transfer_status(struct imx_transfer *xfer)
+{
+    return link_result(xfer->dev, xfer->status);
+}
+
+static int cancel_transfer(struct imx_transfer *xfer)
+{
+    return xfer->dev->ops->cancel(xfer->dev->priv, xfer);
+}
+
+static int handle_events(struct imx_device *h)
+{
+    int e = h->ops->handle_events(h->priv);
+    if (e < 0 && e != LIBUSB_ERROR_INTERRUPTED)
+        return usb_error(e, "handle_events");
+    return 0;
+}
+
+/*
+ * libusb transport
+ */
+struct usb_transport {
+    libusb_context *ctx;
+    libusb_device_handle *h;
+    int hotplug;        /* A removal callback is registered */
+    libusb_hotplug_callback_handle removal;
+    int gone;           /* The device has been unplugged */
+};
+
+struct usb_transfer {
+    struct libusb_transfer *t;
+    uint8_t control[LIBUSB_CONTROL_SETUP_SIZE + 1025];
+};
+
+static int usb_set_report(void *priv, uint8_t *report, int len,
+        unsigned int timeout)
+{
+    struct usb_transport *u = priv;
+
+    if (u->gone)
+        return LIBUSB_ERROR_NO_DEVICE;
+    return libusb_control_transfer(u->h, CTRL_OUT, HID_SET_REPORT,
+            (HID_REPORT_TYPE_OUTPUT << 8) | report[0],
+            0, report, len, timeout);
+}
+
+static int usb_read_report(void *priv, uint8_t *report, int len, int *actual,
+        unsigned int timeout)
+{
+    struct usb_transport *u = priv;
+
+    if (u->gone)
+        return LIBUSB_ERROR_NO_DEVICE;
+    return libusb_interrupt_transfer(u->h, EP_IN, report, len, actual,
+            timeout);
+}
+
+static int transfer_error(struct libusb_transfer *xfer)
+{
+    switch (xfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        return 0;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        return LIBUSB_ERROR_TIMEOUT;
+    case LIBUSB_TRANSFER_STALL:
+        return LIBUSB_ERROR_PIPE;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        return LIBUSB_ERROR_NO_DEVICE;
+    case LIBUSB_TRANSFER_OVERFLOW:
+        return LIBUSB_ERROR_OVERFLOW;
+    case LIBUSB_TRANSFER_CANCELLED:
+        return LIBUSB_ERROR_INTERRUPTED;
+    default:
+        return LIBUSB_ERROR_IO;
+    }
+}
+
+static void LIBUSB_CALL usb_transfer_callback(struct libusb_transfer *t)
+{
+    struct imx_transfer *xfer = t->user_data;
+
+    xfer->status = transfer_error(t);
+    xfer->actual_length = t->actual_length;
+    xfer->callback(xfer);
+}
+
+static int usb_submit(void *priv, struct imx_transfer *xfer)
+{
+    struct usb_transport *u = priv;
+    struct usb_transfer *ut = xfer->priv;
+
+    if (u->gone)
+        return LIBUSB_ERROR_NO_DEVICE;
+    if (!ut) {
+        ut = calloc(1, sizeof(*ut));
+        if (!ut)
+            return LIBUSB_ERROR_NO_MEM;
+        ut->t = libusb_alloc_transfer(0);
+        if (!ut->t) {
+            free(ut);
+            return LIBUSB_ERROR_NO_MEM;
+        }
+        xfer->priv = ut;
+    }
+
+    switch (xfer->type) {
+    case IMX_TRANSFER_SET_REPORT:
+        /* Control transfers need the setup packet ahead of the data */
+        if (xfer->length > sizeof(ut->control) - LIBUSB_CONTROL_SETUP_SIZE)
+            return LIBUSB_ERROR_INVALID_PARAM;
+        memcpy(&ut->control[LIBUSB_CONTROL_SETUP_SIZE], xfer->buffer,
+                xfer->length);
+        libusb_fill_control_setup(ut->control, CTRL_OUT, HID_SET_REPORT,
+                (HID_REPORT_TYPE_OUTPUT << 8) | xfer->buffer[0], 0,
+                xfer->length);
+        libusb_fill_control_transfer(ut->t, u->h, ut->control,
+                usb_transfer_callback, xfer, TIMEOUT);
+        break;
+    case IMX_TRANSFER_READ:
+        libusb_fill_interrupt_transfer(ut->t, u->h, EP_IN, xfer->buffer,
+                xfer->length, usb_transfer_callback, xfer, TIMEOUT);
+        break;
+    case IMX_TRANSFER_WRITE:
+        libusb_fill_interrupt_transfer(ut->t, u->h, xfer->endpoint,
+                xfer->buffer, xfer->length, usb_transfer_callback, xfer,
+                TIMEOUT);
+        break;
+    default:
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+
+    return libusb_submit_transfer(ut->t);
+}
+
+static int usb_cancel(void *priv, struct imx_transfer *xfer)
+{
+    struct usb_transfer *ut = xfer->priv;
+
+    return libusb_cancel_transfer(ut->t);
+}
+
+static void usb_release(void *priv, struct imx_transfer *xfer)
+{
+    struct usb_transfer *ut = xfer->priv;
+
+    libusb_free_transfer(ut->t);
+    free(ut);
+    xfer->priv = NULL;
+}
+
+static int usb_handle_events(void *priv)
+{
+    struct usb_transport *u = priv;
+
+    return libusb_handle_events(u->ctx);
+}
+
+static int usb_pollfds(void *priv, struct pollfd *fds, int max)
+{
+    struct usb_transport *u = priv;
+    const struct libusb_pollfd **list;
+    int i;
+
+    list = libusb_get_pollfds(u->ctx);
+    if (!list)
+        return LIBUSB_ERROR_NOT_SUPPORTED;
+    for (i = 0; list[i] && i < max; i++) {
+        fds[i].fd = list[i]->fd;
+        fds[i].events = list[i]->events;
+        fds[i].revents = 0;
+    }
+    libusb_free_pollfds(list);
+    return i;
+}
+
+static int usb_next_timeout(void *priv)
+{
+    struct usb_transport *u = priv;
+    struct timeval tv;
+
+    if (libusb_get_next_timeout(u->ctx, &tv) != 1)
+        return -1;
+    return tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+}
+
+static int usb_poll_events(void *priv)
+{
+    struct usb_transport *u = priv;
+    struct timeval tv = {0, 0};
+
+    return libusb_handle_events_timeout_completed(u->ctx, &tv, NULL);
+}
+
+static void usb_close(void *priv)
+{
+    struct usb_transport *u = priv;
+
+    if (u->hotplug)
+        libusb_hotplug_deregister_callback(u->ctx, u->removal);
+    libusb_release_interface(u->h, 0);
+    libusb_close(u->h);
+    libusb_exit(u->ctx);
+    free(u);
+}
+
+static const struct imx_transport_ops usb_transport_ops = {
+    .name = "usb",
+    .set_report = usb_set_report,
+    .read_report = usb_read_report,
+    .submit = usb_submit,
+    .cancel = usb_cancel,
+    .release = usb_release,
+    .handle_events = usb_handle_events,
+    .pollfds = usb_pollfds,
+    .next_timeout = usb_next_timeout,
+    .poll_events = usb_poll_events,
+    .close = usb_close,
+};
+
+void imx_disconnect(struct imx_device *h)
+{
+    imx_write_barrier(h);
+    queue_free(h);
+    h->ops->close(h->priv);
+    free(h);
+}
+
+/**
+ * Describe where a device is plugged in, ie: "1-2.3"
+ */
+static void usb_location(libusb_device *dev, struct imx_device_id *id)
+{
+    int i;
+
+    id->bus = libusb_get_bus_number(dev);
+    id->address = libusb_get_device_address(dev);
+    id->nports = libusb_get_port_numbers(dev, id->ports, sizeof(id->ports));
+    if (id->nports < 0)
+        id->nports = 0;
+    snprintf(id->path, sizeof(id->path), "%d", id->bus);
+    for (i = 0; i < id->nports; i++)
+        snprintf(id->path + strlen(id->path), sizeof(id->path) - strlen(id->path),
+                "%c%d", i ? '.' : '-', id->ports[i]);
+}
+
+int imx_enumerate(struct imx_device_id **ids)
+{
+    libusb_context *ctx;
     libusb_device **devs = NULL;
-    libusb_device *dev = NULL;
-    libusb_device_handle *h = NULL;
+    struct imx_device_id *list = NULL;
+    int count, found = 0, i;
 
-    if (!_context)
-        if (libusb_init(&_context) < 0)
-            return NULL;
+    *ids = NULL;
+    if (libusb_init(&ctx) < 0)
+        return -EIO;
 
-    count = libusb_get_device_list(_context, &devs);
+    count = libusb_get_device_list(ctx, &devs);
     if (count < 0 || !devs) {
         usb_error(count, "get_device_list");
-        return NULL;
+        libusb_exit(ctx);
+        return -EIO;
     }
+
     for (i = 0; i < count; i++) {
+        struct libusb_device_descriptor desc;
+        const struct imx_soc *soc;
+        struct imx_device_id *id;
         int e;
+
+        e = libusb_get_device_descriptor(devs[i], &desc);
+        if (e < 0) {
+            usb_error(e, "get_device_descriptor");
+            continue;
+        }
+        soc = imx_find_soc(desc.idVendor, desc.idProduct);
+        if (!soc)
+            continue;
+
+        id = realloc(list, (found + 1) * sizeof(*list));
+        if (!id) {
+            found = -ENOMEM;
+            break;
+        }
+        list = id;
+        id = &list[found++];
+        memset(id, 0, sizeof(*id));
+        id->soc = soc;
+        usb_location(devs[i], id);
+    }
+
+    libusb_free_device_list(devs, 1);
+    libusb_exit(ctx);
+    if (found < 0) {
+        free(list);
+        return found;
+    }
+    *ids = list;
+    return found;
+}
+
+int imx_parse_location(const char *location, struct imx_device_id *id)
+{
+    const char *p = location;
+    char *end;
+    unsigned long v;
+
+    memset(id, 0, sizeof(*id));
+    v = strtoul(p, &end, 10);
+    if (end == p || v > 255)
+        goto invalid;
+    id->bus = v;
+
+    if (*end == ':') {
+        p = end + 1;
+        v = strtoul(p, &end, 10);
+        if (end == p || *end || v == 0 || v > 127)
+            goto invalid;
+        id->address = v;
+    } else if (*end == '-') {
+        do {
+            p = end + 1;
+            v = strtoul(p, &end, 10);
+            if (end == p || v == 0 || v > 255 ||
+                    id->nports == sizeof(id->ports))
+                goto invalid;
+            id->ports[id->nports++] = v;
+        } while (*end == '.');
+        if (*end)
+            goto invalid;
+    } else {
+        goto invalid;
+    }
+
+    snprintf(id->path, sizeof(id->path), "%s", location);
+    return 0;
+
+invalid:
+    fprintf(stderr, "Invalid device location '%s' (expected bus-port.port "
+            "or bus:address)\n", location);
+    return -EINVAL;
+}
+
+/**
+ * Note when the device a session is using is unplugged. libusb calls this
+ * while handling events for the session, ie: during any transfer
+ */
+static int LIBUSB_CALL usb_removed(libusb_context *ctx, libusb_device *dev,
+        libusb_hotplug_event event, void *user_data)
+{
+    struct usb_transport *u = user_data;
+
+    if (dev == libusb_get_device(u->h))
+        u->gone = 1;
+    return 0;
+}
+
+/**
+ * Check whether a device is the one described by id. Only the bus
+ * topology is compared, so no descriptors need to be read
+ */
+static int usb_matches(libusb_device *dev, const struct imx_device_id *id)
+{
+    uint8_t ports[7];
+    int nports;
+
+    if (libusb_get_bus_number(dev) != id->bus)
+        return 0;
+    if (id->address)
+        return libusb_get_device_address(dev) == id->address;
+
+    nports = libusb_get_port_numbers(dev, ports, sizeof(ports));
+    return nports == id->nports && memcmp(ports, id->ports, nports) == 0;
+}
+
+/**
+ * Open a device from a device list, as a session using ctx. The session
+ * takes over ctx if it is opened, otherwise the caller keeps it
+ * @param soc Boot ROM the device is running, or NULL to look it up
+ * @param where Description of the device, for error messages
+ */
+static struct imx_device *usb_open(libusb_context *ctx, libusb_device *dev,
+        const struct imx_soc *soc, const char *where)
+{
+    libusb_device_handle *uh = NULL;
+    struct usb_transport *u;
+    struct imx_device *h = NULL;
+    struct imx_device_id found;
+    int e;
+
+    /* Descriptions from imx_parse_location don't know what the device is */
+    if (!soc) {
         struct libusb_device_descriptor desc;
 
-        dev = devs[i];
-        e = libusb_get_device_descriptor(dev, &desc);
+        e = libusb_get_device_descriptor(dev, &desc);
+        if (e < 0) {
+            usb_error(e, "get_device_descriptor");
+            return NULL;
+        }
+        soc = imx_find_soc(desc.idVendor, desc.idProduct);
+        if (!soc) {
+            fprintf(stderr, "Device at %s (%4.4x:%4.4x) is not a supported "
+                    "i.MX boot ROM\n", where, desc.idVendor,
+                    desc.idProduct);
+            return NULL;
+        }
+    }
+    memset(&found, 0, sizeof(found));
+    found.soc = soc;
+    usb_location(dev, &found);
+
+    e = libusb_open(dev, &uh);
+    if (e < 0) {
+        usb_error(e, "libusb_open /dev/bus/usb/%.3d/%.3d",
+                found.bus, found.address);
+        return NULL;
+    }
+    if (libusb_kernel_driver_active(uh, 0))
+        libusb_detach_kernel_driver(uh, 0);
+
+    e = libusb_claim_interface(uh, 0);
+    if (e < 0) {
+        usb_error(e, "claim_interface");
+        libusb_close(uh);
+        return NULL;
+    }
+
+    u = calloc(1, sizeof(*u));
+    if (u) {
+        u->ctx = ctx;
+        u->h = uh;
+        if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+            u->hotplug = libusb_hotplug_register_callback(ctx,
+                    LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, 0, found.soc->vid,
+                    found.soc->pid, LIBUSB_HOTPLUG_MATCH_ANY, usb_removed, u,
+                    &u->removal) == LIBUSB_SUCCESS;
+        h = imx_device_create(&usb_transport_ops, u, found.soc,
+                find_ep_out(dev));
+    }
+    if (!h) {
+        if (u && u->hotplug)
+            libusb_hotplug_deregister_callback(ctx, u->removal);
+        free(u);
+        libusb_release_interface(uh, 0);
+        libusb_close(uh);
+        return NULL;
+    }
+    imx_set_name(h, found.path);
+    return h;
+}
+
+struct imx_device *imx_open(const struct imx_device_id *id)
+{
+    int count, i;
+    libusb_context *ctx;
+    libusb_device **devs = NULL;
+    libusb_device *dev = NULL;
+    struct imx_device *h = NULL;
+
+    /* Each session has its own context, so that events for one device are
+     * only ever handled by the thread driving it */
+    if (libusb_init(&ctx) < 0)
+        return NULL;
+
+    count = libusb_get_device_list(ctx, &devs);
+    if (count < 0 || !devs) {
+        usb_error(count, "get_device_list");
+        libusb_exit(ctx);
+        return NULL;
+    }
+    for (i = 0; i < count; i++)
+        if (usb_matches(devs[i], id)) {
+            dev = devs[i];
+            break;
+        }
+
+    if (dev)
+        h = usb_open(ctx, dev, id->soc, id->path);
+    else
+        fprintf(stderr, "No device at %s\n", id->path);
+
+    libusb_free_device_list(devs, 1);
+    if (!h)
+        libusb_exit(ctx);
+    return h;
+}
+
+struct imx_device *imx_connect(void)
+{
+    int count, i;
+    libusb_context *ctx;
+    libusb_device **devs = NULL;
+    struct imx_device *h = NULL;
+
+    /* Open the first device found, in the same walk of the bus, rather
+     * than enumerating everything and then looking for it again */
+    if (libusb_init(&ctx) < 0)
+        return NULL;
+
+    count = libusb_get_device_list(ctx, &devs);
+    if (count < 0 || !devs) {
+        usb_error(count, "get_device_list");
+        libusb_exit(ctx);
+        return NULL;
+    }
+    for (i = 0; i < count && !h; i++) {
+        struct libusb_device_descriptor desc;
+        const struct imx_soc *soc;
+        char where[32];
+
+        if (libusb_get_device_descriptor(devs[i], &desc) < 0)
+            continue;
+        soc = imx_find_soc(desc.idVendor, desc.idProduct);
+        if (!soc)
+            continue;
+        snprintf(where, sizeof(where), "%d:%d",
+                libusb_get_bus_number(devs[i]),
+                libusb_get_device_address(devs[i]));
+        h = usb_open(ctx, devs[i], soc, where);
+    }
+
+    libusb_free_device_list(devs, 1);
+    if (!h)
+        libusb_exit(ctx);
+    return h;
+}
+
+/*
+ * Hotplug monitoring
+ * Where libusb supports hotplug, arrivals are reported by its callback as
+ * soon as the device enumerates. Elsewhere the bus is polled.
+ */
+#define MONITOR_MAX_PENDING 16
+#define MONITOR_POLL_MS 20
+
+struct imx_monitor {
+    libusb_context *ctx;
+    int hotplug;
+    libusb_hotplug_callback_handle handle;
+    /* Arrivals not yet collected by imx_monitor_wait */
+    struct imx_device_id pending[MONITOR_MAX_PENDING];
+    int npending;
+    /* Polling: devices present at the last poll */
+    struct imx_device_id *present;
+    int npresent;
+};
+
+static void monitor_add(struct imx_monitor *m, const struct imx_device_id *id)
+{
+    if (m->npending == MONITOR_MAX_PENDING) {
+        fprintf(stderr, "Too many devices arriving at once, ignoring %s\n",
+                id->path);
+        return;
+    }
+    m->pending[m->npending++] = *id;
+}
+
+static int LIBUSB_CALL monitor_hotplug(libusb_context *ctx,
+        libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+    struct imx_monitor *m = user_data;
+    struct libusb_device_descriptor desc;
+    struct imx_device_id id = {0};
+
+    if (event != LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+        return 0;
+    if (libusb_get_device_descriptor(dev, &desc) < 0)
+        return 0;
+    id.soc = imx_find_soc(desc.idVendor, desc.idProduct);
+    if (!id.soc)
+        return 0;
+    usb_location(dev, &id);
+    monitor_add(m, &id);
+    return 0;
+}
+
+static int monitor_poll(struct imx_monitor *m)
+{
+    struct imx_device_id *ids;
+    int count, i, j;
+
+    count = imx_enumerate(&ids);
+    if (count < 0)
+        return count;
+
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < m->npresent; j++)
+            if (strcmp(ids[i].path, m->present[j].path) == 0 &&
+                    ids[i].address == m->present[j].address)
+                break;
+        if (j == m->npresent)
+            monitor_add(m, &ids[i]);
+    }
+
+    free(m->present);
+    m->present = ids;
+    m->npresent = count;
+    return 0;
+}
+
+struct imx_monitor *imx_monitor_start(void)
+{
+    struct imx_monitor *m = calloc(1, sizeof(*m));
+    int e;
+
+    if (!m)
+        return NULL;
+
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        /* The first poll picks up the devices already attached */
+        if (monitor_poll(m) < 0) {
+            free(m);
+            return NULL;
+        }
+        return m;
+    }
+
+    if (libusb_init(&m->ctx) < 0) {
+        free(m);
+        return NULL;
+    }
+    /* Every arrival is checked against the SoC table in the callback */
+    e = libusb_hotplug_register_callback(m->ctx,
+            LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_ENUMERATE,
+            LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+            LIBUSB_HOTPLUG_MATCH_ANY, monitor_hotplug, m, &m->handle);
+    if (e < 0) {
+        usb_error(e, "hotplug_register_callback");
+        libusb_exit(m->ctx);
+        free(m);
+        return NULL;
+    }
+    m->hotplug = 1;
+    return m;
+}
+
+int imx_monitor_wait(struct imx_monitor *m, struct imx_device_id *id,
+        int timeout_ms)
+{
+    struct timespec start, now;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (!m->npending) {
+        int elapsed, e;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - start.tv_sec) * 1000 +
+            (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (timeout_ms >= 0 && elapsed >= timeout_ms)
+            return 0;
+
+        if (m->hotplug) {
+            int wait = timeout_ms < 0 ? 1000 : timeout_ms - elapsed;
+            struct timeval tv = {wait / 1000, (wait % 1000) * 1000};
+
+            e = libusb_handle_events_timeout_completed(m->ctx, &tv, NULL);
+            if (e < 0 && e != LIBUSB_ERROR_INTERRUPTED)
+                return usb_error(e, "handle_events");
+        } else {
+            usleep(MONITOR_POLL_MS * 1000);
+            e = monitor_poll(m);
+            if (e < 0)
+                return e;
+        }
+    }
+
+    *id = m->pending[0];
+    m->npending--;
+    memmove(&m->pending[0], &m->pending[1], m->npending * sizeof(*id));
+    return 1;
+}
+
+void imx_monitor_stop(struct imx_monitor *m)
+{
+    if (m->hotplug) {
+        libusb_hotplug_deregister_callback(m->ctx, m->handle);
+        libusb_exit(m->ctx);
+    }
+    free(m->present);
+    free(m);
+}
+
+static int hab_type(const uint8_t *hab, int len)
+{
+    if (len < 4) {
+        printf("Invalid hab len: %d\n", len);
+        return -1;
+    }
+    if (hab[0] == 0x56 && hab[3] == 0x56 && hab[1] == 0x78 && hab[2] == 0x78)
+        return HAB_ENGINEERING;
+    if (hab[0] == 0x12 && hab[3] == 0x12 && hab[1] == 0x34 && hab[2] == 0x34)
+        return HAB_PRODUCTION;
+    return -1;
+}
+
+/**
+ * Send a command report, retrying with increasing delays if it fails
+ * (unless the device has gone)
+ * @param report Report to send, beginning with the report ID
+ */
+static int send_report(struct imx_device *h, void *report, int len)
+{
+    int i, e;
+    uint8_t report_id = *(uint8_t *)report;
+
+    for (i = 0; i < MAX_ATTEMPTS; i++) {
+        if (i)
+            usleep(1000 << i);
+        e = dev_set_report(h, report, len);
+        if (e >= 0 || h->link_error)
+            break;
+    }
+    if (e >= 0)
+        return e;
+
+    /* Still not accepting commands, so give up on it */
+    link_result(h, e);
+    return usb_error(e, "sdp set_report 0x%x", report_id);
+}
+
+static int imx_send_sdp(struct imx_device *h, struct sdp_command *cmd)
+{
+    return send_report(h, cmd, sizeof(*cmd));
+}
+
+static int imx_read_hab(struct imx_device *h)
+{
+    uint8_t hab[65] = {0};
+    int len, e;
+
+    e = dev_read_report(h, hab, sizeof(hab), &len);
+    if (e < 0)
+        return usb_error(e, "read_report HAB");
+
+    return imx_check_hab(hab, len);
+}
+
+int imx_check_hab(const uint8_t *hab, int len)
+{
+    if (len < 1 || hab[0] != 3) {
+        fprintf(stderr, "Invalid HAB report ID: 0x%x\n", hab[0]);
+        return -EINVAL;
+    }
+    if (hab_type(&hab[1], len - 1) < 0)
+        return -EINVAL;
+    return 0;
+}
+
+/**
+ * Check the status report which completes a write command
+ * @param expected Status word the ROM reports on success
+ */
+int imx_check_status(const uint8_t *status, int len, uint32_t expected)
+{
+    if (len != 65) {
+        fprintf(stderr, "Insufficient write response data: %d\n", len);
+        return -EINVAL;
+    }
+    if (status[0] != 4) {
+        fprintf(stderr, "Incorrect report type: 0x%x\n", status[0]);
+        return -EINVAL;
+    }
+    if (status[1] != ((expected >> 24) & 0xff) ||
+        status[2] != ((expected >> 16) & 0xff) ||
+        status[3] != ((expected >> 8) & 0xff) ||
+        status[4] != (expected & 0xff)) {
+        fprintf(stderr, "Invalid write response\n");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int imx_write_reg(struct imx_device *h, uint32_t addr,
+		uint32_t data, int count, int format)
+{
+    int e;
+    struct sdp_command cmd = {0};
+    uint8_t buffer[65];
+    int len;
+
+    //printf("Writing 0x%8.8x to 0x%8.8x\n", data, addr);
+
+    e = imx_require(h, IMX_CAP_REGISTERS, "register writes");
+    if (e < 0)
+        return e;
+    e = imx_write_barrier(h);
+    if (e < 0)
+        return e;
+
+    cmd.report_id = 1;
+    cmd.command_type = SDP_WRITE_REGISTER;
+    cmd.address = htonl(addr);
+    cmd.format = format;
+    cmd.data_count = htonl(count);
+    cmd.data = htonl(data);
+
+    //dump("write_cmd", &cmd, sizeof(cmd));
+    e = imx_send_sdp(h, &cmd);
+    if (e < 0)
+        return e;
+
+    /* Read the HAB data */
+    e = imx_read_hab(h);
+    if (e < 0)
+        return e;
+
+    /* Read the response data */
+    memset(buffer, 0, sizeof(buffer));
+    buffer[0] = 4;
+    len = 0;
+    e = dev_read_report(h, buffer, sizeof(buffer), &len);
+    if (e < 0)
+        return usb_error(e, "read_report");
+
+    //dump("write_response", buffer, len);
+    return imx_check_status(buffer, len, STATUS_WRITE_COMPLETE);
+}
+
+int imx_write_reg32(struct imx_device *h, uint32_t addr, uint32_t data)
+{
+    if (h->queued_writes)
+        return imx_queue_write_reg(h, addr, data, 0x20);
+    return imx_write_reg(h, addr, data, 1, 0x20);
+}
+
+int imx_write_reg16(struct imx_device *h, uint32_t addr, uint16_t data)
+{
+    if (h->queued_writes)
+        return imx_queue_write_reg(h, addr, data, 0x10);
+    return imx_write_reg(h, addr, data, 1, 0x10);
+}
+
+int imx_write_reg8(struct imx_device *h, uint32_t addr, uint8_t data)
+{
+    if (h->queued_writes)
+        return imx_queue_write_reg(h, addr, data, 0x8);
+    return imx_write_reg(h, addr, data, 1, 0x8);
+}
+
+/*
+ * DCD v2 tables
+ * Entries are kept in decoded form, and only encoded when sent, so that a
+ * table of any length can be split up into packets the ROM will accept.
+ * Consecutive writes of the same width & type share a single write command.
+ */
+void imx_set_dcd_address(struct imx_device *h, uint32_t addr)
+{
+    h->dcd_addr = addr;
+    h->dcd_area_used = 0;
+    h->dcd_area_noted = 0;
+}
+
+uint32_t imx_get_dcd_address(struct imx_device *h)
+{
+    return h->dcd_addr;
+}
+
+void imx_dcd_init(struct imx_dcd *dcd)
+{
+    memset(dcd, 0, sizeof(*dcd));
+}
+
+void imx_dcd_free(struct imx_dcd *dcd)
+{
+    free(dcd->entries);
+    free(dcd->buffer);
+    imx_dcd_init(dcd);
+}
+
+void imx_dcd_reset(struct imx_dcd *dcd)
+{
+    dcd->count = 0;
+}
+
+static int dcd_width(int width)
+{
+    if (width != 32 && width != 16 && width != 8) {
+        fprintf(stderr, "Invalid DCD width: %d\n", width);
+        return -EINVAL;
+    }
+    return width / 8;
+}
+
+static int dcd_add(struct imx_dcd *dcd, uint8_t tag, uint8_t param,
+        uint32_t addr, uint32_t value, uint32_t count)
+{
+    struct imx_dcd_entry *entry;
+
+    if (dcd->count == dcd->size) {
+        int size = dcd->size ? dcd->size * 2 : 64;
+        entry = realloc(dcd->entries, size * sizeof(*entry));
+        if (!entry)
+            return -ENOMEM;
+        dcd->entries = entry;
+        dcd->size = size;
+    }
+
+    entry = &dcd->entries[dcd->count++];
+    entry->tag = tag;
+    entry->param = param;
+    entry->addr = addr;
+    entry->value = value;
+    entry->count = count;
+    return 0;
+}
+
+int imx_dcd_write_data(struct imx_dcd *dcd, int width, int op, uint32_t addr,
+        uint32_t value)
+{
+    int bytes = dcd_width(width);
+    if (bytes < 0)
+        return bytes;
+    return dcd_add(dcd, DCD_TAG_WRITE, (op << 3) | bytes, addr, value, 0);
+}
+
+int imx_dcd_check_data(struct imx_dcd *dcd, int width, int cond, uint32_t addr,
+        uint32_t mask, uint32_t count)
+{
+    int bytes = dcd_width(width);
+    if (bytes < 0)
+        return bytes;
+    return dcd_add(dcd, DCD_TAG_CHECK, (cond << 3) | bytes, addr, mask, count);
+}
+
+int imx_dcd_nop(struct imx_dcd *dcd)
+{
+    return dcd_add(dcd, DCD_TAG_NOP, 0, 0, 0, 0);
+}
+
+static uint8_t *put_be16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+    return p + 2;
+}
+
+static uint8_t *put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return p + 4;
+}
+
+int imx_dcd_encode(const struct imx_dcd *dcd, int *pos, uint8_t *buffer)
+{
+    uint8_t *p = buffer + 4;
+    uint8_t *end = buffer + DCD_MAX_BYTES;
+    uint8_t *cmd = NULL;    /* Start of the current write command */
+    int i;
+
+    for (i = *pos; i < dcd->count; i++) {
+        const struct imx_dcd_entry *entry = &dcd->entries[i];
+
+        if (entry->tag == DCD_TAG_WRITE) {
+            /* Extend the previous write command if we can */
+            if (!cmd || cmd[3] != entry->param) {
+                if (p + 12 > end)
+                    break;
+                cmd = p;
+                *p++ = DCD_TAG_WRITE;
+                p = put_be16(p, 4);
+                *p++ = entry->param;
+            } else if (p + 8 > end)
+                break;
+            p = put_be32(put_be32(p, entry->addr), entry->value);
+            put_be16(cmd + 1, p - cmd);
+            continue;
+        }
+
+        cmd = NULL;
+        if (entry->tag == DCD_TAG_CHECK) {
+            int len = entry->count ? 16 : 12;
+            if (p + len > end)
+                break;
+            *p++ = DCD_TAG_CHECK;
+            p = put_be16(p, len);
+            *p++ = entry->param;
+            p = put_be32(put_be32(p, entry->addr), entry->value);
+            if (entry->count)
+                p = put_be32(p, entry->count);
+        } else {
+            if (p + 4 > end)
+                break;
+            *p++ = entry->tag;
+            p = put_be16(p, 4);
+            *p++ = 0;
+        }
+    }
+
+    *pos = i;
+    buffer[0] = DCD_TAG_HEADER;
+    put_be16(buffer + 1, p - buffer);
+    buffer[3] = DCD_VERSION;
+    return p - buffer;
+}
+
+static int imx_dcd_write_packet(struct imx_device *h, uint8_t *table,
+        int length)
+{
+    int e;
+    struct sdp_command cmd = {0};
+    uint8_t report[1025];
+    int len, pos;
+
+    cmd.report_id = 1;
+    cmd.command_type = SDP_DCD_WRITE;
+    cmd.address = htonl(h->dcd_addr);
+    cmd.data_count = htonl(length);
+
+    //dump("write_cmd", &cmd, sizeof(cmd));
+    e = imx_send_sdp(h, &cmd);
+    if (e < 0)
+        return e;
+
+    /* Write the DCD data */
+    for (pos = 0; pos < length; pos += 1024) {
+        int this_len = min(1024, length - pos);
+
+        report[0] = 2;
+        memcpy(&report[1], table + pos, this_len);
+        //dump("dcd_data", report, this_len + 1);
+        e = dev_set_report(h, report, this_len + 1);
+        if (e < 0)
+            return usb_error(e, "set_report dcd");
+    }
+
+    /* Read the HAB data */
+    e = imx_read_hab(h);
+    if (e < 0)
+        return e;
+
+    /* Read the response data */
+    memset(report, 0, sizeof(report));
+    report[0] = 4;
+    len = 0;
+    e = dev_read_report(h, report, sizeof(report), &len);
+    if (e < 0)
+        return usb_error(e, "read_report");
+
+    //dump("dcd_write_response", report, len);
+    return imx_check_status(report, len, STATUS_WRITE_COMPLETE);
+}
+
+/**
+ * Note where an upload is going, so that register writes aren't batched
+ * into DCD tables which would overwrite it
+ */
+static void dcd_area_check(struct imx_device *h, uint32_t addr, int length)
+{
+    if (h->dcd_addr < (uint64_t)addr + length &&
+            addr < (uint64_t)h->dcd_addr + DCD_MAX_BYTES)
+        h->dcd_area_used = 1;
+}
+
+int imx_dcd_send(struct imx_device *h, struct imx_dcd *dcd)
+{
+    int pos = 0, packets = 0;
+    int e;
+
+    e = imx_require(h, IMX_CAP_DCD_WRITE, "DCD writes");
+    if (e < 0)
+        return e;
+    e = imx_write_barrier(h);
+    if (e < 0)
+        return e;
+
+    if (h->dcd_area_used && dcd->count) {
+        fprintf(stderr, "Warning: DCD staged at 0x%8.8x overwrites uploaded data\n",
+                h->dcd_addr);
+        h->dcd_area_used = 0;
+    }
+
+    if (!dcd->buffer) {
+        dcd->buffer = malloc(DCD_MAX_BYTES);
+        if (!dcd->buffer)
+            return -ENOMEM;
+    }
+
+    while (pos < dcd->count) {
+        int start = pos;
+        int length = imx_dcd_encode(dcd, &pos, dcd->buffer);
+
+        e = imx_dcd_write_packet(h, dcd->buffer, length);
+        if (e < 0) {
+            fprintf(stderr, "DCD write of entries %d-%d failed\n",
+                    start, pos - 1);
+            return e;
+        }
+        packets++;
+    }
+
+    return packets;
+}
+
+int imx_dcd_write(struct imx_device *h, const uint32_t *data, int count)
+{
+    struct imx_dcd dcd;
+    int e = 0, i;
+
+    imx_dcd_init(&dcd);
+    for (i = 0; i < count && e >= 0; i++)
+        e = imx_dcd_write_data(&dcd, data[i * 3], IMX_DCD_WRITE,
+                data[i * 3 + 1], data[i * 3 + 2]);
+    if (e >= 0)
+        e = imx_dcd_send(h, &dcd);
+    imx_dcd_free(&dcd);
+
+    return e;
+}
+
+void imx_batch_init(struct imx_write_batch *batch)
+{
+    memset(batch, 0, sizeof(*batch));
+    imx_dcd_init(&batch->dcd);
+}
+
+void imx_batch_free(struct imx_write_batch *batch)
+{
+    imx_dcd_free(&batch->dcd);
+}
+
+static int read_width(struct imx_device *h, int width, uint32_t addr,
+        uint32_t *value)
+{
+    uint16_t v16;
+    uint8_t v8;
+    int e;
+
+    if (width == 32)
+        return imx_read_reg32(h, addr, value);
+    if (width == 16) {
+        e = imx_read_reg16(h, addr, &v16);
+        *value = v16;
+        return e;
+    }
+    e = imx_read_reg8(h, addr, &v8);
+    *value = v8;
+    return e;
+}
+
+static int write_width(struct imx_device *h, int width, uint32_t addr,
+        uint32_t value)
+{
+    if (width == 32)
+        return imx_write_reg32(h, addr, value);
+    if (width == 16)
+        return imx_write_reg16(h, addr, value);
+    return imx_write_reg8(h, addr, value);
+}
+
+static int check_met(int cond, uint32_t value, uint32_t mask)
+{
+    switch (cond) {
+    case IMX_DCD_ALL_CLEAR:
+        return (value & mask) == 0;
+    case IMX_DCD_ANY_CLEAR:
+        return (value & mask) != mask;
+    case IMX_DCD_ALL_SET:
+        return (value & mask) == mask;
+    default:
+        return (value & mask) != 0;
+    }
+}
+
+/**
+ * Carry out a DCD table with individual register accesses, rather than
+ * staging it on the device
+ * @return < 0 on failure, otherwise the number of transactions used
+ */
+static int dcd_run_direct(struct imx_device *h, const struct imx_dcd *dcd)
+{
+    int i, e = 0, transactions = 0;
+
+    for (i = 0; i < dcd->count && e >= 0; i++) {
+        const struct imx_dcd_entry *entry = &dcd->entries[i];
+        int width = (entry->param & 7) * 8;
+        int op = entry->param >> 3;
+        uint32_t value, polls;
+
+        if (entry->tag == DCD_TAG_WRITE) {
+            value = entry->value;
+            if (op != IMX_DCD_WRITE) {
+                e = read_width(h, width, entry->addr, &value);
+                if (e < 0)
+                    break;
+                transactions++;
+                if (op == IMX_DCD_SET_BITS)
+                    value |= entry->value;
+                else
+                    value &= ~entry->value;
+            }
+            e = write_width(h, width, entry->addr, value);
+            transactions++;
+        } else if (entry->tag == DCD_TAG_CHECK) {
+            for (polls = 0; !entry->count || polls < entry->count; polls++) {
+                e = read_width(h, width, entry->addr, &value);
+                transactions++;
+                if (e < 0 || check_met(op, value, entry->value))
+                    break;
+            }
+            if (e >= 0 && entry->count && polls == entry->count) {
+                fprintf(stderr, "Check of 0x%8.8x & 0x%8.8x timed out\n",
+                        entry->addr, entry->value);
+                e = -ETIMEDOUT;
+            }
+        }
+    }
+    if (e < 0)
+        return e;
+    return transactions;
+}
+
+int imx_batch_flush(struct imx_device *h, struct imx_write_batch *batch)
+{
+    int e, count = batch->dcd.count;
+    int staged = !h->dcd_area_used;
+
+    if (!count)
+        return 0;
+
+    /* Staging the batch would overwrite an upload, so then it goes as
+     * individual writes. The batch is spent whether or not it succeeds */
+    if (!staged && !h->dcd_area_noted) {
+        fprintf(stderr, "%s: an upload covers the DCD staging area at "
+                "0x%8.8x, so batched writes will be sent one at a time. Use "
+                "dcd_addr to move it to free memory\n", h->name, h->dcd_addr);
+        h->dcd_area_noted = 1;
+    }
+    if (staged)
+        e = imx_dcd_send(h, &batch->dcd);
+    else
+        e = dcd_run_direct(h, &batch->dcd);
+    imx_dcd_reset(&batch->dcd);
+    if (e < 0) {
+        fprintf(stderr, "Failed to write batch of %d registers\n", count);
+        return e;
+    }
+    if (staged)
+        batch->staged += e;
+    batch->transactions += e;
+    return 0;
+}
+
+int imx_batch_write(struct imx_device *h, struct imx_write_batch *batch,
+        int width, uint32_t addr, uint32_t data)
+{
+    int e;
+
+    if (batch->dcd.count == IMX_DCD_MAX_WRITES) {
+        e = imx_batch_flush(h, batch);
+        if (e < 0)
+            return e;
+    }
+
+    e = imx_dcd_write_data(&batch->dcd, width, IMX_DCD_WRITE, addr, data);
+    if (e < 0)
+        return e;
+    batch->writes++;
+
+    return 0;
+}
+
+int imx_batch_check(struct imx_device *h, struct imx_write_batch *batch,
+        int width, int cond, uint32_t addr, uint32_t mask, uint32_t count)
+{
+    if (batch->dcd.count == IMX_DCD_MAX_WRITES) {
+        int e = imx_batch_flush(h, batch);
+        if (e < 0)
+            return e;
+    }
+
+    return imx_dcd_check_data(&batch->dcd, width, cond, addr, mask, count);
+}
+
+static int imx_write_bulk_block(struct imx_device *h, uint32_t addr,
+		uint8_t *data, int length)
+{
+    int e;
+    struct sdp_command cmd = {0};
+    int len;
+    uint8_t write_data[1025];
+
+    if (length > 1024)
+        return -EINVAL;
+
+    cmd.report_id = 1;
+    cmd.command_type = SDP_WRITE_FILE;
+    cmd.address = htonl(addr);
+    cmd.data_count = htonl(length);
+
+    //dump("write_cmd", &cmd, sizeof(cmd));
+    e = imx_send_sdp(h, &cmd);
+    if (e < 0)
+        return e;
+
+    write_data[0] = 2;
+    memcpy(&write_data[1], data, length);
+    e = dev_set_report(h, write_data, length + 1);
+    if (e < 0)
+        return usb_error(e, "set_report write_file");
+
+    /* Read the HAB data */
+    e = imx_read_hab(h);
+    if (e < 0)
+        return e;
+
+    /* Read the response data */
+    e = dev_read_report(h, write_data, sizeof(write_data), &len);
+    if (e < 0)
+        return usb_error(e, "read_report");
+
+    //dump("dcd_write_response", write_data, len);
+    return imx_check_status(write_data, len, STATUS_FILE_COMPLETE);
+}
+
+static int imx_write_bulk_sync(struct imx_device *h, uint32_t addr,
+        uint8_t *data, int length)
+{
+    int i;
+
+    for (i = 0; i < length; i+= 1024) {
+        int this_len = min(1024, length - i);
+        int e;
+        e = imx_write_bulk_block(h, addr, data, this_len);
+        if (e < 0) {
+            fprintf(stderr, "Write failed at 0x%8.8x\n", addr);
+            return e;
+        }
+        addr += this_len;
+        data += this_len;
+        h->write_acked += this_len;
+    }
+
+    return 0;
+}
+
+/*
+ * Asynchronous bulk writer
+ * Each 1KiB block needs a command SET_REPORT, a data SET_REPORT, and two
+ * interrupt reads (HAB & status). Rather than waiting on each of these in
+ * turn, we keep several blocks in flight, with their interrupt reads queued
+ * ahead of time. libusb completes transfers on a given endpoint in
+ * submission order, so the responses line up with the blocks.
+ */
+#define ASYNC_DEPTH 4
+
+enum {
+    XFER_CMD,
+    XFER_DATA,
+    XFER_HAB,
+    XFER_STATUS,
+    XFER_COUNT,
+};
+
+struct async_block {
+    struct imx_transfer *xfer[XFER_COUNT];
+    int active[XFER_COUNT];
+    struct sdp_command cmd;
+    uint8_t data[1025];
+    uint8_t hab[65];
+    uint8_t status[65];
+    uint32_t addr;
+    uint32_t expected;  /* Status reported on success */
+    int pending;
+    int error;
+    /* Register writes only */
+    uint32_t value;
+    int format;
+    char origin[64];
+};
+
+void imx_set_write_mode(struct imx_device *h, int mode)
+{
+    h->write_mode = mode;
+}
+
+int imx_get_write_mode(struct imx_device *h)
+{
+    return h->write_mode;
+}
+
+void imx_set_write_window(struct imx_device *h, int bytes)
+{
+    h->write_window = max(1024, (bytes + 1023) & ~1023);
+}
+
+int imx_get_write_window(struct imx_device *h)
+{
+    return h->write_window;
+}
+
+static void async_block_callback(struct imx_transfer *xfer)
+{
+    struct async_block *b = xfer->user_data;
+    int e, i;
+
+    for (i = 0; i < XFER_COUNT; i++)
+        if (b->xfer[i] == xfer)
+            b->active[i] = 0;
+    b->pending--;
+
+    if (b->error < 0)
+        return;
+
+    e = transfer_status(xfer);
+    if (e < 0) {
+        b->error = usb_error(e, "async transfer");
+        return;
+    }
+
+    if (xfer == b->xfer[XFER_HAB])
+        b->error = imx_check_hab(b->hab, xfer->actual_length);
+    else if (xfer == b->xfer[XFER_STATUS])
+        b->error = imx_check_status(b->status, xfer->actual_length, b->expected);
+}
+
+/**
+ * Queue the response reads for a block, followed by its command (and
+ * optionally data) reports
+ */
+static int async_block_start(struct imx_device *h, struct async_block *b,
+        int has_data)
+{
+    int i, e;
+
+    fill_transfer(b->xfer[XFER_HAB], IMX_TRANSFER_READ, b->hab,
+            sizeof(b->hab), async_block_callback, b);
+    fill_transfer(b->xfer[XFER_STATUS], IMX_TRANSFER_READ, b->status,
+            sizeof(b->status), async_block_callback, b);
+
+    /* Queue the responses first, so they're waiting when the data lands */
+    for (i = XFER_HAB; i < XFER_HAB + XFER_COUNT; i++) {
+        int x = i % XFER_COUNT;
+        if (x == XFER_DATA && !has_data)
+            continue;
+        e = submit_transfer(b->xfer[x]);
+        if (e < 0) {
+            b->error = usb_error(e, "submit_transfer");
+            return e;
+        }
+        b->active[x] = 1;
+        b->pending++;
+    }
+
+    return 0;
+}
+
+static int async_block_submit(struct imx_device *h, struct async_block *b,
+        uint32_t addr, uint8_t *data, int length)
+{
+    struct sdp_command *cmd;
+
+    b->addr = addr;
+    b->expected = STATUS_FILE_COMPLETE;
+    b->error = 0;
+
+    cmd = &b->cmd;
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->report_id = 1;
+    cmd->command_type = SDP_WRITE_FILE;
+    cmd->address = htonl(addr);
+    cmd->data_count = htonl(length);
+    fill_transfer(b->xfer[XFER_CMD], IMX_TRANSFER_SET_REPORT, (uint8_t *)cmd,
+            sizeof(*cmd), async_block_callback, b);
+
+    b->data[0] = 2;
+    memcpy(&b->data[1], data, length);
+    fill_transfer(b->xfer[XFER_DATA], IMX_TRANSFER_SET_REPORT, b->data,
+            length + 1, async_block_callback, b);
+
+    return async_block_start(h, b, 1);
+}
+
+static void async_block_cancel(struct async_block *b)
+{
+    int i;
+
+    for (i = 0; i < XFER_COUNT; i++)
+        if (b->active[i])
+            cancel_transfer(b->xfer[i]);
+}
+
+static int async_block_wait(struct async_block *b)
+{
+    while (b->pending) {
+        int e = handle_events(b->xfer[XFER_CMD]->dev);
+        if (e < 0)
+            return e;
+    }
+    return b->error;
+}
+
+/*
+ * Queued register writes
+ * In queued mode imx_write_reg* only submit the write and return. The
+ * responses are checked, in order, when a later write needs the slot or at
+ * the next barrier. Anything which may depend on the writes having landed
+ * (reads, file & DCD writes, jumps) waits on a barrier first.
+ */
+#define WRITE_QUEUE_DEPTH 16
+
+static const char *(*write_origin)(void) = NULL;
+
+void imx_set_queued_writes(struct imx_device *h, int enable)
+{
+    h->queued_writes = enable;
+}
+
+int imx_get_queued_writes(struct imx_device *h)
+{
+    return h->queued_writes;
+}
+
+void imx_set_write_origin(const char *(*origin)(void))
+{
+    write_origin = origin;
+}
+
+static void queue_abort(struct imx_device *h)
+{
+    int i;
+
+    for (i = 0; i < h->queue_count; i++) {
+        struct async_block *b = &h->write_queue[(h->queue_head + i) %
+            WRITE_QUEUE_DEPTH];
+        if (b->error == 0)
+            b->error = -ECANCELED;
+        async_block_cancel(b);
+    }
+    for (i = 0; i < h->queue_count; i++)
+        async_block_wait(&h->write_queue[(h->queue_head + i) %
+                WRITE_QUEUE_DEPTH]);
+    h->queue_count = 0;
+}
+
+static int queue_retire(struct imx_device *h)
+{
+    struct async_block *b = &h->write_queue[h->queue_head];
+    int e = async_block_wait(b);
+
+    h->queue_head = (h->queue_head + 1) % WRITE_QUEUE_DEPTH;
+    h->queue_count--;
+    if (e < 0) {
+        fprintf(stderr, "Queued %d-bit write of 0x%8.8x to 0x%8.8x failed [%s]\n",
+                b->format, b->value, b->addr, b->origin);
+        queue_abort(h);
+    }
+    return e;
+}
+
+int imx_write_barrier(struct imx_device *h)
+{
+    if (h->link_error) {
+        queue_abort(h);
+        return h->link_error;
+    }
+    while (h->queue_count) {
+        int e = queue_retire(h);
+        if (e < 0)
+            return e;
+    }
+    return 0;
+}
+
+static int imx_queue_write_reg(struct imx_device *h, uint32_t addr,
+        uint32_t data, int format)
+{
+    struct async_block *b;
+    struct sdp_command *cmd;
+    int e, i, j;
+
+    e = imx_require(h, IMX_CAP_REGISTERS, "register writes");
+    if (e < 0)
+        return e;
+
+    if (!h->write_queue) {
+        h->write_queue = calloc(WRITE_QUEUE_DEPTH, sizeof(*h->write_queue));
+        if (!h->write_queue)
+            return -ENOMEM;
+        for (i = 0; i < WRITE_QUEUE_DEPTH; i++)
+            for (j = 0; j < XFER_COUNT; j++)
+                if (!(h->write_queue[i].xfer[j] = alloc_transfer(h))) {
+                    queue_free(h);
+                    return -ENOMEM;
+                }
+    }
+
+    if (h->queue_count == WRITE_QUEUE_DEPTH) {
+        e = queue_retire(h);
+        if (e < 0)
+            return e;
+    }
+
+    b = &h->write_queue[(h->queue_head + h->queue_count) % WRITE_QUEUE_DEPTH];
+    b->addr = addr;
+    b->value = data;
+    b->format = format;
+    b->expected = STATUS_WRITE_COMPLETE;
+    b->error = 0;
+    snprintf(b->origin, sizeof(b->origin), "%s",
+            write_origin ? write_origin() : "");
+
+    cmd = &b->cmd;
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->report_id = 1;
+    cmd->command_type = SDP_WRITE_REGISTER;
+    cmd->address = htonl(addr);
+    cmd->format = format;
+    cmd->data_count = htonl(1);
+    cmd->data = htonl(data);
+    fill_transfer(b->xfer[XFER_CMD], IMX_TRANSFER_SET_REPORT, (uint8_t *)cmd,
+            sizeof(*cmd), async_block_callback, b);
+
+    h->queue_count++;
+    e = async_block_start(h, b, 0);
+    if (e < 0)
+        return imx_write_barrier(h);
+
+    return 0;
+}
+
+static void queue_free(struct imx_device *h)
+{
+    int i, j;
+
+    if (!h->write_queue)
+        return;
+    for (i = 0; i < WRITE_QUEUE_DEPTH; i++)
+        for (j = 0; j < XFER_COUNT; j++)
+            free_transfer(h->write_queue[i].xfer[j]);
+    free(h->write_queue);
+    h->write_queue = NULL;
+}
+
+static int imx_write_bulk_async(struct imx_device *h, uint32_t addr,
+        uint8_t *data, int length)
+{
+    struct async_block *blocks;
+    int head = 0, tail = 0; /* Oldest in-flight block, next free block */
+    int inflight = 0;
+    int pos = 0;
+    int e = 0, i, j;
+
+    blocks = calloc(ASYNC_DEPTH, sizeof(*blocks));
+    if (!blocks)
+        return -ENOMEM;
+    for (i = 0; i < ASYNC_DEPTH; i++)
+        for (j = 0; j < XFER_COUNT; j++) {
+            blocks[i].xfer[j] = alloc_transfer(h);
+            if (!blocks[i].xfer[j]) {
+                e = -ENOMEM;
+                goto out;
+            }
+        }
+
+    while (pos < length || inflight) {
+        /* Top up the pipeline */
+        while (pos < length && inflight < ASYNC_DEPTH) {
+            int this_len = min(1024, length - pos);
+
+            e = async_block_submit(h, &blocks[tail], addr + pos,
+                    data + pos, this_len);
+            inflight++;
+            if (e < 0) {
+                fprintf(stderr, "Write failed at 0x%8.8x\n", addr + pos);
+                goto abort;
+            }
+            tail = (tail + 1) % ASYNC_DEPTH;
+            pos += this_len;
+        }
+
+        /* Retire the oldest block */
+        e = async_block_wait(&blocks[head]);
+        if (e < 0) {
+            fprintf(stderr, "Write failed at 0x%8.8x\n", blocks[head].addr);
+            goto abort;
+        }
+        head = (head + 1) % ASYNC_DEPTH;
+        inflight--;
+        /* Blocks complete in order, and only the last can be short */
+        h->write_acked = min(h->write_acked + 1024, length);
+    }
+
+    goto out;
+
+abort:
+    /* Cancel everything still outstanding, and wait for it to drain */
+    for (i = 0; i < ASYNC_DEPTH; i++) {
+        if (blocks[i].error == 0)
+            blocks[i].error = -ECANCELED;
+        async_block_cancel(&blocks[i]);
+    }
+    for (i = 0; i < ASYNC_DEPTH; i++)
+        async_block_wait(&blocks[i]);
+
+out:
+    for (i = 0; i < ASYNC_DEPTH; i++)
+        for (j = 0; j < XFER_COUNT; j++)
+            free_transfer(blocks[i].xfer[j]);
+    free(blocks);
+    return e;
+}
+
+/*
+ * Streamed bulk writer
+ * A single WRITE_FILE command covers a whole window of data, which is then
+ * sent as back-to-back 1KiB data reports, with a single HAB & status
+ * response at the end.
+ */
+struct stream_report {
+    struct imx_transfer *xfer;
+    uint8_t data[1025];
+    int pending;
+    int error;
+};
+
+static void stream_reports_free(struct stream_report *reports);
+
+static void stream_report_callback(struct imx_transfer *xfer)
+{
+    struct stream_report *r = xfer->user_data;
+    int e = transfer_status(xfer);
+
+    r->pending = 0;
+    if (e < 0)
+        r->error = usb_error(e, "stream data report");
+}
+
+static int stream_report_wait(struct stream_report *r)
+{
+    while (r->pending) {
+        int e = handle_events(r->xfer->dev);
+        if (e < 0)
+            return e;
+    }
+    return r->error;
+}
+
+/**
+ * Send a run of data as back-to-back 1KiB reports, with several in flight
+ * @param ep Interrupt OUT endpoint to use, or 0 to use SET_REPORT
+ * @param addr Target address of the data, for error reporting
+ */
+static int stream_data(struct imx_device *h, struct stream_report *reports,
+        int ep, uint32_t addr, uint8_t *data, int length)
+{
+    int pos, slot = 0;
+    int e = 0, i;
+
+    for (pos = 0; pos < length; pos += 1024) {
+        struct stream_report *r = &reports[slot];
+        uint8_t *report = r->data;
+        int this_len = min(1024, length - pos);
+
+        /* Wait for this slot's previous report to go out */
+        e = stream_report_wait(r);
+        if (e < 0) {
+            fprintf(stderr, "Write failed at 0x%8.8x\n",
+                    addr + pos - ASYNC_DEPTH * 1024);
+            goto drain;
+        }
+
+        report[0] = 2;
+        memcpy(&report[1], data + pos, this_len);
+        fill_transfer(r->xfer, ep ? IMX_TRANSFER_WRITE : IMX_TRANSFER_SET_REPORT,
+                report, this_len + 1, stream_report_callback, r);
+        e = submit_transfer(r->xfer);
         if (e < 0) {
-            usb_error(e, "get_device_descriptor");
-            continue;
+            usb_error(e, "submit_transfer");
+            fprintf(stderr, "Write failed at 0x%8.8x\n", addr + pos);
+            goto drain;
         }
-        if (desc.idVendor == 0x15a2 &&
-		(desc.idProduct == 0x0052 ||
-		desc.idProduct == 0x0054))
-            break;
+        r->pending = 1;
+        slot = (slot + 1) % ASYNC_DEPTH;
     }
-    if (i == count)
-        dev = NULL;
 
-    if (dev) {
-        int e;
-        e = libusb_open(dev, &h);
+    for (i = 0; i < ASYNC_DEPTH; i++) {
+        e = stream_report_wait(&reports[i]);
         if (e < 0) {
-            usb_error(e, "libusb_open /dev/bus/usb/%.3d/%.3d",
-	    	libusb_get_bus_number(dev), libusb_get_device_address(dev));
-            h = NULL;
-        } else {
-            if (libusb_kernel_driver_active(h, 0))
-                libusb_detach_kernel_driver(h, 0);
-
-            e = libusb_claim_interface(h, 0);
-            if (e < 0) {
-                usb_error(e, "claim_interface");
-                h = NULL;
-            }
+            fprintf(stderr, "Write failed in 0x%8.8x-0x%8.8x\n",
+                    addr, addr + length - 1);
+            goto drain;
         }
     }
 
-    if (devs)
-        libusb_free_device_list(devs, 1);
+    return 0;
 
-    return h;
+drain:
+    for (i = 0; i < ASYNC_DEPTH; i++)
+        if (reports[i].pending)
+            cancel_transfer(reports[i].xfer);
+    for (i = 0; i < ASYNC_DEPTH; i++)
+        stream_report_wait(&reports[i]);
+    return e;
 }
 
-static int hab_type(uint8_t *hab, int len)
+static struct stream_report *stream_reports_alloc(struct imx_device *h)
 {
-    if (len < 4) {
-        printf("Invalid hab len: %d\n", len);
-        return -1;
-    }
-    if (hab[0] == 0x56 && hab[3] == 0x56 && hab[1] == 0x78 && hab[2] == 0x78)
-        return HAB_ENGINEERING;
-    if (hab[0] == 0x12 && hab[3] == 0x12 && hab[1] == 0x34 && hab[2] == 0x34)
-        return HAB_PRODUCTION;
-    return -1;
-}
+    struct stream_report *reports;
+    int i;
 
-static int imx_send_sdp(libusb_device_handle *h, struct sdp_command *cmd)
-{
-    int i, e;
-    for (i = 5; i; i--) {
-        e = libusb_control_transfer(h, CTRL_OUT, HID_SET_REPORT,
-                (HID_REPORT_TYPE_OUTPUT << 8) | cmd->report_id,
-                0, (void *)cmd, sizeof(struct sdp_command), TIMEOUT);
-        if (e >= 0)
-            return e;
+    reports = calloc(ASYNC_DEPTH, sizeof(*reports));
+    if (!reports)
+        return NULL;
+    for (i = 0; i < ASYNC_DEPTH; i++) {
+        reports[i].xfer = alloc_transfer(h);
+        if (!reports[i].xfer) {
+            stream_reports_free(reports);
+            return NULL;
+        }
     }
-
-    return usb_error(e, "sdp libusb_control_transfer");
+    return reports;
 }
 
-static int imx_read_hab(libusb_device_handle *h)
+static void stream_reports_free(struct stream_report *reports)
 {
-    uint8_t hab[65] = {0};
-    int len, e;
-
-    e = libusb_interrupt_transfer(h, EP_IN, hab, sizeof(hab), &len, TIMEOUT);
-    if (e < 0)
-        return usb_error(e, "libusb_interrupt_transfer HAB");
-
-    if (hab[0] != 3) {
-        fprintf(stderr, "Invalid HAB report ID: 0x%x\n", hab[0]);
-        return -EINVAL;
-    }
-
-    e = hab_type(&hab[1], len - 1);
-    if (e < 0)
-        return e;
+    int i;
 
-    return 0;
+    for (i = 0; i < ASYNC_DEPTH; i++)
+        free_transfer(reports[i].xfer);
+    free(reports);
 }
 
-static int imx_write_reg(libusb_device_handle *h, uint32_t addr,
-		uint32_t data, int count, int format)
+static int imx_write_stream_window(struct imx_device *h,
+        struct stream_report *reports, uint32_t addr, uint8_t *data,
+        int length)
 {
-    int e;
     struct sdp_command cmd = {0};
-    uint8_t buffer[65];
-    int len;
-
-    //printf("Writing 0x%8.8x to 0x%8.8x\n", data, addr);
+    uint8_t status[65];
+    int e, len;
 
     cmd.report_id = 1;
-    cmd.command_type = SDP_WRITE_REGISTER;
+    cmd.command_type = SDP_WRITE_FILE;
     cmd.address = htonl(addr);
-    cmd.format = format;
-    cmd.data_count = htonl(count);
-    cmd.data = htonl(data);
+    cmd.data_count = htonl(length);
 
-    //dump("write_cmd", &cmd, sizeof(cmd));
     e = imx_send_sdp(h, &cmd);
     if (e < 0)
         return e;
 
-    /* Read the HAB data */
-    e = imx_read_hab(h);
+    e = stream_data(h, reports, 0, addr, data, length);
     if (e < 0)
         return e;
 
-    /* Read the response data */
-    memset(buffer, 0, sizeof(buffer));
-    buffer[0] = 4;
-    len = 0;
-    e = libusb_interrupt_transfer(h, EP_IN, buffer, sizeof(buffer), &len,
-		    TIMEOUT);
+    e = imx_read_hab(h);
     if (e < 0)
-        return usb_error(e, "libusb_interrupt_transfer");
+        return e;
 
-    if (len != 65) {
-        fprintf(stderr, "Insufficient write response data: %d\n", len);
-        return -EINVAL;
-    }
-    if (buffer[0] != 4) {
-        fprintf(stderr, "Incorrect report type: 0x%x\n", buffer[0]);
-        return -EINVAL;
-    }
-    if (buffer[1] != 0x12 || buffer[2] != 0x8a || buffer[3] != 0x8a ||
-        buffer[4] != 0x12) {
-        fprintf(stderr, "Invalid write response\n");
-        return -EINVAL;
-    }
-    //dump("write_response", buffer, len);
+    e = dev_read_report(h, status, sizeof(status), &len);
+    if (e < 0)
+        return usb_error(e, "read_report");
 
-    return 0;
+    return imx_check_status(status, len, STATUS_FILE_COMPLETE);
 }
 
-int imx_write_reg32(libusb_device_handle *h, uint32_t addr, uint32_t data)
-{
-    return imx_write_reg(h, addr, data, 1, 0x20);
-}
+/* Time to wait for each stale report when draining them (ms) */
+#define DRAIN_TIMEOUT 50
+/* Most stale reports to throw away */
+#define DRAIN_MAX 8
 
-int imx_write_reg16(libusb_device_handle *h, uint32_t addr, uint16_t data)
+/**
+ * Throw away the HAB & status reports the ROM sent about a write it gave
+ * up on, so that they aren't taken as the replies to the next command.
+ * These reads are expected to time out, so they don't count against the
+ * link's health
+ */
+static void drain_reports(struct imx_device *h)
 {
-    return imx_write_reg(h, addr, data, 1, 0x10);
+    uint8_t report[65];
+    int i, len;
+
+    for (i = 0; i < DRAIN_MAX && !h->link_error; i++)
+        if (h->ops->read_report(h->priv, report, sizeof(report), &len,
+                    DRAIN_TIMEOUT) < 0)
+            break;
 }
 
-int imx_write_reg8(libusb_device_handle *h, uint32_t addr, uint8_t data)
+/**
+ * Whether a failed streamed write looks like the ROM not accepting
+ * multi-report writes: it either says so, stalls, or stops answering
+ */
+static int stream_refused(int e)
 {
-    return imx_write_reg(h, addr, data, 1, 0x8);
+    return e == -EINVAL || e == LIBUSB_ERROR_PIPE ||
+        e == LIBUSB_ERROR_TIMEOUT;
 }
 
-int imx_dcd_write(libusb_device_handle *h, uint32_t *data, int count)
+static int imx_write_bulk_stream(struct imx_device *h, uint32_t addr,
+        uint8_t *data, int length)
 {
-    int e;
-    struct sdp_command cmd = {0};
-    uint8_t dcd_data[1024];
-    int len, i;
-
-    if (count > 85) {
-        fprintf(stderr, "DCD writes must be < 85 32-bit words\n");
-        return -EINVAL;
+    struct stream_report *reports;
+    int pos = 0;
+    int e = 0;
+
+    reports = stream_reports_alloc(h);
+    if (!reports)
+        return -ENOMEM;
+
+    while (pos < length) {
+        int this_len = min(h->write_window, length - pos);
+
+        e = imx_write_stream_window(h, reports, addr + pos, data + pos,
+                this_len);
+        if (pos == 0 && stream_refused(e) && !h->link_error) {
+            /* The ROM didn't accept a multi-report write, so fall back
+             * to one command per block from here on */
+            fprintf(stderr, "Streamed write rejected, using 1KiB blocks\n");
+            drain_reports(h);
+            h->stream_rejected = 1;
+            e = imx_write_bulk_async(h, addr, data, length);
+            goto out;
+        }
+        if (e < 0) {
+            fprintf(stderr, "Write failed at 0x%8.8x\n", addr + pos);
+            goto out;
+        }
+        pos += this_len;
+        h->write_acked = pos;
     }
 
-    /* Convert them all to the required big-endian format */
-    for (i = 0; i < count * 3; i++) {
-        data[i] = htonl(data[i]);
-    }
+out:
+    stream_reports_free(reports);
+    return e;
+}
 
-    //printf("Writing 0x%8.8x to 0x%8.8x\n", data, addr);
+/*
+ * SDPS protocol
+ * Newer boot ROMs take a whole boot image after a single BLTC "download
+ * firmware" command, and boot it as soon as it has all arrived. The image
+ * carries its own load addresses, so there is no address in the command.
+ */
+static int imx_sdps_write(struct imx_device *h, uint8_t *data, int length)
+{
+    struct sdps_command cmd = {0};
+    struct stream_report *reports;
+    int e;
 
     cmd.report_id = 1;
-    cmd.command_type = SDP_DCD_WRITE;
-    cmd.data_count = htonl(count);
+    cmd.signature = htole32(BLTC_SIGNATURE);
+    cmd.tag = htole32(1);
+    cmd.xfer_length = htole32(length);
+    cmd.command = BLTC_DOWNLOAD_FW;
+    cmd.length = htonl(length);
 
-    //dump("write_cmd", &cmd, sizeof(cmd));
-    e = imx_send_sdp(h, &cmd);
+    e = send_report(h, &cmd, sizeof(cmd));
     if (e < 0)
         return e;
 
-    /* Write the DCD data */
-    dcd_data[0] = 2;
-    memcpy(&dcd_data[1], data, count * 12);
-    //dump("dcd_data", dcd_data, count * 12 + 1);
-    e = libusb_control_transfer(h, CTRL_OUT, HID_SET_REPORT,
-            (HID_REPORT_TYPE_OUTPUT << 8) | 2,
-            0, dcd_data, count * 12 + 1, TIMEOUT);
-    if (e < 0)
-        return usb_error(e, "libusb_control_transfer dcd");
-
-    /* Read the HAB data */
-    e = imx_read_hab(h);
+    reports = stream_reports_alloc(h);
+    if (!reports)
+        return -ENOMEM;
+    e = stream_data(h, reports, h->ep_out, 0, data, length);
+    stream_reports_free(reports);
     if (e < 0)
         return e;
 
-    /* Read the response data */
-    memset(dcd_data, 0, sizeof(dcd_data));
-    dcd_data[0] = 4;
-    len = 0;
-    e = libusb_interrupt_transfer(h, EP_IN, dcd_data, sizeof(dcd_data),
-		    &len, TIMEOUT);
+    /* The ROM will now boot the image itself */
+    h->image_loaded = 1;
+    return 0;
+}
+
+int imx_write_bulk(struct imx_device *h, uint32_t addr, uint8_t *data,
+		int length)
+{
+    int e = imx_write_barrier(h);
     if (e < 0)
-        return usb_error(e, "libusb_interrupt_transfer");
+        return e;
 
-    if (len != 65) {
-        fprintf(stderr, "Insufficient write response data: %d\n", len);
-        return -EINVAL;
-    }
-    //dump("dcd_write_response", dcd_data, len);
-    if (dcd_data[0] != 4) {
-        fprintf(stderr, "Incorrect report type: 0x%x\n", dcd_data[0]);
-        return -EINVAL;
-    }
-    if (dcd_data[1] != 0x12 || dcd_data[2] != 0x8a || dcd_data[3] != 0x8a ||
-        dcd_data[4] != 0x12) {
-        fprintf(stderr, "Invalid write response\n");
-        return -EINVAL;
-    }
+    h->write_acked = 0;
+    if (h->soc->protocol == IMX_PROTOCOL_SDPS)
+        return imx_sdps_write(h, data, length);
 
-    return 0;
+    dcd_area_check(h, addr, length);
+    if (h->write_mode == IMX_WRITE_STREAM && !h->stream_rejected)
+        return imx_write_bulk_stream(h, addr, data, length);
+    if (h->write_mode == IMX_WRITE_SYNC)
+        return imx_write_bulk_sync(h, addr, data, length);
+    return imx_write_bulk_async(h, addr, data, length);
 }
 
-static int imx_write_bulk_block(libusb_device_handle *h, uint32_t addr,
-		uint8_t *data, int length)
+int imx_write_acked(struct imx_device *h)
 {
-    int e;
-    struct sdp_command cmd = {0};
-    int len;
-    uint8_t write_data[1025];
+    return h->write_acked;
+}
 
-    if (length > 1024)
-        return -EINVAL;
+/* Amount of data read back to confirm a resumed write can carry on */
+#define RESUME_CHECK 4096
 
-    cmd.report_id = 1;
-    cmd.command_type = SDP_WRITE_FILE;
-    cmd.address = htonl(addr);
-    cmd.data_count = htonl(length);
+int imx_write_bulk_resume(struct imx_device *h, uint32_t addr, uint8_t *data,
+        int length, int acked)
+{
+    int check = min(RESUME_CHECK, acked);
+    uint8_t *read_back;
+    int e;
 
-    //dump("write_cmd", &cmd, sizeof(cmd));
-    e = imx_send_sdp(h, &cmd);
+    if (acked <= 0 || acked > length ||
+            h->soc->protocol == IMX_PROTOCOL_SDPS)
+        return imx_write_bulk(h, addr, data, length);
+
+    /* Make sure what was written before is still there (ie: the board
+     * wasn't reset, or swapped) before relying on it */
+    read_back = malloc(check);
+    if (!read_back)
+        return -ENOMEM;
+    e = imx_read_bulk(h, addr + acked - check, read_back, check, 8);
+    if (e >= 0 && memcmp(read_back, data + acked - check, check) != 0) {
+        fprintf(stderr, "Data at 0x%8.8x has changed, restarting write\n",
+                addr + acked - check);
+        acked = 0;
+    }
+    free(read_back);
     if (e < 0)
         return e;
 
-    write_data[0] = 2;
-    memcpy(&write_data[1], data, length);
-    e = libusb_control_transfer(h, CTRL_OUT, HID_SET_REPORT,
-            (HID_REPORT_TYPE_OUTPUT << 8) | 2,
-            0, write_data, length + 1, TIMEOUT);
-    if (e < 0)
-        return usb_error(e, "libusb_control_transfer write_file");
-
-    /* Read the HAB data */
-    e = imx_read_hab(h);
+    e = imx_write_bulk(h, addr + acked, data + acked, length - acked);
+    h->write_acked += acked;
     if (e < 0)
         return e;
+    return acked;
+}
 
-    /* Read the response data */
-    e = libusb_interrupt_transfer(h, EP_IN, write_data, sizeof(write_data),
-		    &len, TIMEOUT);
-    if (e < 0)
-        return usb_error(e, "libusb_interrupt_transfer");
+/*
+ * Bulk reads
+ * The response to a READ_REGISTER command is a stream of 64-byte interrupt
+ * reports. We keep several interrupt reads queued so the next report is
+ * always waiting to be filled, and copy each payload straight to its place
+ * in the caller's buffer. libusb completes transfers on an endpoint in
+ * order, so the reports arrive in address order.
+ */
+#define READ_MAX_COUNT (64 * 1024)
 
-    if (len != 65) {
-        fprintf(stderr, "Insufficient write response data: %d\n", len);
-        return -EINVAL;
-    }
-    //dump("dcd_write_response", write_data, len);
-    if (write_data[0] != 4) {
-        fprintf(stderr, "Incorrect report type: 0x%x\n", write_data[0]);
-        return -EINVAL;
-    }
-    if (write_data[1] != 0x88 || write_data[2] != 0x88 ||
-        write_data[3] != 0x88 || write_data[4] != 0x88) {
-        fprintf(stderr, "Invalid write response\n");
-        return -EINVAL;
-    }
 
-    return 0;
+struct read_report {
+    struct imx_transfer *xfer;
+    struct read_state *state;
+    uint8_t data[65];
+    int busy;
+};
+
+struct read_state {
+    uint8_t *result;
+    int count;
+    int done;
+    int inflight;
+    int error;
+};
+
+void imx_set_read_depth(struct imx_device *h, int depth)
+{
+    h->read_depth = max(depth, 1);
 }
 
-int imx_write_bulk(libusb_device_handle *h, uint32_t addr, uint8_t *data,
-		int length)
+int imx_get_read_depth(struct imx_device *h)
 {
-    int i;
+    return h->read_depth;
+}
 
-    for (i = 0; i < length; i+= 1024) {
-        int this_len = min(1024, length - i);
-        int e;
-        e = imx_write_bulk_block(h, addr, data, this_len);
-        if (e < 0)
-            return e;
-        addr += this_len;
-        data += this_len;
+static void read_report_callback(struct imx_transfer *xfer)
+{
+    struct read_report *r = xfer->user_data;
+    struct read_state *st = r->state;
+    int e = transfer_status(xfer);
+
+    r->busy = 0;
+    st->inflight--;
+    if (st->error < 0)
+        return;
+    if (e < 0) {
+        st->error = usb_error(e, "read_report read resp");
+        return;
     }
 
-    return 0;
+    if (xfer->actual_length > 1) {
+        int this = min(st->count - st->done, xfer->actual_length - 1);
+        memcpy(st->result + st->done, &r->data[1], this);
+        st->done += this;
+    }
 }
 
-int imx_read_bulk(libusb_device_handle *h, uint32_t addr, uint8_t *result,
-        int count, int format)
+
+static int imx_read_bulk_block(struct imx_device *h,
+        struct read_report *reports, int depth, uint32_t addr,
+        uint8_t *result, int count, int format)
 {
-    int e;
     struct sdp_command cmd = {0};
-    uint8_t buffer[65];
-    int len;
-    int remaining = count;
-
-    //printf("Reading %d %d-bit values from 0x%8.8x remaining %d\n", count, format, addr, remaining);
+    struct read_state st = {
+        .result = result,
+        .count = count,
+    };
+    int requested = 0, slot = 0;
+    int e, i;
+
+    //printf("Reading %d %d-bit values from 0x%8.8x\n", count, format, addr);
     cmd.report_id = 1;
     cmd.command_type = SDP_READ_REGISTER;
     cmd.address = htonl(addr);
@@ -472,70 +2533,139 @@ int imx_read_bulk(libusb_device_handle *h, uint32_t addr, uint8_t *result,
         return e;
 
     /* Read the actual data */
-    while (remaining) {
-        memset(buffer, 0, sizeof(buffer));
-        buffer[0] = 4;
-        len = 0;
-        e = libusb_interrupt_transfer(h, EP_IN, buffer, sizeof(buffer),
-			&len, TIMEOUT);
-        if (e < 0)
-            return usb_error(e, "libusb_interrupt_transfer read resp");
+    while (st.done < count && st.error == 0) {
+        struct read_report *r = &reports[slot];
+
+        if (requested >= count) {
+            /* Short reports mean we need more than we've asked for */
+            if (!st.inflight)
+                requested = st.done;
+            else if ((e = handle_events(h)) < 0)
+                st.error = e;
+            continue;
+        }
+
+        if (r->busy) {
+            if ((e = handle_events(h)) < 0)
+                st.error = e;
+            continue;
+        }
+
+        r->state = &st;
+        fill_transfer(r->xfer, IMX_TRANSFER_READ, r->data, sizeof(r->data),
+                read_report_callback, r);
+        e = submit_transfer(r->xfer);
+        if (e < 0) {
+            st.error = usb_error(e, "submit_transfer");
+            break;
+        }
+        r->busy = 1;
+        st.inflight++;
+        requested += 64;
+        slot = (slot + 1) % depth;
+    }
+
+    /* Cancel anything left over, and wait for it to drain */
+    for (i = 0; i < depth; i++)
+        if (reports[i].busy)
+            cancel_transfer(reports[i].xfer);
+    while (st.inflight)
+        if (handle_events(h) < 0)
+            break;
+
+    return st.error;
+}
 
-        if (len > 1) {
-            int this = min(remaining, len - 1);
-            memcpy(result, &buffer[1], this);
+int imx_read_bulk(struct imx_device *h, uint32_t addr, uint8_t *result,
+        int count, int format)
+{
+    struct read_report *reports;
+    int depth = h->read_depth;
+    int pos = 0;
+    int e = 0, i;
 
-            //dump("read_resp", buffer, sizeof(buffer));
+    e = imx_require(h, IMX_CAP_REGISTERS, "memory reads");
+    if (e < 0)
+        return e;
+    e = imx_write_barrier(h);
+    if (e < 0)
+        return e;
 
-            result += this;
-            remaining -= this;
+    reports = calloc(depth, sizeof(*reports));
+    if (!reports)
+        return -ENOMEM;
+    for (i = 0; i < depth; i++) {
+        reports[i].xfer = alloc_transfer(h);
+        if (!reports[i].xfer) {
+            e = -ENOMEM;
+            goto out;
         }
+    }
 
+    /* Larger reads are split up into a chain of commands */
+    while (pos < count) {
+        int this_len = min(READ_MAX_COUNT, count - pos);
+
+        e = imx_read_bulk_block(h, reports, depth, addr + pos,
+                result + pos, this_len, format);
+        if (e < 0) {
+            fprintf(stderr, "Read failed at 0x%8.8x\n", addr + pos);
+            goto out;
+        }
+        pos += this_len;
     }
 
-    return 0;
+out:
+    for (i = 0; i < depth; i++)
+        free_transfer(reports[i].xfer);
+    free(reports);
+    return e;
 }
 
-int imx_read_reg32(libusb_device_handle *h, uint32_t addr, uint32_t *value)
+int imx_read_reg32(struct imx_device *h, uint32_t addr, uint32_t *value)
 {
     return imx_read_bulk(h, addr, (uint8_t *)value, 4, 0x20);
 }
 
-int imx_read_reg16(libusb_device_handle *h, uint32_t addr, uint16_t *value)
+int imx_read_reg16(struct imx_device *h, uint32_t addr, uint16_t *value)
 {
     return imx_read_bulk(h, addr, (uint8_t *)value, 2, 0x10);
 }
 
-int imx_read_reg8(libusb_device_handle *h, uint32_t addr, uint8_t *value)
+int imx_read_reg8(struct imx_device *h, uint32_t addr, uint8_t *value)
 {
     return imx_read_bulk(h, addr, value, 1, 0x08);
 }
 
+uint32_t imx_jump_ivt(uint32_t entry, uint8_t *buffer)
+{
+    struct imx_image_ivt fake;
+
+    memset(&fake, 0, sizeof(fake));
+    fake.header.tag = IMX_IMAGE_TAG_FILE_HEADER;
+    fake.header.length = IMX_IMAGE_FILE_HEADER_LENGTH;
+    fake.header.version = IMX_IMAGE_VERSION;
+    fake.entry = entry;
+    fake.self = entry - sizeof(fake);
+    memcpy(buffer, &fake, sizeof(fake));
+    return fake.self;
+}
+
 /**
  * The IMX is looking for an IMX image, so we create a fake entry
  * for one, and point it's jump address to the one we're after.
  * This means there must always be sizeof(struct imx_image_ivt) memory
  * available before the address passed to this function
  */
-int imx_jump_address(libusb_device_handle *h, uint32_t addr)
+/**
+ * Have the ROM start the image described by the IVT at a given address
+ */
+static int jump_ivt(struct imx_device *h, uint32_t addr)
 {
     int e;
     struct sdp_command cmd = {0};
     uint8_t buffer[65];
     int len;
-    struct imx_image_ivt fake;
-
-    /* Write a pretend IVT header */
-    memset(&fake, 0, sizeof(fake));
-    fake.header.tag = IMX_IMAGE_TAG_FILE_HEADER;
-    fake.header.length = IMX_IMAGE_FILE_HEADER_LENGTH;
-    fake.header.version = IMX_IMAGE_VERSION;
-    fake.entry = addr;
-    fake.self = addr - sizeof(fake);
-    addr = fake.self;
-    e = imx_write_bulk(h, addr, (uint8_t *)&fake, sizeof(fake));
-    if (e < 0)
-        return e;
 
     cmd.report_id = 1;
     cmd.command_type = SDP_JUMP_ADDRESS;
@@ -554,15 +2684,48 @@ int imx_jump_address(libusb_device_handle *h, uint32_t addr)
     memset(buffer, 0, sizeof(buffer));
     buffer[0] = 4;
     len = 0;
-    e = libusb_interrupt_transfer(h, EP_IN, buffer, sizeof(buffer), &len, TIMEOUT);
+    e = dev_read_report(h, buffer, sizeof(buffer), &len);
     /* We actually expect USB to fail here, since we've just jumped out
      * of the USB Bootloader code
      */
-    if (e < 0)
+    if (e < 0) {
+        h->link_error = LIBUSB_ERROR_NO_DEVICE;
         return 0;
+    }
 
    fprintf(stderr, "Failure: Continued USB comms after jump\n");
    dump("jump_response", buffer, len);
    return -EINVAL;
 }
 
+int imx_jump_address(struct imx_device *h, uint32_t addr)
+{
+    int e;
+    uint8_t ivt[IMX_JUMP_IVT_SIZE];
+
+    if (!(h->soc->caps & IMX_CAP_JUMP)) {
+        /* SDPS ROMs boot the downloaded image as soon as it arrives */
+        if (h->image_loaded)
+            return 0;
+        fprintf(stderr, "%s can only boot a downloaded image\n",
+                h->soc->name);
+        return -EINVAL;
+    }
+
+    /* Write a pretend IVT header */
+    addr = imx_jump_ivt(addr, ivt);
+    e = imx_write_bulk(h, addr, ivt, sizeof(ivt));
+    if (e < 0)
+        return e;
+    return jump_ivt(h, addr);
+}
+
+int imx_jump_image(struct imx_device *h, uint32_t ivt)
+{
+    int e = imx_require(h, IMX_CAP_JUMP, "jumps to an IVT");
+
+    if (e < 0)
+        return e;
+    return jump_ivt(h, ivt);
+}
+
@@ -13,28 +13,165 @@
 
 #include <libusb-1.0/libusb.h>
 
+/**
+ * Protocols spoken by the boot ROMs
+ */
+enum {
+    IMX_PROTOCOL_SDP,   /* HID Serial Download Protocol */
+    IMX_PROTOCOL_SDPS,  /* Streamed download of a complete boot image */
+};
+
+/**
+ * Commands a boot ROM supports
+ */
+enum {
+    IMX_CAP_REGISTERS = 1 << 0, /* READ_REGISTER and WRITE_REGISTER */
+    IMX_CAP_DCD_WRITE = 1 << 1, /* DCD_WRITE */
+    IMX_CAP_JUMP = 1 << 2,      /* JUMP_ADDRESS */
+};
+
+/**
+ * Description of a supported boot ROM
+ */
+struct imx_soc {
+    uint16_t vid;
+    uint16_t pid;
+    const char *name;
+    int protocol;       /* One of IMX_PROTOCOL_xxx */
+    unsigned int caps;  /* IMX_CAP_xxx */
+    uint32_t dcd_addr;  /* Free OCRAM the ROM copies DCD tables to */
+};
+
+/**
+ * Connection to a device, via one of the transports in imx_transport.h
+ */
+struct imx_device;
+
+/**
+ * Look up a boot ROM by its USB vendor/product ID
+ * @return Matching entry, or NULL if the device isn't supported
+ */
+const struct imx_soc *imx_find_soc(uint16_t vid, uint16_t pid);
+
+/**
+ * Get the details of a connected device
+ * @param h i.MX?? USB connection handle
+ * @return Boot ROM the device is running
+ */
+const struct imx_soc *imx_soc(struct imx_device *h);
+
+/**
+ * Where an attached device running the USB bootloader can be found
+ */
+struct imx_device_id {
+    const struct imx_soc *soc;
+    uint8_t bus;
+    uint8_t address;
+    uint8_t ports[7];   /* Port numbers from the root hub down */
+    int nports;
+    char path[32];      /* ie: "1-2.3" */
+};
+
+/**
+ * Find all attached devices running the USB bootloader
+ * @param ids Returns an array describing each device, to be freed by the
+ *            caller
+ * @return < 0 on failure, otherwise the number of devices found
+ */
+int imx_enumerate(struct imx_device_id **ids);
+
+/**
+ * Describe a device by where it is plugged in, without looking at what is
+ * attached to the bus
+ * @param location Either a port path (ie: "1-2.3"), or a bus number and
+ *                 device address (ie: "1:5")
+ * @param id Returns the device description, to be opened with imx_open
+ * @return < 0 if location could not be parsed, >= 0 on success
+ */
+int imx_parse_location(const char *location, struct imx_device_id *id);
+
+/**
+ * Open a session with a device found by imx_enumerate or described by
+ * imx_parse_location. Only the matching device is examined, so this is
+ * quick even on a crowded bus. Each session is independent of any others,
+ * so different threads can use different sessions at the same time
+ * @return Device handle, or NULL on failure
+ */
+struct imx_device *imx_open(const struct imx_device_id *id);
+
 /**
  * Connect to an i.MX?? device running the USB bootloader
  * If multiple devices are present, the first one seen will be used
  */
-libusb_device_handle *imx_connect(void);
+struct imx_device *imx_connect(void);
+
+/**
+ * Watches for devices entering the USB bootloader
+ */
+struct imx_monitor;
+
+/**
+ * Start watching for devices. Devices which are already attached are
+ * reported as having just arrived
+ * @return Monitor, or NULL on failure
+ */
+struct imx_monitor *imx_monitor_start(void);
+/**
+ * Wait for the next device to arrive
+ * @param m Monitor to wait on
+ * @param id Returns the device, to be opened with imx_open
+ * @param timeout_ms Maximum time to wait, or < 0 to wait forever
+ * @return < 0 on failure, 0 on timeout, 1 if a device has arrived
+ */
+int imx_monitor_wait(struct imx_monitor *m, struct imx_device_id *id,
+        int timeout_ms);
+/**
+ * Stop watching for devices, and release the monitor
+ */
+void imx_monitor_stop(struct imx_monitor *m);
+
+/**
+ * Check whether a device can still be used. Once it has been unplugged, or
+ * has stopped answering (several transfers in a row have timed out), every
+ * operation on it fails immediately
+ * @return Non-zero while the device is usable
+ */
+int imx_connected(struct imx_device *h);
+
+/**
+ * Get a short name for a device (ie: its USB path)
+ */
+const char *imx_name(struct imx_device *h);
+/**
+ * Set the name returned by imx_name (defaults to the transport's name)
+ */
+void imx_set_name(struct imx_device *h, const char *name);
 /**
  * Disconnect from an i.MX?? device
  */
-void imx_disconnect(struct libusb_device_handle *h);
+void imx_disconnect(struct imx_device *h);
 
 /**
  * Perform a bulk read
  * @param h i.MX?? USB connection handle
  * @param addr Address to read from
  * @param result Buffer to store read data in
- * @param count Number of records to read
+ * @param count Number of bytes to read. Reads larger than a single command
+ *              allows are split up automatically
  * @param format Width of data to read (ie: 32, 16 or 8)
  * @return < 0 on failure, >= 0 on success
  */
-int imx_read_bulk(libusb_device_handle *h, uint32_t addr, uint8_t *result,
+int imx_read_bulk(struct imx_device *h, uint32_t addr, uint8_t *result,
         int count, int format);
 
+/**
+ * Set the number of interrupt reports imx_read_bulk keeps queued
+ * @param h i.MX?? USB connection handle
+ * @param depth Number of reports to have in flight (defaults to 8)
+ */
+void imx_set_read_depth(struct imx_device *h, int depth);
+int imx_get_read_depth(struct imx_device *h);
+
 /**
  * Write a single 32-bit register
  * @param h i.MX?? USB connection handle
@@ -42,24 +179,211 @@ int imx_read_bulk(libusb_device_handle *h, uint32_t addr, uint8_t *result,
  * @param data Data to write
  * @return < 0 on failure, >= 0 on success
  */
-int imx_write_reg32(libusb_device_handle *h, uint32_t addr, uint32_t data);
-int imx_read_reg32(libusb_device_handle *h, uint32_t addr, uint32_t *value);
-int imx_write_reg16(libusb_device_handle *h, uint32_t addr, uint16_t data);
-int imx_read_reg16(libusb_device_handle *h, uint32_t addr, uint16_t *value);
-int imx_write_reg8(libusb_device_handle *h, uint32_t addr, uint8_t data);
-int imx_read_reg8(libusb_device_handle *h, uint32_t addr, uint8_t *value);
+int imx_write_reg32(struct imx_device *h, uint32_t addr, uint32_t data);
+int imx_read_reg32(struct imx_device *h, uint32_t addr, uint32_t *value);
+int imx_write_reg16(struct imx_device *h, uint32_t addr, uint16_t data);
+int imx_read_reg16(struct imx_device *h, uint32_t addr, uint16_t *value);
+int imx_write_reg8(struct imx_device *h, uint32_t addr, uint8_t data);
+int imx_read_reg8(struct imx_device *h, uint32_t addr, uint8_t *value);
+
+/**
+ * Enable/disable queued register writes. When enabled, imx_write_reg*
+ * return as soon as the write has been submitted, and the responses are
+ * checked later, in order. Reads, file writes, DCD writes and jumps all wait
+ * for queued writes to complete first.
+ * Call imx_write_barrier before disabling queued writes.
+ * @param h i.MX?? USB connection handle
+ * @param enable non-zero to queue writes
+ */
+void imx_set_queued_writes(struct imx_device *h, int enable);
+int imx_get_queued_writes(struct imx_device *h);
+
+/**
+ * Wait for all queued register writes to complete
+ * @param h i.MX?? USB connection handle
+ * @return < 0 if any queued write failed, >= 0 on success
+ */
+int imx_write_barrier(struct imx_device *h);
+
+/**
+ * Supply a function describing where writes come from (ie: script & line),
+ * which is used when reporting the failure of a queued write. It is called
+ * from the thread making the write
+ * @param origin Function returning a description of the current location
+ */
+void imx_set_write_origin(const char *(*origin)(void));
 
 /**
  * Perform a bulk write of data to a given address
+ * On SDPS devices 'data' must be a complete boot image, which is booted
+ * as soon as it has been sent, and 'addr' is ignored
  * @param h i.MX?? USB connection handle
  * @param addr Memory address to begin the write at
  * @param data Data to write
  * @param length number of bytes in 'data'
  * @return < 0 on failure, >= 0 on success
  */
-int imx_write_bulk(libusb_device_handle *h, uint32_t addr, uint8_t *data,
+int imx_write_bulk(struct imx_device *h, uint32_t addr, uint8_t *data,
         int length);
 
+/**
+ * Find out how much of the last bulk write reached the device, ie: after
+ * it has failed part way through
+ * @return Number of bytes, from the start of the write, which the ROM has
+ *         acknowledged
+ */
+int imx_write_acked(struct imx_device *h);
+
+/**
+ * Carry on with a bulk write which failed part way through. The data just
+ * before the resume point is read back first, and if it doesn't match
+ * (ie: the board has been reset) the whole write is done again
+ * @param h i.MX?? USB connection handle
+ * @param addr Memory address the write began at
+ * @param data Data to write
+ * @param length number of bytes in 'data'
+ * @param acked Value returned by imx_write_acked after the failed write
+ * @return < 0 on failure, otherwise the number of bytes which didn't need
+ *         to be written again
+ */
+int imx_write_bulk_resume(struct imx_device *h, uint32_t addr, uint8_t *data,
+        int length, int acked);
+
+/**
+ * Methods used by imx_write_bulk to transfer data
+ */
+enum {
+    IMX_WRITE_SYNC,     /* Wait for each 1KiB block to complete in turn */
+    IMX_WRITE_ASYNC,    /* Keep several 1KiB blocks in flight at once */
+    IMX_WRITE_STREAM,   /* One command per window, data streamed behind it */
+};
+
+/**
+ * Select the method used by imx_write_bulk (defaults to IMX_WRITE_STREAM)
+ * If the boot ROM rejects a streamed write, IMX_WRITE_ASYNC is used instead
+ * for the remainder of the session
+ * @param h i.MX?? USB connection handle
+ * @param mode One of IMX_WRITE_xxx
+ */
+void imx_set_write_mode(struct imx_device *h, int mode);
+int imx_get_write_mode(struct imx_device *h);
+
+/**
+ * Set the number of bytes sent per command in IMX_WRITE_STREAM mode
+ * @param h i.MX?? USB connection handle
+ * @param bytes Window size (rounded up to a multiple of 1KiB)
+ */
+void imx_set_write_window(struct imx_device *h, int bytes);
+int imx_get_write_window(struct imx_device *h);
+
+/**
+ * Types of DCD write entry
+ */
+enum {
+    IMX_DCD_WRITE = 0,          /* *addr = value */
+    IMX_DCD_CLEAR_BITS = 1,     /* *addr &= ~value */
+    IMX_DCD_SET_BITS = 3,       /* *addr |= value */
+};
+
+/**
+ * Conditions a DCD check entry waits for
+ */
+enum {
+    IMX_DCD_ALL_CLEAR = 0,      /* (*addr & mask) == 0 */
+    IMX_DCD_ANY_CLEAR = 1,      /* (*addr & mask) != mask */
+    IMX_DCD_ALL_SET = 2,        /* (*addr & mask) == mask */
+    IMX_DCD_ANY_SET = 3,        /* (*addr & mask) != 0 */
+};
+
+/**
+ * Maximum number of writes which fit in a single DCD packet
+ */
+#define IMX_DCD_MAX_WRITES 220
+
+/**
+ * Largest DCD table the ROM accepts in one DCD write, and so the most the
+ * ROM overwrites at the DCD address (see imx_set_dcd_address)
+ */
+#define IMX_DCD_MAX_BYTES 1768
+
+struct imx_dcd_entry {
+    uint8_t tag;
+    uint8_t param;
+    uint32_t addr;
+    uint32_t value;     /* Value to write, or mask to check */
+    uint32_t count;     /* Number of times to poll a check (0 = forever) */
+};
+
+/**
+ * A DCD v2 table, which is executed by the boot ROM
+ */
+struct imx_dcd {
+    struct imx_dcd_entry *entries;
+    int count;
+    int size;
+    uint8_t *buffer;    /* Encoding buffer, reused for each packet */
+};
+
+/**
+ * Prepare an empty DCD table
+ */
+void imx_dcd_init(struct imx_dcd *dcd);
+/**
+ * Release all memory used by a DCD table
+ */
+void imx_dcd_free(struct imx_dcd *dcd);
+/**
+ * Remove all entries from a DCD table, so it can be reused
+ */
+void imx_dcd_reset(struct imx_dcd *dcd);
+
+/**
+ * Add a write to a DCD table
+ * @param dcd Table to add to
+ * @param width Width of the write (ie: 32, 16 or 8)
+ * @param op One of IMX_DCD_WRITE, IMX_DCD_CLEAR_BITS or IMX_DCD_SET_BITS
+ * @param addr Address of register to write
+ * @param value Value to write, or bits to set/clear
+ * @return < 0 on failure, >= 0 on success
+ */
+int imx_dcd_write_data(struct imx_dcd *dcd, int width, int op, uint32_t addr,
+        uint32_t value);
+
+/**
+ * Add a check to a DCD table. The ROM polls the register until the
+ * condition is met, or count polls have been made
+ * @param dcd Table to add to
+ * @param width Width of the read (ie: 32, 16 or 8)
+ * @param cond One of IMX_DCD_ALL_CLEAR/ANY_CLEAR/ALL_SET/ANY_SET
+ * @param addr Address of register to check
+ * @param mask Bits to check
+ * @param count Maximum number of polls, or 0 to poll forever
+ * @return < 0 on failure, >= 0 on success
+ */
+int imx_dcd_check_data(struct imx_dcd *dcd, int width, int cond, uint32_t addr,
+        uint32_t mask, uint32_t count);
+
+/**
+ * Add a no-op to a DCD table
+ */
+int imx_dcd_nop(struct imx_dcd *dcd);
+
+/**
+ * Execute a DCD table on the device. Tables larger than the ROM will accept
+ * are split up into several DCD writes
+ * @param h i.MX?? USB connection handle
+ * @param dcd Table to execute
+ * @return < 0 on failure, otherwise the number of DCD writes used
+ */
+int imx_dcd_send(struct imx_device *h, struct imx_dcd *dcd);
+
+/**
+ * Set the address the ROM copies DCD tables to before executing them
+ * (defaults to the dcd_addr of the device's imx_soc)
+ */
+void imx_set_dcd_address(struct imx_device *h, uint32_t addr);
+uint32_t imx_get_dcd_address(struct imx_device *h);
+
 /**
  * Perform a DCD write - ie: a bulk write of different values to different
  * addresses
@@ -68,10 +392,63 @@ int imx_write_bulk(libusb_device_handle *h, uint32_t addr, uint8_t *data,
  *              - a data width (32, 16 or 8)
  *              - an address
  *              - a value
- * @param count Number of triples to write (must be < 85)
+ * @param count Number of triples to write
+ * @return < 0 on failure, >= 0 on success
+ */
+int imx_dcd_write(struct imx_device *h, const uint32_t *data, int count);
+
+/**
+ * Collection of register writes which are sent to the i.MX?? as DCD writes,
+ * rather than as one SDP transaction per register
+ */
+struct imx_write_batch {
+    struct imx_dcd dcd; /* Pending writes */
+    int writes;         /* Total number of register writes added */
+    int transactions;   /* Total number of transactions used to send them */
+    int staged;         /* ... of which were DCD writes */
+};
+
+/**
+ * Prepare a batch for use
+ * @param batch Batch to initialise
+ */
+void imx_batch_init(struct imx_write_batch *batch);
+/**
+ * Release all memory used by a batch
+ */
+void imx_batch_free(struct imx_write_batch *batch);
+
+/**
+ * Add a register write to a batch. If the batch is full, the pending writes
+ * are flushed to the device first
+ * @param h i.MX?? USB connection handle
+ * @param batch Batch to add the write to
+ * @param width Width of the write (ie: 32, 16 or 8)
+ * @param addr Address of register to write
+ * @param data Data to write
  * @return < 0 on failure, >= 0 on success
  */
-int imx_dcd_write(libusb_device_handle *h, uint32_t *data, int count);
+int imx_batch_write(struct imx_device *h, struct imx_write_batch *batch,
+        int width, uint32_t addr, uint32_t data);
+
+/**
+ * Add a register check to a batch (see imx_dcd_check_data), so that the
+ * device waits for it before carrying out the following writes
+ */
+int imx_batch_check(struct imx_device *h, struct imx_write_batch *batch,
+        int width, int cond, uint32_t addr, uint32_t mask, uint32_t count);
+
+/**
+ * Send all pending writes in a batch to the device. They normally go as
+ * DCD writes, staged at the DCD address (see imx_set_dcd_address). Once an
+ * upload has put data there, they are sent as individual register
+ * accesses instead, so the upload is left intact. A notice is printed the
+ * first time this happens for each DCD address
+ * @param h i.MX?? USB connection handle
+ * @param batch Batch to flush
+ * @return < 0 on failure, >= 0 on success
+ */
+int imx_batch_flush(struct imx_device *h, struct imx_write_batch *batch);
 
 /**
  * Begin executing code at a given address
@@ -80,10 +457,24 @@ int imx_dcd_write(libusb_device_handle *h, uint32_t *data, int count);
  * contain any useful data
  * Note: After this has been executed successfully, no further USB operations
  * can be run, as the i.MX?? will no longer be running the USB bootloader
+ * Note: SDPS devices boot the image sent by imx_write_bulk themselves, so
+ * this only confirms that an image has been sent
  * @param h i.MX?? USB connection handle
  * @param addr Address to begin executing code from
  * @return < 0 on failure, >= 0 on success
  */
-int imx_jump_address(libusb_device_handle *h, uint32_t addr);
+int imx_jump_address(struct imx_device *h, uint32_t addr);
+
+/**
+ * Begin executing a boot image whose IVT has already been written to the
+ * device. Nothing else is written, and the ROM starts the image as its IVT
+ * describes (including authenticating it, for signed images)
+ * Note: As for imx_jump_address, no further USB operations can be run once
+ * this has succeeded
+ * @param h i.MX?? USB connection handle
+ * @param ivt Address of the image's IVT
+ * @return < 0 on failure, >= 0 on success
+ */
+int imx_jump_image(struct imx_device *h, uint32_t ivt);
 
 #endif
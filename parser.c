@@ -7,16 +7,30 @@
  * \description Parsers files/lines of the form
  *      command arg1 arg2 arg3
  * Calls appropriate callback functions based on 'command'
+ *
+ * Script files are compiled before being run: each line is split into its
+ * words and the command looked up once, giving a list of commands which
+ * can be run without any further parsing. Compiled scripts are kept in
+ * memory, and in a cache directory on disk, keyed by a hash of the script's
+ * contents and of the functions table, so a script is only ever compiled
+ * once.
  */
 #include <stdio.h>
+#include <stdint.h>
 #include <ctype.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
 
 #include "parser.h"
 
+#define MAX_PARAMS 20
+
 /**
  * Split the line into separate words, putting them into
  * params. It modifies the original string by inserting nul
@@ -72,11 +86,52 @@ static int decode_line(char *line, char **params, int max_params)
 	return nparams;
 }
 
+/* Script and line number of the command currently being executed. Each
+ * thread runs its own scripts, so these are all per-thread */
+static __thread const char *current_file = NULL;
+static __thread int current_line = 0;
+static __thread const char *echo_prefix = NULL;
+static __thread char error_location[256];
+
+void parser_set_prefix(const char *prefix)
+{
+    echo_prefix = prefix;
+}
+
+const char *parser_error_location(void)
+{
+    return error_location;
+}
+
+/**
+ * Echo a command, then run it
+ */
+static int call_function(struct parser_function *function, char **args,
+        int nparams)
+{
+    int i;
+
+    if (echo_prefix)
+        printf("[%s] ", echo_prefix);
+    for (i = 0; i < nparams; i++)
+        printf("%s%c", args[i], (i == nparams - 1) ? '\n' : ' ');
+    return function->func(nparams, args);
+}
+
+static void list_functions(struct parser_function *functions, int nfunctions)
+{
+    int f;
+
+    printf("Commands:\n");
+    for (f = 0; f < nfunctions; f++)
+        printf("\t%s\n", functions[f].name);
+}
+
 int parse_line(char *line, struct parser_function *functions, int nfunctions)
 {
-    char *args[20];
+    char *args[MAX_PARAMS];
     int f;
-    int nparams = decode_line(line, args, 20);
+    int nparams = decode_line(line, args, MAX_PARAMS);
 
 #if 0
     int i;
@@ -87,17 +142,11 @@ int parse_line(char *line, struct parser_function *functions, int nfunctions)
 
     if (nparams > 0) {
         if (strcmp(args[0], "help") == 0) {
-            printf("Commands:\n");
-            for (f = 0; f < nfunctions; f++)
-                printf("\t%s\n", functions[f].name);
+            list_functions(functions, nfunctions);
         } else {
             for (f = 0; f < nfunctions; f++) {
-                if (strcmp(functions[f].name, args[0]) == 0) {
-		    int i;
-		    for (i = 0; i < nparams; i++)
-			    printf("%s%c", args[i], (i == nparams - 1) ? '\n' : ' ');
-                    return functions[f].func(nparams, args);
-		}
+                if (strcmp(functions[f].name, args[0]) == 0)
+                    return call_function(&functions[f], args, nparams);
             }
             if (f == nfunctions) {
                 fprintf(stderr, "Invalid function: %s\n", args[0]);
@@ -109,33 +158,603 @@ int parse_line(char *line, struct parser_function *functions, int nfunctions)
     return 0;
 }
 
-int parse_file(FILE *file, int cont_on_error, struct parser_function *functions,
-        int nfunctions)
+const char *parser_location(void)
+{
+    static __thread char location[256];
+
+    if (!current_file)
+        return "interactive";
+    snprintf(location, sizeof(location), "%s:%d", current_file,
+            current_line);
+    return location;
+}
+
+static int parse_file_named(FILE *file, const char *name, int cont_on_error,
+        struct parser_function *functions, int nfunctions)
 {
     char buffer[1024];
     int retval = 0;
+    const char *old_file = current_file;
+    int old_line = current_line;
+
+    current_file = name;
+    current_line = 0;
     /* Read from stdin, decoding & executing the commands supplied */
     while (fgets(buffer, sizeof(buffer), file)) {
-        int e = parse_line(buffer, functions, nfunctions);
-        if (e < 0 && !cont_on_error)
-            return e;
+        int e;
+        current_line++;
+        e = parse_line(buffer, functions, nfunctions);
+        if (e < 0 && !error_location[0])
+            snprintf(error_location, sizeof(error_location), "%s",
+                    parser_location());
+        if (e < 0 && !cont_on_error) {
+            retval = e;
+            break;
+        }
+        retval = retval || e;
+    }
+
+    current_file = old_file;
+    current_line = old_line;
+    return retval;
+}
+
+int parse_file(FILE *file, int cont_on_error, struct parser_function *functions,
+        int nfunctions)
+{
+    return parse_file_named(file, "<stdin>", cont_on_error, functions,
+            nfunctions);
+}
+
+/*
+ * Compiled scripts
+ * A compiled script is a header, followed by each command in turn. Each
+ * command is:
+ *      line    Lines since the previous command (varint)
+ *      code    0 for an unknown command, 1 for help, otherwise the
+ *              index of the function + 2 (varint)
+ *      nwords  Number of words which follow (byte)
+ *      words   Each nul terminated
+ * The name of a known command isn't stored, as it is in the functions
+ * table. The same layout is used in memory and in the cache files.
+ */
+#define SCRIPT_MAGIC 0x42584d49 /* "IMXB" */
+#define SCRIPT_VERSION 2
+#define CODE_INVALID 0
+#define CODE_HELP 1
+#define CODE_FUNCTION 2
+
+/* Largest total size of the cache files. The least recently used are
+ * removed once it is exceeded */
+#define CACHE_MAX_BYTES (32 * 1024 * 1024)
+#define CACHE_SUFFIX ".imxb"
+
+struct script_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;       /* See script_key */
+    uint32_t count;     /* Number of commands */
+    uint32_t length;    /* Of the commands following the header */
+};
+
+/**
+ * A command, as decoded from a compiled script
+ */
+struct script_command {
+    uint32_t line;
+    uint32_t code;      /* CODE_xxx, or CODE_FUNCTION + function index */
+    int nwords;
+    const char *words;
+    uint32_t length;    /* Of the words */
+};
+
+struct compiled_script {
+    struct compiled_script *next;
+    struct script_header *script;
+};
+
+/* Every script compiled or loaded so far, shared between threads */
+static struct compiled_script *scripts = NULL;
+static pthread_mutex_t scripts_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *cache_dir = NULL;
+
+void parser_set_cache_dir(const char *dir)
+{
+    free(cache_dir);
+    cache_dir = dir && *dir ? strdup(dir) : NULL;
+    if (cache_dir)
+        mkdir(cache_dir, 0755);
+}
+
+static uint64_t fnv1a64(uint64_t hash, const void *data, size_t length)
+{
+    const uint8_t *d = data;
+
+    while (length--)
+        hash = (hash ^ *d++) * 0x100000001b3ULL;
+    return hash;
+}
+
+/**
+ * The key for a script covers the function names as well as the script
+ * itself, as the compiled commands refer to the functions by their index
+ */
+static uint64_t script_key(const char *text, size_t length,
+        struct parser_function *functions, int nfunctions)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    uint32_t version = SCRIPT_VERSION;
+    int f;
+
+    hash = fnv1a64(hash, &version, sizeof(version));
+    for (f = 0; f < nfunctions; f++)
+        hash = fnv1a64(hash, functions[f].name,
+                strlen(functions[f].name) + 1);
+    return fnv1a64(hash, text, length);
+}
+
+static char *read_all(FILE *fp, size_t *length)
+{
+    char *data = NULL;
+    size_t len = 0, size = 0;
+
+    for (;;) {
+        size_t n;
+
+        if (len + 1 >= size) {
+            char *new_data;
+
+            size = size ? size * 2 : 64 * 1024;
+            new_data = realloc(data, size);
+            if (!new_data) {
+                free(data);
+                return NULL;
+            }
+            data = new_data;
+        }
+        n = fread(data + len, 1, size - len - 1, fp);
+        if (!n)
+            break;
+        len += n;
+    }
+    if (ferror(fp)) {
+        free(data);
+        return NULL;
+    }
+    data[len] = '\0';
+    *length = len;
+    return data;
+}
+
+static uint8_t *put_varint(uint8_t *p, uint32_t value)
+{
+    while (value >= 0x80) {
+        *p++ = value | 0x80;
+        value >>= 7;
+    }
+    *p++ = value;
+    return p;
+}
+
+static const uint8_t *get_varint(const uint8_t *p, const uint8_t *end,
+        uint32_t *value)
+{
+    int shift;
+
+    *value = 0;
+    for (shift = 0; p < end && shift < 32; shift += 7) {
+        *value |= (uint32_t)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80))
+            return p;
+    }
+    return NULL;
+}
+
+/**
+ * Compile a script. The text is modified in the process
+ * @return Compiled script, to be released with free, or NULL on failure
+ */
+static struct script_header *compile_script(char *text, size_t length,
+        uint64_t key, struct parser_function *functions, int nfunctions)
+{
+    struct script_header *script;
+    size_t size = 4096, used = sizeof(*script);
+    char *line = text, *end = text + length;
+    uint32_t lineno = 0, last_line = 0;
+
+    script = malloc(size);
+    if (!script)
+        return NULL;
+    memset(script, 0, sizeof(*script));
+
+    while (line < end) {
+        char *next = memchr(line, '\n', end - line);
+        char *args[MAX_PARAMS];
+        uint32_t code = CODE_INVALID;
+        size_t needed = 1 + 2 * 5;
+        uint8_t *p;
+        int nparams, f, i, first;
+
+        if (next)
+            *next++ = '\0';
+        else
+            next = end;
+        lineno++;
+        nparams = decode_line(line, args, MAX_PARAMS);
+        line = next;
+        if (!nparams)
+            continue;
+
+        if (strcmp(args[0], "help") == 0)
+            code = CODE_HELP;
+        for (f = 0; f < nfunctions && code == CODE_INVALID; f++)
+            if (strcmp(functions[f].name, args[0]) == 0)
+                code = CODE_FUNCTION + f;
+        first = code == CODE_INVALID ? 0 : 1;
+
+        for (i = first; i < nparams; i++)
+            needed += strlen(args[i]) + 1;
+        if (used + needed > size) {
+            struct script_header *new_script;
+
+            while (used + needed > size)
+                size *= 2;
+            new_script = realloc(script, size);
+            if (!new_script) {
+                free(script);
+                return NULL;
+            }
+            script = new_script;
+        }
+
+        p = (uint8_t *)script + used;
+        p = put_varint(p, lineno - last_line);
+        p = put_varint(p, code);
+        *p++ = nparams - first;
+        for (i = first; i < nparams; i++) {
+            size_t len = strlen(args[i]) + 1;
+
+            memcpy(p, args[i], len);
+            p += len;
+        }
+        used = p - (uint8_t *)script;
+        last_line = lineno;
+        script->count++;
+    }
+
+    script->magic = SCRIPT_MAGIC;
+    script->version = SCRIPT_VERSION;
+    script->key = key;
+    script->length = used - sizeof(*script);
+    return script;
+}
+
+/**
+ * Decode the next command of a compiled script, checking that it is intact
+ * @param c Returns the command. Its line must hold the previous command's
+ *          line
+ * @return Start of the following command, or NULL if it is corrupt
+ */
+static const uint8_t *next_command(const uint8_t *pos, const uint8_t *end,
+        int nfunctions, struct script_command *c)
+{
+    uint32_t delta;
+    int i;
+
+    pos = get_varint(pos, end, &delta);
+    if (pos)
+        pos = get_varint(pos, end, &c->code);
+    if (!pos || pos >= end || c->code >= CODE_FUNCTION + nfunctions)
+        return NULL;
+    c->line += delta;
+    c->nwords = *pos++;
+    if (c->nwords > MAX_PARAMS - (c->code != CODE_INVALID) ||
+            (c->code == CODE_INVALID && !c->nwords))
+        return NULL;
+
+    c->words = (const char *)pos;
+    for (i = 0; i < c->nwords; i++) {
+        const uint8_t *nul = memchr(pos, '\0', end - pos);
+
+        if (!nul)
+            return NULL;
+        pos = nul + 1;
+    }
+    c->length = (const char *)pos - c->words;
+    return pos;
+}
+
+/**
+ * Check that a compiled script read from the cache is intact, so that it
+ * can be run without any further checks
+ */
+static int script_valid(const struct script_header *script, size_t size,
+        uint64_t key, int nfunctions)
+{
+    const uint8_t *pos = (const uint8_t *)(script + 1);
+    const uint8_t *end;
+    struct script_command c = {0};
+    uint32_t i;
+
+    if (size < sizeof(*script) || script->magic != SCRIPT_MAGIC ||
+            script->version != SCRIPT_VERSION || script->key != key ||
+            script->length != size - sizeof(*script))
+        return 0;
+
+    end = pos + script->length;
+    for (i = 0; i < script->count && pos; i++)
+        pos = next_command(pos, end, nfunctions, &c);
+    return pos == end;
+}
+
+static void cache_filename(char *name, size_t size, uint64_t key)
+{
+    snprintf(name, size, "%s/%016llx" CACHE_SUFFIX, cache_dir,
+            (unsigned long long)key);
+}
+
+static struct script_header *cache_load(uint64_t key, int nfunctions)
+{
+    struct script_header *script;
+    char name[1024];
+    size_t length;
+    FILE *fp;
+
+    if (!cache_dir)
+        return NULL;
+    cache_filename(name, sizeof(name), key);
+    fp = fopen(name, "rb");
+    if (!fp)
+        return NULL;
+    script = (struct script_header *)read_all(fp, &length);
+    fclose(fp);
+    if (script && !script_valid(script, length, key, nfunctions)) {
+        free(script);
+        script = NULL;
+    }
+    /* Mark it as recently used, see cache_sweep */
+    if (script)
+        utime(name, NULL);
+    return script;
+}
+
+struct cache_file {
+    char name[64];
+    off_t size;
+    time_t used;
+};
+
+static int cache_file_cmp(const void *a, const void *b)
+{
+    const struct cache_file *fa = a, *fb = b;
+
+    return (fa->used > fb->used) - (fa->used < fb->used);
+}
+
+/**
+ * Remove the least recently used cache files, once they add up to more
+ * than CACHE_MAX_BYTES
+ */
+static void cache_sweep(void)
+{
+    struct cache_file *files = NULL;
+    struct dirent *d;
+    char path[1024];
+    off_t total = 0;
+    int count = 0, size = 0, i;
+    DIR *dir;
+
+    dir = opendir(cache_dir);
+    if (!dir)
+        return;
+    while ((d = readdir(dir))) {
+        struct stat st;
+
+        /* Includes temporary files left behind by cache_store */
+        if (!strstr(d->d_name, CACHE_SUFFIX) ||
+                strlen(d->d_name) >= sizeof(files->name))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", cache_dir, d->d_name);
+        if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+            continue;
+        if (count == size) {
+            struct cache_file *new_files;
+
+            size = size ? size * 2 : 64;
+            new_files = realloc(files, size * sizeof(*files));
+            if (!new_files)
+                break;
+            files = new_files;
+        }
+        strcpy(files[count].name, d->d_name);
+        files[count].size = st.st_size;
+        files[count].used = st.st_mtime;
+        total += st.st_size;
+        count++;
+    }
+    closedir(dir);
+
+    if (total > CACHE_MAX_BYTES) {
+        qsort(files, count, sizeof(*files), cache_file_cmp);
+        for (i = 0; i < count && total > CACHE_MAX_BYTES; i++) {
+            snprintf(path, sizeof(path), "%s/%s", cache_dir, files[i].name);
+            if (unlink(path) == 0)
+                total -= files[i].size;
+        }
+    }
+    free(files);
+}
+
+/**
+ * Save a compiled script in the cache. This is written to a temporary file
+ * first, so that other processes never see a partial script
+ */
+static void cache_store(const struct script_header *script)
+{
+    char name[1024], temp[sizeof(name) + 8];
+    size_t length = sizeof(*script) + script->length;
+    FILE *fp;
+    int fd, e;
+
+    if (!cache_dir)
+        return;
+    cache_filename(name, sizeof(name), script->key);
+    snprintf(temp, sizeof(temp), "%s.XXXXXX", name);
+    fd = mkstemp(temp);
+    if (fd < 0)
+        return;
+    fp = fdopen(fd, "wb");
+    if (!fp) {
+        close(fd);
+        unlink(temp);
+        return;
+    }
+    e = fwrite(script, length, 1, fp) == 1 ? 0 : -EIO;
+    if (fclose(fp) != 0)
+        e = -EIO;
+    if (e < 0 || rename(temp, name) < 0)
+        unlink(temp);
+    else
+        cache_sweep();
+}
+
+/**
+ * Find the compiled form of a script, compiling it if it hasn't been seen
+ * before
+ */
+static const struct script_header *get_script(char *text, size_t length,
+        struct parser_function *functions, int nfunctions)
+{
+    uint64_t key = script_key(text, length, functions, nfunctions);
+    struct compiled_script *c;
+    struct script_header *script;
+
+    pthread_mutex_lock(&scripts_lock);
+    for (c = scripts; c; c = c->next)
+        if (c->script->key == key)
+            break;
+    pthread_mutex_unlock(&scripts_lock);
+    if (c)
+        return c->script;
+
+    script = cache_load(key, nfunctions);
+    if (!script) {
+        script = compile_script(text, length, key, functions, nfunctions);
+        if (!script)
+            return NULL;
+        cache_store(script);
+    }
+
+    c = malloc(sizeof(*c));
+    if (!c) {
+        free(script);
+        return NULL;
+    }
+    c->script = script;
+    pthread_mutex_lock(&scripts_lock);
+    c->next = scripts;
+    scripts = c;
+    pthread_mutex_unlock(&scripts_lock);
+    return script;
+}
+
+/**
+ * Run a single compiled command. Compiled scripts are shared, so the
+ * command gets its own copy of the words
+ */
+static int run_command(const struct script_command *c,
+        struct parser_function *functions, int nfunctions)
+{
+    char buffer[1024], *words = buffer, *pos;
+    char *args[MAX_PARAMS];
+    struct parser_function *function;
+    int i, e;
+
+    if (c->code == CODE_HELP) {
+        list_functions(functions, nfunctions);
+        return 0;
+    }
+    if (c->code == CODE_INVALID) {
+        fprintf(stderr, "Invalid function: %s\n", c->words);
+        return -EINVAL;
+    }
+
+    if (c->length > sizeof(buffer)) {
+        words = malloc(c->length);
+        if (!words)
+            return -ENOMEM;
+    }
+    memcpy(words, c->words, c->length);
+    function = &functions[c->code - CODE_FUNCTION];
+    args[0] = function->name;
+    for (i = 0, pos = words; i < c->nwords; i++) {
+        args[i + 1] = pos;
+        pos += strlen(pos) + 1;
+    }
+    e = call_function(function, args, c->nwords + 1);
+    if (words != buffer)
+        free(words);
+    return e;
+}
+
+static int run_script(const struct script_header *script, const char *name,
+        int cont_on_error, struct parser_function *functions, int nfunctions)
+{
+    const uint8_t *pos = (const uint8_t *)(script + 1);
+    const uint8_t *end = pos + script->length;
+    const char *old_file = current_file;
+    int old_line = current_line;
+    struct script_command c = {0};
+    int retval = 0;
+    uint32_t i;
+
+    current_file = name;
+    for (i = 0; i < script->count; i++) {
+        int e;
+
+        pos = next_command(pos, end, nfunctions, &c);
+        current_line = c.line;
+        e = run_command(&c, functions, nfunctions);
+        if (e < 0 && !error_location[0])
+            snprintf(error_location, sizeof(error_location), "%s",
+                    parser_location());
+        if (e < 0 && !cont_on_error) {
+            retval = e;
+            break;
+        }
         retval = retval || e;
     }
 
+    current_file = old_file;
+    current_line = old_line;
     return retval;
 }
 
 int parse_filename(const char *file, int cont_on_error,
         struct parser_function *functions, int nfunctions)
 {
+    const struct script_header *script;
+    size_t length;
+    char *text;
     FILE *fp;
-    int e;
+
     fp = fopen(file, "rb");
     if (!fp) {
         fprintf(stderr, "Failed to open %s: %s\n", file, strerror(errno));
         return -errno;
     }
-    e = parse_file(fp, cont_on_error, functions, nfunctions);
+    text = read_all(fp, &length);
     fclose(fp);
-    return e;
+    if (!text) {
+        fprintf(stderr, "Failed to read %s\n", file);
+        return -EIO;
+    }
+
+    script = get_script(text, length, functions, nfunctions);
+    free(text);
+    if (!script) {
+        fprintf(stderr, "Failed to compile %s\n", file);
+        return -ENOMEM;
+    }
+    return run_script(script, file, cont_on_error, functions, nfunctions);
 }
@@ -15,9 +15,34 @@ struct parser_function {
 };
 int parse_file(FILE *file, int cont_on_error, struct parser_function *functions,
         int nfunctions);
+/**
+ * Run a script file. The script is compiled the first time it is seen,
+ * and run from its compiled form after that (see parser_set_cache_dir)
+ */
 int parse_filename(const char *file, int cont_on_error,
         struct parser_function *functions, int nfunctions);
 int parse_line(char *line, struct parser_function *functions, int nfunctions);
+/**
+ * Describe where the command currently being executed came from,
+ * in the form "file:line"
+ */
+const char *parser_location(void);
+/**
+ * Get the location of the first command which failed, or "" if none have
+ */
+const char *parser_error_location(void);
+/**
+ * Prefix the commands echoed by this thread with a name (ie: the device
+ * the commands are being run on), or NULL for no prefix
+ */
+void parser_set_prefix(const char *prefix);
+/**
+ * Keep compiled scripts in a directory, so that later runs don't need to
+ * compile them again. The directory is created if it doesn't exist.
+ * NULL or "" keeps them in memory only. Must be set before any scripts
+ * are run
+ */
+void parser_set_cache_dir(const char *dir);
 
 
 #endif